@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2020 Arm Limited. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+// Measures the PBKDF2-HMAC-SHA256 iteration rate of the kernels selected for this CPU. Each
+// iteration costs two SHA256 compressions, so the compression rate is reported as well, to be
+// compared with the raw throughput of the block function.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <iostream>
+#include <string>
+
+#include "kdf/pbkdf2_sha256.h"
+
+namespace {
+
+void Usage(const std::string& progname) {
+  std::cout << "Usage: " << progname << " [iterations [repetitions]]\n";
+  std::cout << "    iterations: PBKDF2 iteration count (c) per derivation, default 1000000\n";
+  std::cout << "    repetitions: number of timed derivations, the fastest is reported, default 5\n";
+}
+
+bool ParseCount(const char* str, uint64_t* value) {
+  char* end;
+  unsigned long long parsed = strtoull(str, &end, 10);
+  if (*str == '\0' || *end != '\0' || parsed == 0) return false;
+  *value = parsed;
+  return true;
+}
+
+// Checks the selected kernels against the PBKDF2-HMAC-SHA256 test vector of RFC 7914.
+void SelfTest() {
+  static const uint8_t kExpected[64] = {
+      0x4d, 0xdc, 0xd8, 0xf6, 0x0b, 0x98, 0xbe, 0x21, 0x83, 0x0c, 0xee, 0x5e, 0xf2, 0x27, 0x01,
+      0xf9, 0x64, 0x1a, 0x44, 0x18, 0xd0, 0x4c, 0x04, 0x14, 0xae, 0xff, 0x08, 0x87, 0x6b, 0x34,
+      0xab, 0x56, 0xa1, 0xd4, 0x25, 0xa1, 0x22, 0x58, 0x33, 0x54, 0x9a, 0xdb, 0x84, 0x1b, 0x51,
+      0xc9, 0xb3, 0x17, 0x6a, 0x27, 0x2b, 0xde, 0xbb, 0xa1, 0xd0, 0x78, 0x47, 0x8f, 0x62, 0xb3,
+      0x97, 0xf3, 0x3c, 0x8d};
+  HMAC_SHA256_CTX Phctx;
+  uint8_t output[64];
+  HMAC_SHA256_Init(&Phctx, "Password", 8);
+  key_derivation_function(&Phctx, reinterpret_cast<const uint8_t*>("NaCl"), 4, 80000, output,
+                          sizeof(output));
+  if (memcmp(output, kExpected, sizeof(output)) != 0) {
+    std::cerr << "Error: PBKDF2-HMAC-SHA256 self-test failed\n";
+    exit(1);
+  }
+}
+
+}
+
+int main(int argc, char** argv) {
+  uint64_t iterations = 1000000;
+  uint64_t repetitions = 5;
+
+  if (argc > 3 || (argc > 1 && !ParseCount(argv[1], &iterations)) ||
+      (argc > 2 && !ParseCount(argv[2], &repetitions))) {
+    Usage(argv[0]);
+    return 1;
+  }
+
+  SelectSHA256Transform();
+  SelectPBKDF2Lanes();
+  SelfTest();
+
+  HMAC_SHA256_CTX Phctx;
+  HMAC_SHA256_Init(&Phctx, "password", 8);
+  static const uint8_t kSalt[] = "benchmark salt";
+  // A single output block, so that the time is spent in the iteration loop.
+  uint8_t output[32];
+
+  double best_seconds = 0;
+  for (uint64_t i = 0; i < repetitions; ++i) {
+    auto start = std::chrono::steady_clock::now();
+    key_derivation_function(&Phctx, kSalt, sizeof(kSalt) - 1, iterations, output, sizeof(output));
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    if (i == 0 || elapsed.count() < best_seconds) best_seconds = elapsed.count();
+  }
+
+  const double iterations_per_second = iterations / best_seconds;
+  std::cout << "SHA256 block function: " << SHA256_Transform_name << "\n";
+  std::cout << "iterations: " << iterations << ", repetitions: " << repetitions << "\n";
+  std::cout << "best time: " << best_seconds * 1e3 << " ms\n";
+  std::cout << "iterations/s: " << static_cast<uint64_t>(iterations_per_second) << "\n";
+  std::cout << "compressions/s: " << static_cast<uint64_t>(2 * iterations_per_second) << "\n";
+  std::cout << "ns/compression: " << best_seconds * 1e9 / (2 * iterations) << "\n";
+
+  return 0;
+}
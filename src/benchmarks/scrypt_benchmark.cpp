@@ -0,0 +1,535 @@
+/*
+ * Copyright (c) 2020 Arm Limited. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+// Runs the scrypt key derivation pipeline (Node A -> Node B -> Node C) over a sweep of (N, r, p)
+// parameters, and reports for each of them the median and 99th percentile latency (per request to
+// Node A), the derivation rate, the number of compartment crossings per derivation and the peak
+// RSS. Requests may carry a batch of derivations (see KdfRequestType::kDeriveBatch), and may be made
+// by several client threads concurrently, each of them possibly keeping several requests in flight
+// (see compartment-manager/compartment_async.h). The results are written as JSON, and summarized on
+// stdout.
+//
+// This file is built in two flavours:
+// - compartment-benchmark (SCRYPT_BENCHMARK_COMPARTMENTS defined): acts as the compartment manager
+//   and loads the compute nodes as compartments, exactly like compartment-demo, in either
+//   topology (see ComputeNodeTopology). Morello only.
+// - scrypt_benchmark: links the compute nodes' code in-process (see
+//   compartments/compartment_in_process.h), so that the same kernels run without
+//   compartmentalization. Also builds and runs on the host.
+// The derivations are requested in the same way in both cases, so that comparing their results
+// gives the cost of compartmentalization. Both need COMPARTMENT_SWITCH_COUNTING, to count the
+// crossings.
+
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if !defined(COMPARTMENT_SWITCH_COUNTING)
+#error "COMPARTMENT_SWITCH_COUNTING must be defined, to count the compartment crossings"
+#endif
+
+#include <archcap.h>
+
+#include "compartment_interface.h"
+#include "compartment-manager/compartment_async.h"
+#include "compartments/protocol.h"
+
+#if defined(SCRYPT_BENCHMARK_COMPARTMENTS)
+#include "compartment-manager/compartment_config.h"
+#include "compartment-manager/compartment_manager.h"
+#else
+#include "compartments/compartment_in_process.h"
+
+DECLARE_IN_PROCESS_COMPARTMENT(compute_node_a_entry, compute_node_a_main);
+DECLARE_IN_PROCESS_COMPARTMENT(compute_node_b_entry, compute_node_b_main);
+DECLARE_IN_PROCESS_COMPARTMENT(compute_node_c_entry, compute_node_c_main);
+#endif
+
+namespace {
+
+struct SweepPoint {
+  uint64_t N;
+  uint32_t r;
+  uint32_t p;
+};
+
+// The default parameters, followed by variations of each of them.
+const SweepPoint kDefaultSweep[] = {
+  {kScryptDefaultN, kScryptDefaultR, kScryptDefaultP},
+  {1024, 8, 1},
+  {4096, 8, 1},
+  {32768, 8, 1},
+  {16384, 16, 1},
+  {16384, 8, 2},
+  {16384, 8, 4},
+};
+
+struct PointResult {
+  SweepPoint point;
+  double median_seconds;
+  double p99_seconds;
+  double derivations_per_second;
+  double crossings_per_derivation;
+  long peak_rss_kib;
+};
+
+#if defined(SCRYPT_BENCHMARK_COMPARTMENTS)
+
+const char* const kMode = "compartments";
+
+ComputeNodeTopology topology = ComputeNodeTopology::kSplit;
+
+bool SetupPipeline(const std::string& dirname) {
+  CompartmentManagerInit();
+  if (topology == ComputeNodeTopology::kFused) {
+    CompartmentAdd(kComputeNodeACompartmentId, dirname + "compartments/compute_node_fused", {},
+                   kCompartmentMemoryRangeLength);
+    return true;
+  }
+  CompartmentAdd(kComputeNodeACompartmentId, dirname + "compartments/compute_node_a", {},
+                 kCompartmentMemoryRangeLength);
+  CompartmentAdd(kComputeNodeBCompartmentId, dirname + "compartments/compute_node_b", {},
+                 kCompartmentMemoryRangeLength);
+  CompartmentAdd(kComputeNodeCCompartmentId, dirname + "compartments/compute_node_c", {},
+                 kCompartmentMemoryRangeLength);
+  // Node A always calls Node B, and Node B always calls Node C: spare them the ID lookups.
+  CompartmentGrantCallGate(kComputeNodeACompartmentId, kComputeNodeBCompartmentId);
+  CompartmentGrantCallGate(kComputeNodeBCompartmentId, kComputeNodeCCompartmentId);
+  return true;
+}
+
+const char* TopologyName() {
+  return topology == ComputeNodeTopology::kFused ? "fused" : "split";
+}
+
+uint64_t CrossingCount() {
+  return CompartmentManagerSwitchCount();
+}
+
+#else
+
+const char* const kMode = "in_process";
+
+bool SetupPipeline(const std::string&) {
+  return InProcessCompartmentAdd(kComputeNodeACompartmentId, "compute_node_a", compute_node_a_main,
+                                 compute_node_a_entry) &&
+         InProcessCompartmentAdd(kComputeNodeBCompartmentId, "compute_node_b", compute_node_b_main,
+                                 compute_node_b_entry) &&
+         InProcessCompartmentAdd(kComputeNodeCCompartmentId, "compute_node_c", compute_node_c_main,
+                                 compute_node_c_entry);
+}
+
+uint64_t CrossingCount() {
+  return InProcessCompartmentCallCount();
+}
+
+const char* TopologyName() {
+  return "in_process";
+}
+
+#endif
+
+void Usage(const std::string& progname) {
+#if defined(SCRYPT_BENCHMARK_COMPARTMENTS)
+  std::cout << "Usage: " << progname
+            << " [-n repetitions] [-b batch_size] [-j threads] [-q depth] [-o output]"
+               " [-t split|fused] [N,r,p ...]\n";
+  std::cout << "    -t: compute nodes topology (see compartment_config.h), default split\n";
+#else
+  std::cout << "Usage: " << progname
+            << " [-n repetitions] [-b batch_size] [-j threads] [-q depth] [-o output]"
+               " [N,r,p ...]\n";
+#endif
+  std::cout << "    -n: number of timed requests per parameter set and thread, default 20\n";
+  std::cout << "    -b: number of derivations per request (batch), default 1\n";
+  std::cout << "    -j: number of client threads making requests concurrently, default 1\n";
+  std::cout << "    -q: number of asynchronous requests each client thread keeps in flight, "
+               "default 1 (synchronous requests)\n";
+  std::cout << "    -o: JSON output file, default scrypt_benchmark.json\n";
+  std::cout << "    N,r,p: scrypt parameters to benchmark, default: a sweep around N=16384, r=8, "
+               "p=1\n";
+}
+
+bool ParseCount(const char* str, uint64_t* value) {
+  char* end;
+  unsigned long long parsed = strtoull(str, &end, 10);
+  if (*str == '\0' || *end != '\0' || parsed == 0) return false;
+  *value = parsed;
+  return true;
+}
+
+bool ParsePoint(const char* str, SweepPoint* point) {
+  unsigned long long N, r, p;
+  char trailing;
+  if (sscanf(str, "%llu,%llu,%llu%c", &N, &r, &p, &trailing) != 3 ||
+      !ScryptParametersValid(N, r, p))
+    return false;
+  *point = {N, static_cast<uint32_t>(r), static_cast<uint32_t>(p)};
+  return true;
+}
+
+// Asks Node A, through call (CompartmentCall() or CompartmentCallAsync() bound to Node A), to derive
+// a secret for each of the count inputs, in the same way as the client compartment does: with a
+// kDerive request if there is a single one, kDeriveBatch otherwise. statuses (count entries) is only
+// used in the latter case.
+template <typename CallFn>
+auto RequestDerive(CallFn call, const KDF_Inputs* inputs, Secret* secrets, KdfStatus* statuses,
+                   size_t count) {
+  const KDF_Inputs* __capability inputs_cap = archcap_c_ddc_cast(inputs);
+  inputs_cap = archcap_c_perms_set(inputs_cap, ARCHCAP_PERM_GLOBAL | ARCHCAP_PERM_LOAD);
+  Secret* __capability secrets_cap = archcap_c_ddc_cast(secrets);
+  secrets_cap = archcap_c_perms_set(secrets_cap, ARCHCAP_PERM_GLOBAL | ARCHCAP_PERM_STORE);
+
+  if (count == 1)
+    return call(KdfRequestType::kDerive, inputs_cap, secrets_cap);
+
+  KdfStatus* __capability statuses_cap = archcap_c_ddc_cast(statuses);
+  statuses_cap = archcap_c_perms_set(statuses_cap, ARCHCAP_PERM_GLOBAL | ARCHCAP_PERM_STORE);
+  return call(KdfRequestType::kDeriveBatch, inputs_cap, secrets_cap, count, statuses_cap);
+}
+
+// Whether a request made with RequestDerive() succeeded, given Node A's return value.
+bool DeriveSucceeded(uintcap_t ret, const KdfStatus* statuses, size_t count) {
+  if (ret != 0)
+    return false;
+  return count == 1 || std::all_of(statuses, statuses + count,
+                                   [](KdfStatus status) { return status == KdfStatus::kOk; });
+}
+
+bool Derive(const KDF_Inputs* inputs, Secret* secrets, size_t count) {
+  std::vector<KdfStatus> statuses(count);
+  auto call = [](auto... args) {
+    return CompartmentCall(kComputeNodeACompartmentId, AsUintcap(args)...);
+  };
+  return DeriveSucceeded(RequestDerive(call, inputs, secrets, statuses.data(), count),
+                         statuses.data(), count);
+}
+
+KDF_Inputs MakeInputs(const char* passwd, const char* salt, const SweepPoint& point) {
+  // The fields are fixed-size and need not be NUL-terminated.
+  KDF_Inputs inputs;
+  memset(&inputs, 0, sizeof(inputs));
+  memcpy(inputs.passwd, passwd, std::min(strlen(passwd), sizeof(inputs.passwd)));
+  memcpy(inputs.salt, salt, std::min(strlen(salt), sizeof(inputs.salt)));
+  inputs.N = point.N;
+  inputs.r = point.r;
+  inputs.p = point.p;
+  return inputs;
+}
+
+// Checks the pipeline against the scrypt test vector of RFC 7914 that fits in KDF_Inputs
+// (truncated to OUTPUT_BUFLEN bytes).
+bool SelfTest() {
+  static const uint8_t kExpected[16] = {
+      0xfd, 0xba, 0xbe, 0x1c, 0x9d, 0x34, 0x72, 0x00,
+      0x78, 0x56, 0xe7, 0x19, 0x0d, 0x01, 0xe9, 0xfe};
+  static_assert(sizeof(kExpected) == OUTPUT_BUFLEN, "");
+  KDF_Inputs inputs = MakeInputs("password", "NaCl", {1024, 8, 16});
+  Secret secret;
+  return Derive(&inputs, &secret, 1) &&
+         memcmp(secret.output, kExpected, sizeof(kExpected)) == 0;
+}
+
+// Nearest-rank percentile of sorted samples.
+double Percentile(const std::vector<double>& sorted, double fraction) {
+  size_t rank = static_cast<size_t>(fraction * sorted.size() + 0.999999);
+  return sorted[std::min(std::max<size_t>(rank, 1), sorted.size()) - 1];
+}
+
+long PeakRssKib() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  // Linux reports ru_maxrss in KiB.
+  return usage.ru_maxrss;
+}
+
+// Times repetitions requests of batch_size derivations each, on each of num_threads client threads.
+// With a queue_depth above 1, each thread makes asynchronous requests, keeping queue_depth of them
+// in flight, and the latency is measured from submission to completion. The derivation rate is
+// measured over the wall-clock time it takes all the threads to complete their requests.
+bool RunPoint(const SweepPoint& point, uint64_t repetitions, size_t batch_size, size_t num_threads,
+              size_t queue_depth, PointResult* result) {
+  std::vector<std::vector<double>> thread_latencies(num_threads);
+  std::atomic<bool> failed{false};
+
+  // The threads start their timed requests together, once all of them have warmed up.
+  std::mutex start_mutex;
+  std::condition_variable start_cv;
+  size_t warmed_up = 0;
+  std::chrono::steady_clock::time_point start_time;
+  uint64_t crossings_before = 0;
+
+  auto client = [&](size_t thread_index) {
+    std::vector<KDF_Inputs> inputs(batch_size, MakeInputs("benchmark", "benchmark salt", point));
+    std::vector<Secret> secrets(batch_size);
+
+    // Output buffers and submission time of each request in flight, indexed by completion tag.
+    struct InFlight {
+      std::vector<Secret> secrets;
+      std::vector<KdfStatus> statuses;
+      std::chrono::steady_clock::time_point start;
+    };
+    std::vector<InFlight> in_flight(queue_depth);
+    CompartmentCompletionQueue queue;
+    auto submit = [&](size_t tag) {
+      InFlight& request = in_flight[tag];
+      request.secrets.resize(batch_size);
+      request.statuses.resize(batch_size);
+      request.start = std::chrono::steady_clock::now();
+      auto call = [&](auto... args) {
+        return CompartmentCallAsync(&queue, tag, kComputeNodeACompartmentId, args...);
+      };
+      RequestDerive(call, inputs.data(), request.secrets.data(), request.statuses.data(),
+                    batch_size);
+    };
+
+    // Makes count requests, recording their latencies if latencies is not null.
+    auto run = [&](uint64_t count, std::vector<double>* latencies) {
+      if (queue_depth == 1) {
+        for (uint64_t i = 0; i < count && !failed; ++i) {
+          auto start = std::chrono::steady_clock::now();
+          bool ok = Derive(inputs.data(), secrets.data(), batch_size);
+          std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+          if (!ok)
+            failed = true;
+          if (latencies != nullptr)
+            latencies->push_back(elapsed.count());
+        }
+        return;
+      }
+
+      uint64_t submitted = 0;
+      for (; submitted < std::min<uint64_t>(queue_depth, count); ++submitted)
+        submit(submitted);
+      for (uint64_t completed = 0; completed < submitted; ++completed) {
+        CompartmentCompletion completion = queue.Wait();
+        const InFlight& request = in_flight[completion.tag];
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - request.start;
+        if (!DeriveSucceeded(completion.ret, request.statuses.data(), batch_size))
+          failed = true;
+        if (latencies != nullptr)
+          latencies->push_back(elapsed.count());
+        if (submitted < count && !failed) {
+          submit(completion.tag);
+          ++submitted;
+        }
+      }
+    };
+
+    // Warm up (Node B grows its scratch memory on the first derivation with new parameters, and
+    // each thread calling into the compute nodes has its own, including the asynchronous call
+    // workers).
+    run(queue_depth, nullptr);
+    {
+      std::unique_lock<std::mutex> lock(start_mutex);
+      if (++warmed_up == num_threads) {
+        crossings_before = CrossingCount();
+        start_time = std::chrono::steady_clock::now();
+        start_cv.notify_all();
+      } else {
+        start_cv.wait(lock, [&] { return warmed_up == num_threads; });
+      }
+    }
+
+    std::vector<double>& latencies = thread_latencies[thread_index];
+    latencies.reserve(repetitions);
+    run(repetitions, &latencies);
+  };
+
+  // The calling thread is one of the clients.
+  std::vector<std::thread> threads;
+  for (size_t t = 1; t < num_threads; ++t)
+    threads.emplace_back(client, t);
+  client(0);
+  for (std::thread& thread : threads)
+    thread.join();
+  std::chrono::duration<double> total_seconds = std::chrono::steady_clock::now() - start_time;
+  uint64_t crossings = CrossingCount() - crossings_before;
+  if (failed)
+    return false;
+
+  std::vector<double> latencies;
+  for (const std::vector<double>& thread_latency : thread_latencies)
+    latencies.insert(latencies.end(), thread_latency.begin(), thread_latency.end());
+  std::sort(latencies.begin(), latencies.end());
+
+  uint64_t derivations = num_threads * repetitions * batch_size;
+  result->point = point;
+  result->median_seconds = Percentile(latencies, 0.5);
+  result->p99_seconds = Percentile(latencies, 0.99);
+  result->derivations_per_second = derivations / total_seconds.count();
+  result->crossings_per_derivation = static_cast<double>(crossings) / derivations;
+  // Peak RSS of the whole process (including the compartments) so far, hence also an upper bound
+  // for the previous parameter sets.
+  result->peak_rss_kib = PeakRssKib();
+  return true;
+}
+
+void WriteJson(std::ostream& os, uint64_t repetitions, size_t batch_size, size_t num_threads,
+               size_t queue_depth, const std::vector<PointResult>& results) {
+  os << std::setprecision(9);
+  os << "{\n";
+  os << "  \"benchmark\": \"scrypt\",\n";
+  os << "  \"mode\": \"" << kMode << "\",\n";
+  os << "  \"topology\": \"" << TopologyName() << "\",\n";
+  os << "  \"repetitions\": " << repetitions << ",\n";
+  os << "  \"batch_size\": " << batch_size << ",\n";
+  os << "  \"threads\": " << num_threads << ",\n";
+  os << "  \"queue_depth\": " << queue_depth << ",\n";
+  os << "  \"results\": [";
+  for (size_t i = 0; i < results.size(); ++i) {
+    const PointResult& result = results[i];
+    os << (i == 0 ? "\n" : ",\n");
+    os << "    {\"N\": " << result.point.N << ", \"r\": " << result.point.r
+       << ", \"p\": " << result.point.p
+       << ", \"median_ms\": " << result.median_seconds * 1e3
+       << ", \"p99_ms\": " << result.p99_seconds * 1e3
+       << ", \"derivations_per_second\": " << result.derivations_per_second
+       << ", \"crossings_per_derivation\": " << result.crossings_per_derivation
+       << ", \"peak_rss_kib\": " << result.peak_rss_kib << "}";
+  }
+  os << "\n  ]\n";
+  os << "}\n";
+}
+
+}
+
+int main(int argc, char** argv) {
+  std::string progname{argv[0]};
+  uint64_t repetitions = 20;
+  uint64_t batch_size = 1;
+  uint64_t num_threads = 1;
+  uint64_t queue_depth = 1;
+  std::string output_path = "scrypt_benchmark.json";
+
+  int opt;
+  while ((opt = getopt(argc, argv, "b:hj:n:o:q:t:")) != -1) {
+    switch (opt) {
+      case 'b':
+        if (!ParseCount(optarg, &batch_size) || batch_size > kKdfMaxBatchSize) {
+          Usage(progname);
+          return 1;
+        }
+        break;
+      case 'j':
+        if (!ParseCount(optarg, &num_threads)) {
+          Usage(progname);
+          return 1;
+        }
+        break;
+      case 'n':
+        if (!ParseCount(optarg, &repetitions)) {
+          Usage(progname);
+          return 1;
+        }
+        break;
+      case 'o':
+        output_path = optarg;
+        break;
+      case 'q':
+        if (!ParseCount(optarg, &queue_depth)) {
+          Usage(progname);
+          return 1;
+        }
+        break;
+#if defined(SCRYPT_BENCHMARK_COMPARTMENTS)
+      case 't':
+        if (!ParseComputeNodeTopology(optarg, &topology)) {
+          Usage(progname);
+          return 1;
+        }
+        break;
+#endif
+      case 'h':
+        Usage(progname);
+        return 0;
+      default:
+        Usage(progname);
+        return 1;
+    }
+  }
+
+  std::vector<SweepPoint> sweep;
+  for (int i = optind; i < argc; ++i) {
+    SweepPoint point;
+    if (!ParsePoint(argv[i], &point)) {
+      std::cerr << "Error: invalid scrypt parameters " << argv[i] << "\n";
+      return 1;
+    }
+    sweep.push_back(point);
+  }
+  if (sweep.empty())
+    sweep.assign(std::begin(kDefaultSweep), std::end(kDefaultSweep));
+
+  // Get our dirname (see compartment-manager/main.cpp).
+  std::string dirname{progname};
+  size_t pos = dirname.find_last_of('/');
+  dirname.erase(pos == std::string::npos ? 0 : pos + 1);
+
+  if (!SetupPipeline(dirname)) {
+    std::cerr << "Error: failed to initialize the compute nodes\n";
+    return 1;
+  }
+  // Same as compartment-demo: KDF_LANE_THREADS sets the number of threads running the lanes.
+  CompartmentLendThreads(kComputeNodeACompartmentId, KdfLaneThreadsFromEnv() - 1,
+                         KdfRequestType::kLaneWorker);
+  if (!SelfTest()) {
+    std::cerr << "Error: scrypt self-test failed\n";
+    return 1;
+  }
+  // Each request in flight gets a worker of its own, and each worker its own contexts in the
+  // compute nodes.
+  if (queue_depth > 1)
+    CompartmentStartAsyncWorkers(kComputeNodeACompartmentId, num_threads * queue_depth);
+
+  std::vector<PointResult> results;
+  std::cout << "mode: " << kMode << ", topology: " << TopologyName()
+            << ", repetitions: " << repetitions << ", batch size: " << batch_size
+            << ", threads: " << num_threads << ", queue depth: " << queue_depth << "\n";
+  std::cout << "       N    r    p   median ms      p99 ms  derivations/s  crossings"
+               "  peak RSS KiB\n";
+  for (const SweepPoint& point : sweep) {
+    PointResult result;
+    if (!RunPoint(point, repetitions, batch_size, num_threads, queue_depth, &result)) {
+      std::cerr << "Error: derivation failed for N=" << point.N << " r=" << point.r
+                << " p=" << point.p << "\n";
+      return 1;
+    }
+    results.push_back(result);
+
+    std::cout << std::fixed << std::setprecision(3)
+              << std::setw(8) << point.N << std::setw(5) << point.r << std::setw(5) << point.p
+              << std::setw(12) << result.median_seconds * 1e3
+              << std::setw(12) << result.p99_seconds * 1e3
+              << std::setw(15) << std::setprecision(1) << result.derivations_per_second
+              << std::setw(11) << result.crossings_per_derivation
+              << std::setw(14) << result.peak_rss_kib << std::endl;
+  }
+
+  std::ofstream output{output_path};
+  WriteJson(output, repetitions, batch_size, num_threads, queue_depth, results);
+  if (!output) {
+    std::cerr << "Error: failed to write " << output_path << "\n";
+    return 1;
+  }
+  std::cout << "results written to " << output_path << "\n";
+
+  return 0;
+}
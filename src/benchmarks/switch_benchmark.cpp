@@ -0,0 +1,435 @@
+/*
+ * Copyright (c) 2020 Arm Limited. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+// Measures the round-trip cost of a compartment call, with trivial compartments (see
+// compartments/switch_target.cpp and compartments/switch_relay.cpp), for 0 to
+// kCompartmentCallMaxArgs arguments:
+// - indirect_call: a plain indirect function call, as the baseline.
+// - main_to_null: from the compartment manager to a compartment that returns straight away.
+// - main_to_echo_scalar / main_to_echo_capability: same, to a compartment that returns its first
+//   argument, with scalar or capability arguments.
+// - compartment_gate / compartment_id: from one compartment (the relay) to another (the null
+//   compartment), through a call gate or by ID. Timed in the relay compartment.
+// - nested: from the compartment manager to the relay, which calls the null compartment through
+//   its gate with the given number of arguments (the relay itself is called with 2 arguments).
+// Calls are timed in batches with the counter that CompartmentTraceTimestamp() reads. For each
+// case, the minimum, median and 99th percentile of the time per call over the batches are
+// reported, in ns, and in CPU cycles if the CPU frequency is known. The results are written as
+// JSON, and summarized on stdout.
+//
+// Like scrypt_benchmark.cpp, this file is built in two flavours: switch-benchmark
+// (SWITCH_BENCHMARK_COMPARTMENTS defined, Morello only) loads the trivial compartments, and
+// switch_benchmark_in_process links them in-process, which gives the cost of the in-process call
+// path (see compartments/compartment_in_process.h), and also builds and runs on the host.
+
+#include <getopt.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <archcap.h>
+
+#include "compartment_interface.h"
+#include "compartments/compartment_trace.h"
+#include "compartments/protocol.h"
+
+#if defined(SWITCH_BENCHMARK_COMPARTMENTS)
+#include "compartment-manager/compartment_config.h"
+#include "compartment-manager/compartment_manager.h"
+#else
+#include "compartments/compartment_in_process.h"
+
+DECLARE_IN_PROCESS_COMPARTMENT(switch_null_entry, switch_null_main);
+DECLARE_IN_PROCESS_COMPARTMENT(switch_echo_entry, switch_echo_main);
+DECLARE_IN_PROCESS_COMPARTMENT(switch_relay_entry, switch_relay_main);
+#endif
+
+namespace {
+
+#if defined(SWITCH_BENCHMARK_COMPARTMENTS)
+
+const char* const kMode = "compartments";
+
+bool SetupCompartments(const std::string& dirname) {
+  CompartmentManagerInit();
+  CompartmentAdd(kSwitchNullCompartmentId, dirname + "compartments/switch_null", {},
+                 kCompartmentMemoryRangeLength);
+  CompartmentAdd(kSwitchEchoCompartmentId, dirname + "compartments/switch_echo", {},
+                 kCompartmentMemoryRangeLength);
+  CompartmentAdd(kSwitchRelayCompartmentId, dirname + "compartments/switch_relay", {},
+                 kCompartmentMemoryRangeLength);
+  CompartmentGrantCallGate(kSwitchRelayCompartmentId, kSwitchNullCompartmentId);
+  return true;
+}
+
+#else
+
+const char* const kMode = "in_process";
+
+bool SetupCompartments(const std::string&) {
+  return InProcessCompartmentAdd(kSwitchNullCompartmentId, "switch_null", switch_null_main,
+                                 switch_null_entry) &&
+         InProcessCompartmentAdd(kSwitchEchoCompartmentId, "switch_echo", switch_echo_main,
+                                 switch_echo_entry) &&
+         InProcessCompartmentAdd(kSwitchRelayCompartmentId, "switch_relay", switch_relay_main,
+                                 switch_relay_entry);
+}
+
+#endif
+
+struct Settings {
+  size_t num_samples = 1000;
+  size_t batch = 100;
+  // CPU frequency used to convert times to cycles, 0 if unknown.
+  double cpu_mhz = 0;
+  // Counter frequency, calibrated against the steady clock.
+  double ticks_per_ns = 0;
+};
+
+struct CaseResult {
+  std::string scenario;
+  size_t nargs;
+  double min_ns;
+  double median_ns;
+  double p99_ns;
+};
+
+// Written to after each batch, so that the compiler cannot discard the calls' results.
+volatile uintcap_t benchmark_sink;
+
+// Callee of the indirect_call baseline. Returns its first argument, like the echo compartment.
+template <typename... Args>
+__attribute__((noinline)) uintcap_t IndirectCallee(Args... args) {
+  uintcap_t values[] = {0, AsUintcap(args)...};
+  return values[sizeof...(Args) == 0 ? 0 : 1];
+}
+
+// Calls fn with the first sizeof...(I) values.
+template <typename Fn, typename T, size_t... I>
+uintcap_t CallWithArgs(const Fn& fn, const T* values, std::index_sequence<I...>) {
+  return fn(values[I]...);
+}
+
+// Calls body(std::make_index_sequence<nargs>()), so that body is instantiated for each number of
+// arguments and its timed loop does not depend on nargs.
+template <typename Body>
+void ForArgCount(size_t nargs, const Body& body) {
+  switch (nargs) {
+    case 0: body(std::make_index_sequence<0>()); break;
+    case 1: body(std::make_index_sequence<1>()); break;
+    case 2: body(std::make_index_sequence<2>()); break;
+    case 3: body(std::make_index_sequence<3>()); break;
+    case 4: body(std::make_index_sequence<4>()); break;
+    case 5: body(std::make_index_sequence<5>()); break;
+    case 6: body(std::make_index_sequence<6>()); break;
+    default: abort();
+  }
+}
+
+// Nearest-rank percentile of sorted samples.
+double Percentile(const std::vector<double>& sorted, double fraction) {
+  size_t rank = static_cast<size_t>(fraction * sorted.size() + 0.999999);
+  return sorted[std::min(std::max<size_t>(rank, 1), sorted.size()) - 1];
+}
+
+// batch_ticks holds the duration of each batch.
+CaseResult MakeResult(const std::string& scenario, size_t nargs,
+                      const std::vector<uint64_t>& batch_ticks, const Settings& settings) {
+  std::vector<double> ns;
+  ns.reserve(batch_ticks.size());
+  for (uint64_t ticks : batch_ticks)
+    ns.push_back(ticks / settings.ticks_per_ns / settings.batch);
+  std::sort(ns.begin(), ns.end());
+  return {scenario, nargs, ns.front(), Percentile(ns, 0.5), Percentile(ns, 0.99)};
+}
+
+// Times batches of calls to call(), from the calling thread. Returns the duration of each batch.
+template <typename Fn>
+std::vector<uint64_t> TimeBatches(const Fn& call, const Settings& settings) {
+  std::vector<uint64_t> batch_ticks(settings.num_samples);
+  // Warm up (the first call into a compartment from a thread sets up the thread's context).
+  for (size_t j = 0; j < settings.batch; ++j)
+    benchmark_sink = call();
+
+  for (uint64_t& ticks : batch_ticks) {
+    uint64_t start = CompartmentTraceTimestamp();
+    uintcap_t ret = 0;
+    for (size_t j = 0; j < settings.batch; ++j)
+      ret = call();
+    ticks = CompartmentTraceTimestamp() - start;
+    benchmark_sink = ret;
+  }
+  return batch_ticks;
+}
+
+// Times calls to call(values[0], ..., values[nargs - 1]), from the calling thread.
+template <typename Fn, typename T>
+CaseResult TimeCalls(const std::string& scenario, size_t nargs, const Fn& call, const T* values,
+                     const Settings& settings) {
+  std::vector<uint64_t> batch_ticks;
+  ForArgCount(nargs, [&](auto args) {
+    batch_ticks = TimeBatches([&] { return CallWithArgs(call, values, args); }, settings);
+  });
+  return MakeResult(scenario, nargs, batch_ticks, settings);
+}
+
+// Times calls from the relay compartment to the null compartment, in the relay.
+bool TimeRelayCalls(const std::string& scenario, size_t nargs, bool via_gate,
+                    const Settings& settings, CaseResult* result) {
+  std::vector<uint64_t> batch_ticks(settings.num_samples);
+  uint64_t* __capability samples_cap = archcap_c_ddc_cast(batch_ticks.data());
+  samples_cap = archcap_c_perms_set(samples_cap, ARCHCAP_PERM_GLOBAL | ARCHCAP_PERM_STORE);
+  // Warm up first, with a single sample.
+  for (size_t num_samples : {size_t{1}, settings.num_samples}) {
+    if (CompartmentCall(kSwitchRelayCompartmentId, AsUintcap(SwitchRelayRequestType::kMeasure),
+                        AsUintcap(samples_cap), AsUintcap(num_samples), AsUintcap(settings.batch),
+                        AsUintcap(nargs), AsUintcap(static_cast<size_t>(via_gate))) != 0)
+      return false;
+  }
+  *result = MakeResult(scenario, nargs, batch_ticks, settings);
+  return true;
+}
+
+// Checks that the echo compartment returns its first argument.
+bool CheckEcho(const uint64_t* scalars, const void* __capability const* caps) {
+  uintcap_t ret = CompartmentCall(kSwitchEchoCompartmentId, scalars[0]);
+  if (static_cast<uint64_t>(ret) != scalars[0])
+    return false;
+  ret = CompartmentCall(kSwitchEchoCompartmentId, caps[0]);
+  return archcap_c_tag_get(reinterpret_cast<void* __capability>(ret)) &&
+         static_cast<ptraddr_t>(ret) == archcap_c_address_get(caps[0]);
+}
+
+bool RunAll(const Settings& settings, std::vector<CaseResult>* results) {
+  const uint64_t scalars[kCompartmentCallMaxArgs] = {1, 2, 3, 4, 5, 6};
+  // Read-only capabilities to a local buffer, as a caller would pass.
+  static char buffer[kCompartmentCallMaxArgs][64];
+  const void* __capability caps[kCompartmentCallMaxArgs];
+  for (size_t i = 0; i < kCompartmentCallMaxArgs; ++i) {
+    const void* __capability cap = archcap_c_ddc_cast(static_cast<const void*>(buffer[i]));
+    cap = archcap_c_bounds_set(cap, sizeof(buffer[i]));
+    caps[i] = archcap_c_perms_set(cap, ARCHCAP_PERM_GLOBAL | ARCHCAP_PERM_LOAD);
+  }
+  if (!CheckEcho(scalars, caps)) {
+    std::cerr << "Error: the echo compartment did not return its argument\n";
+    return false;
+  }
+
+  auto indirect_call = [](auto... args) {
+    static uintcap_t (*volatile fn)(decltype(args)...) = IndirectCallee<decltype(args)...>;
+    return fn(args...);
+  };
+  auto call_null = [](auto... args) {
+    return CompartmentCall(kSwitchNullCompartmentId, args...);
+  };
+  auto call_echo = [](auto... args) {
+    return CompartmentCall(kSwitchEchoCompartmentId, args...);
+  };
+
+  for (size_t nargs = 0; nargs <= kCompartmentCallMaxArgs; ++nargs) {
+    results->push_back(TimeCalls("indirect_call", nargs, indirect_call, scalars, settings));
+    results->push_back(TimeCalls("main_to_null", nargs, call_null, scalars, settings));
+    if (nargs > 0) {
+      results->push_back(TimeCalls("main_to_echo_scalar", nargs, call_echo, scalars, settings));
+      results->push_back(TimeCalls("main_to_echo_capability", nargs, call_echo, caps, settings));
+    }
+
+    CaseResult result;
+    if (!TimeRelayCalls("compartment_gate", nargs, true, settings, &result))
+      return false;
+    results->push_back(result);
+    if (!TimeRelayCalls("compartment_id", nargs, false, settings, &result))
+      return false;
+    results->push_back(result);
+
+    // The relay itself is always called with the same number of arguments.
+    auto call_nested = [nargs] {
+      return CompartmentCall(kSwitchRelayCompartmentId,
+                             AsUintcap(SwitchRelayRequestType::kForward), AsUintcap(nargs));
+    };
+    results->push_back(MakeResult("nested", nargs, TimeBatches(call_nested, settings), settings));
+  }
+  return true;
+}
+
+// Counter ticks per ns, measured against the steady clock.
+double CalibrateTicks() {
+  auto start = std::chrono::steady_clock::now();
+  uint64_t start_ticks = CompartmentTraceTimestamp();
+  std::chrono::duration<double, std::nano> elapsed;
+  do {
+    elapsed = std::chrono::steady_clock::now() - start;
+  } while (elapsed.count() < 50e6);
+  return (CompartmentTraceTimestamp() - start_ticks) / elapsed.count();
+}
+
+// Maximum frequency of CPU 0, 0 if unknown.
+double ReadCpuMhz() {
+  std::ifstream is{"/sys/devices/system/cpu/cpu0/cpufreq/cpuinfo_max_freq"};
+  double khz = 0;
+  if (!(is >> khz))
+    return 0;
+  return khz / 1000;
+}
+
+void Usage(const std::string& progname) {
+  std::cout << "Usage: " << progname << " [-n samples] [-b batch] [-f cpu_mhz] [-o output]\n";
+  std::cout << "    -n: number of timed batches per case, default 1000\n";
+  std::cout << "    -b: number of calls per batch, default 100\n";
+  std::cout << "    -f: CPU frequency in MHz, to convert times to cycles, default: the maximum "
+               "frequency of CPU 0 (cpufreq), if available\n";
+  std::cout << "    -o: JSON output file, default switch_benchmark.json\n";
+}
+
+bool ParseCount(const char* str, uint64_t* value) {
+  char* end;
+  unsigned long long parsed = strtoull(str, &end, 10);
+  if (*str == '\0' || *end != '\0' || parsed == 0) return false;
+  *value = parsed;
+  return true;
+}
+
+void WriteJson(std::ostream& os, const Settings& settings,
+               const std::vector<CaseResult>& results) {
+  os << std::setprecision(9);
+  os << "{\n";
+  os << "  \"benchmark\": \"compartment_switch\",\n";
+  os << "  \"mode\": \"" << kMode << "\",\n";
+  os << "  \"samples\": " << settings.num_samples << ",\n";
+  os << "  \"batch\": " << settings.batch << ",\n";
+  os << "  \"ticks_per_ns\": " << settings.ticks_per_ns << ",\n";
+  os << "  \"cpu_mhz\": " << settings.cpu_mhz << ",\n";
+  os << "  \"results\": [";
+  for (size_t i = 0; i < results.size(); ++i) {
+    const CaseResult& result = results[i];
+    os << (i == 0 ? "\n" : ",\n");
+    os << "    {\"scenario\": \"" << result.scenario << "\", \"args\": " << result.nargs
+       << ", \"min_ns\": " << result.min_ns << ", \"median_ns\": " << result.median_ns
+       << ", \"p99_ns\": " << result.p99_ns;
+    if (settings.cpu_mhz != 0) {
+      double cycles_per_ns = settings.cpu_mhz / 1e3;
+      os << ", \"min_cycles\": " << result.min_ns * cycles_per_ns
+         << ", \"median_cycles\": " << result.median_ns * cycles_per_ns
+         << ", \"p99_cycles\": " << result.p99_ns * cycles_per_ns;
+    }
+    os << "}";
+  }
+  os << "\n  ]\n";
+  os << "}\n";
+}
+
+void PrintResult(std::ostream& os, const CaseResult& result, const Settings& settings) {
+  os << std::fixed << std::setprecision(1) << std::left << std::setw(26) << result.scenario
+     << std::right << std::setw(5) << result.nargs << std::setw(10) << result.min_ns
+     << std::setw(10) << result.median_ns << std::setw(10) << result.p99_ns;
+  if (settings.cpu_mhz != 0) {
+    double cycles_per_ns = settings.cpu_mhz / 1e3;
+    os << std::setprecision(0) << std::setw(10) << result.min_ns * cycles_per_ns
+       << std::setw(10) << result.median_ns * cycles_per_ns
+       << std::setw(10) << result.p99_ns * cycles_per_ns;
+  }
+  os << std::endl;
+}
+
+}
+
+int main(int argc, char** argv) {
+  std::string progname{argv[0]};
+  Settings settings;
+  settings.cpu_mhz = ReadCpuMhz();
+  std::string output_path = "switch_benchmark.json";
+
+  int opt;
+  uint64_t value;
+  while ((opt = getopt(argc, argv, "b:f:hn:o:")) != -1) {
+    switch (opt) {
+      case 'b':
+        if (!ParseCount(optarg, &value)) {
+          Usage(progname);
+          return 1;
+        }
+        settings.batch = value;
+        break;
+      case 'f':
+        if (!ParseCount(optarg, &value)) {
+          Usage(progname);
+          return 1;
+        }
+        settings.cpu_mhz = value;
+        break;
+      case 'n':
+        if (!ParseCount(optarg, &value) || value > kSwitchMaxSamples) {
+          Usage(progname);
+          return 1;
+        }
+        settings.num_samples = value;
+        break;
+      case 'o':
+        output_path = optarg;
+        break;
+      case 'h':
+        Usage(progname);
+        return 0;
+      default:
+        Usage(progname);
+        return 1;
+    }
+  }
+
+  // Get our dirname (see compartment-manager/main.cpp).
+  std::string dirname{progname};
+  size_t pos = dirname.find_last_of('/');
+  dirname.erase(pos == std::string::npos ? 0 : pos + 1);
+
+  if (!SetupCompartments(dirname)) {
+    std::cerr << "Error: failed to initialize the compartments\n";
+    return 1;
+  }
+  settings.ticks_per_ns = CalibrateTicks();
+
+  std::cout << "mode: " << kMode << ", samples: " << settings.num_samples
+            << ", batch: " << settings.batch << ", counter: " << std::setprecision(4)
+            << settings.ticks_per_ns * 1e3 << " MHz, CPU: ";
+  if (settings.cpu_mhz != 0)
+    std::cout << settings.cpu_mhz << " MHz\n";
+  else
+    std::cout << "unknown frequency (see -f)\n";
+
+  std::vector<CaseResult> results;
+  if (!RunAll(settings, &results)) {
+    std::cerr << "Error: a compartment call failed\n";
+    return 1;
+  }
+
+  std::cout << std::left << std::setw(26) << "scenario" << std::right << std::setw(5) << "args"
+            << std::setw(10) << "min ns" << std::setw(10) << "median ns" << std::setw(10)
+            << "p99 ns";
+  if (settings.cpu_mhz != 0) {
+    std::cout << std::setw(10) << "min cyc" << std::setw(10) << "med cyc" << std::setw(10)
+              << "p99 cyc";
+  }
+  std::cout << "\n";
+  for (const CaseResult& result : results)
+    PrintResult(std::cout, result, settings);
+
+  std::ofstream output{output_path};
+  WriteJson(output, settings, results);
+  if (!output) {
+    std::cerr << "Error: failed to write " << output_path << "\n";
+    return 1;
+  }
+  std::cout << "results written to " << output_path << "\n";
+
+  return 0;
+}
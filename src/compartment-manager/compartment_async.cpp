@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 2020 Arm Limited. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include "compartment_async.h"
+
+#include <stdlib.h>
+
+#include <iostream>
+#include <map>
+#include <thread>
+
+namespace {
+
+// Worker threads bound to a compartment, and the calls waiting for one of them.
+class WorkerPool {
+ public:
+  explicit WorkerPool(CompartmentId id)
+    : id_(id) {}
+
+  // Called with pools_mutex held.
+  void Grow(size_t num_workers) {
+    for (; num_workers_ < num_workers; ++num_workers_) {
+      // Workers run until the process exits, like the compartments they are bound to.
+      std::thread([this] { WorkerLoop(); }).detach();
+    }
+  }
+
+  void Submit(CompartmentAsyncCall call) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      calls_.push_back(std::move(call));
+    }
+    cv_.notify_one();
+  }
+
+ private:
+  void WorkerLoop() {
+    for (;;) {
+      CompartmentAsyncCall call;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this] { return !calls_.empty(); });
+        call = std::move(calls_.front());
+        calls_.pop_front();
+      }
+
+      uintcap_t ret = Call(call);
+      if (call.queue != nullptr)
+        call.queue->Push({call.tag, ret});
+      call.result.set_value(ret);
+    }
+  }
+
+  uintcap_t Call(const CompartmentAsyncCall& call) {
+    const uintcap_t* a = call.args;
+    switch (call.num_args) {
+      case 0:
+        return CompartmentCall(id_);
+      case 1:
+        return CompartmentCall(id_, a[0]);
+      case 2:
+        return CompartmentCall(id_, a[0], a[1]);
+      case 3:
+        return CompartmentCall(id_, a[0], a[1], a[2]);
+      case 4:
+        return CompartmentCall(id_, a[0], a[1], a[2], a[3]);
+      case 5:
+        return CompartmentCall(id_, a[0], a[1], a[2], a[3], a[4]);
+      default:
+        return CompartmentCall(id_, a[0], a[1], a[2], a[3], a[4], a[5]);
+    }
+  }
+
+  const CompartmentId id_;
+  size_t num_workers_ = 0;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<CompartmentAsyncCall> calls_;
+};
+
+// Indexed by compartment ID. Pools are never destroyed, as their workers keep using them.
+std::map<CompartmentId, WorkerPool*> pools;
+std::mutex pools_mutex;
+
+WorkerPool& GetPool(CompartmentId id, size_t min_workers) {
+  std::lock_guard<std::mutex> lock(pools_mutex);
+  WorkerPool*& pool = pools[id];
+  if (pool == nullptr)
+    pool = new WorkerPool(id);
+  pool->Grow(min_workers);
+  return *pool;
+}
+
+}
+
+CompartmentCompletion CompartmentCompletionQueue::Wait() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  cv_.wait(lock, [this] { return !completions_.empty(); });
+  CompartmentCompletion completion = completions_.front();
+  completions_.pop_front();
+  return completion;
+}
+
+bool CompartmentCompletionQueue::Poll(CompartmentCompletion* completion) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (completions_.empty())
+    return false;
+  *completion = completions_.front();
+  completions_.pop_front();
+  return true;
+}
+
+size_t CompartmentCompletionQueue::Drain(std::vector<CompartmentCompletion>* completions) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  size_t count = completions_.size();
+  completions->insert(completions->end(), completions_.begin(), completions_.end());
+  completions_.clear();
+  return count;
+}
+
+void CompartmentCompletionQueue::Push(const CompartmentCompletion& completion) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    completions_.push_back(completion);
+  }
+  cv_.notify_one();
+}
+
+std::future<uintcap_t> CompartmentSubmitAsync(CompartmentAsyncCall call) {
+  if (call.num_args > kCompartmentCallMaxArgs) {
+    std::cerr << "CompartmentCallAsync(): too many arguments\n";
+    abort();
+  }
+  std::future<uintcap_t> result = call.result.get_future();
+  GetPool(call.id, 1).Submit(std::move(call));
+  return result;
+}
+
+void CompartmentStartAsyncWorkers(CompartmentId id, size_t num_workers) {
+  GetPool(id, num_workers);
+}
@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2020 Arm Limited. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "compartment_interface.h"
+
+// Asynchronous compartment calls, made from the main executable. CompartmentCallAsync() queues the
+// call and returns straight away; the call is then made with CompartmentCall() by a worker thread
+// bound to the target compartment, so that independent calls overlap on different cores (each
+// worker has its own contexts in the compartments, see compartment_manager.h). The caller waits for
+// the result through the returned future, or through a completion queue it passes.
+//
+// This is built on CompartmentCall() only, so it works the same with in-process compartments (see
+// compartments/compartment_in_process.h). Only the main executable can make asynchronous calls:
+// the workers of a compartment would be threads created by it, and those cannot call other
+// compartments. Use CompartmentLendThreads() to give a compartment threads that can.
+
+// Result of an asynchronous call, identified by the tag passed to CompartmentCallAsync().
+struct CompartmentCompletion {
+  uint64_t tag;
+  uintcap_t ret;
+};
+
+// Queue of the completions of the asynchronous calls submitted with it, in completion order.
+// Must outlive these calls.
+class CompartmentCompletionQueue {
+ public:
+  // Blocks until a call has completed, and returns its completion.
+  CompartmentCompletion Wait();
+
+  // Returns the next completion in *completion if there is one, without blocking. Returns false
+  // otherwise.
+  bool Poll(CompartmentCompletion* completion);
+
+  // Appends all the available completions to completions, without blocking. Returns their number.
+  size_t Drain(std::vector<CompartmentCompletion>* completions);
+
+  // Called by the workers when a call completes.
+  void Push(const CompartmentCompletion& completion);
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<CompartmentCompletion> completions_;
+};
+
+// A queued asynchronous call. Use CompartmentCallAsync() rather than this directly.
+struct CompartmentAsyncCall {
+  CompartmentId id;
+  uintcap_t args[kCompartmentCallMaxArgs];
+  size_t num_args;
+  std::promise<uintcap_t> result;
+  // Optional.
+  CompartmentCompletionQueue* queue;
+  uint64_t tag;
+};
+
+std::future<uintcap_t> CompartmentSubmitAsync(CompartmentAsyncCall call);
+
+// Makes sure that at least num_workers worker threads are bound to the compartment. By default, a
+// compartment gets a single worker on its first asynchronous call. Each worker takes a context
+// (stack and TLS, plus whatever the compartment allocates per thread) in the compartment and in
+// those it calls, so the number of workers is bounded by the compartments' memory ranges.
+void CompartmentStartAsyncWorkers(CompartmentId id, size_t num_workers);
+
+// Same as CompartmentCall(), asynchronously. The arguments are passed as uintcap_t (see
+// AsUintcap()). The returned future holds the compartment's return value once the call completes.
+template <typename... Args>
+static inline std::future<uintcap_t> CompartmentCallAsync(CompartmentId id, Args... args) {
+  static_assert(sizeof...(Args) <= kCompartmentCallMaxArgs, "Too many compartment call arguments");
+  return CompartmentSubmitAsync({id, {AsUintcap(args)...}, sizeof...(Args), {}, nullptr, 0});
+}
+
+// Same as above, also pushing {tag, return value} to queue when the call completes.
+template <typename... Args>
+static inline std::future<uintcap_t> CompartmentCallAsync(CompartmentCompletionQueue* queue,
+                                                          uint64_t tag, CompartmentId id,
+                                                          Args... args) {
+  static_assert(sizeof...(Args) <= kCompartmentCallMaxArgs, "Too many compartment call arguments");
+  return CompartmentSubmitAsync({id, {AsUintcap(args)...}, sizeof...(Args), {}, queue, tag});
+}
+
+// Lends num_threads threads of the main executable to the compartment: each of them calls it with
+// args, and the call is not expected to return, the compartment keeping the thread to run work of
+// its own (see KdfRequestType::kLaneWorker). Unlike the threads that a compartment creates, these
+// can call other compartments.
+template <typename... Args>
+static inline void CompartmentLendThreads(CompartmentId id, size_t num_threads, Args... args) {
+  static_assert(sizeof...(Args) <= kCompartmentCallMaxArgs, "Too many compartment call arguments");
+  for (size_t i = 0; i < num_threads; ++i) {
+    // Lent threads run until the process exits, like the compartments they are lent to.
+    std::thread([=] { CompartmentCall(id, AsUintcap(args)...); }).detach();
+  }
+}
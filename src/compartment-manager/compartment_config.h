@@ -8,11 +8,39 @@
 
 #include <archcap.h>
 
+#include <string>
+
 // Default length of a compartment's memory range.
 constexpr size_t kCompartmentMemoryRangeLength = 256 * 1024 * 1024;
 
 constexpr size_t kCompartmentStackSize = 1024 * 1024;
 
+// Maximum number of compartments (including unused statically allocated IDs). Address space for
+// the descriptor table is reserved for that many descriptors, memory is only committed as the table
+// grows.
+constexpr size_t kMaxCompartments = 4096;
+
+// Trust topology of the compute nodes (scrypt key derivation), selected per deployment:
+// - split: Node A, Node B and Node C each run in their own compartment.
+// - fused: a single compartment (compute_node_fused) runs the code of all three nodes, only Node A's
+//   interface is a compartment boundary.
+enum class ComputeNodeTopology {
+  kSplit,
+  kFused,
+};
+
+static inline bool ParseComputeNodeTopology(const std::string& name,
+                                            ComputeNodeTopology* topology) {
+  if (name == "split") {
+    *topology = ComputeNodeTopology::kSplit;
+  } else if (name == "fused") {
+    *topology = ComputeNodeTopology::kFused;
+  } else {
+    return false;
+  }
+  return true;
+}
+
 // Environment variables propagated to the compartments.
 constexpr const char* kCompartmentPropagatedEnv[] = {
   "PATH",
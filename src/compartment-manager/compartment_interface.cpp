@@ -8,15 +8,18 @@
 
 #include <archcap.h>
 
-#include "compartment_interface_impl.h"
 #include "compartment_manager_asm.h"
 
-uintcap_t CompartmentCall(CompartmentId id,
-                          uintcap_t arg0, uintcap_t arg1, uintcap_t arg2,
-                          uintcap_t arg3, uintcap_t arg4, uintcap_t arg5) {
-  // CompartmentCallImpl() uses a capability function pointer to call CompartmentSwitch(), derive
-  // one from PCC. A capability branch is needed anyway, because CompartmentSwitch() returns to the
-  // caller using CLR.
-  return CompartmentCallImpl(id, arg0, arg1, arg2, arg3, arg4, arg5,
-                             archcap_c_from_pcc(&CompartmentSwitch));
+// CompartmentCall() uses capability function pointers to call the switch stubs, derive them from
+// PCC. A capability branch is needed anyway, because the stubs return to the caller using CLR.
+extern "C" {
+void* __capability COMPARTMENT_MANAGER_CALL_CAPABILITY_SYMBOL[kCompartmentCallMaxArgs + 1] = {
+  archcap_c_from_pcc(reinterpret_cast<void*>(&CompartmentSwitch0)),
+  archcap_c_from_pcc(reinterpret_cast<void*>(&CompartmentSwitch1)),
+  archcap_c_from_pcc(reinterpret_cast<void*>(&CompartmentSwitch2)),
+  archcap_c_from_pcc(reinterpret_cast<void*>(&CompartmentSwitch3)),
+  archcap_c_from_pcc(reinterpret_cast<void*>(&CompartmentSwitch4)),
+  archcap_c_from_pcc(reinterpret_cast<void*>(&CompartmentSwitch5)),
+  archcap_c_from_pcc(reinterpret_cast<void*>(&CompartmentSwitch6)),
+};
 }
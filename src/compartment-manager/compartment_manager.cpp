@@ -16,19 +16,42 @@
 #include <sys/random.h>
 
 #include <algorithm>
+#include <atomic>
 #include <fstream>
 #include <iostream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <vector>
 
 #include <archcap.h>
 
 #include "compartment_manager_asm.h"
 #include "compartment_config.h"
+#include "compartment_profile.h"
+#include "compartments/compartment_channel.h"
+#include "compartments/compartment_trace.h"
+#include "utils/align.h"
 #include "utils/elf_util.h"
 
-// This is accessed from assembly.
+// These are accessed from assembly.
 extern "C" {
-  Compartment cm_compartments[MAX_COMPARTMENTS];
+  // Descriptor table, indexed by compartment ID. Address space is reserved for kMaxCompartments
+  // descriptors at initialization, so the table never moves as it grows.
+  Compartment* cm_compartments;
+  // Size of the descriptor table: IDs below it are accepted by CompartmentSwitch. Descriptors of
+  // IDs that are not allocated stay zeroed, and are rejected by their invalid entry point.
+  size_t cm_compartment_count;
+#if defined(COMPARTMENT_SWITCH_COUNTING)
+  uint64_t cm_switch_count;
+#endif
+
+  thread_local ThreadCompartmentContext* cm_thread_contexts;
+
+#if defined(COMPARTMENT_PROFILING)
+  thread_local CompartmentId cm_thread_current_compartment = kCompartmentProfileMainCaller;
+#endif
 }
 
 namespace {
@@ -66,6 +89,13 @@ class Capability {
     return *this;
   }
 
+  // Seals the capability as a load pair and branch sentry: it can then only be used by LDPBLR,
+  // which loads the pair of capabilities it points to and branches to the second one.
+  Capability& SealLoadPairBranch() {
+    asm("seal %0, %0, lpb" : "+C"(cap_));
+    return *this;
+  }
+
   operator void* __capability() const {
     return cap_;
   }
@@ -83,6 +113,69 @@ constexpr archcap_perms_t kCompartmentManagerEntryPointPerms =
 // compartment is mapped).
 ptraddr_t cm_lowest_address;
 
+// Trace ring of a compartment (see compartments/compartment_trace.h).
+struct TraceState {
+  const CompartmentTraceRing* ring = nullptr;
+  // Range of the compartment's image, where event messages must lie.
+  Range image_range = Range::kEmpty;
+  // Number of events already printed.
+  uint64_t drained = 0;
+};
+
+// Indexed by compartment ID, same size as the descriptor table.
+std::vector<TraceState> cm_traces;
+
+// Call gate tables of the compartments (COMPARTMENT_CALL_GATES_SYMBOL), indexed by compartment ID.
+using CallGates = void* __capability[kFirstDynamicCompartmentId][kCompartmentCallMaxArgs + 1];
+std::vector<CallGates*> cm_call_gate_tables;
+
+// Channel tables of the compartments (COMPARTMENT_CHANNELS_SYMBOL), indexed by compartment ID.
+using ChannelTable = void* __capability[kMaxCompartmentChannels];
+std::vector<ChannelTable*> cm_channel_tables;
+
+// Targets of the call gates, indexed by callee ID and number of arguments. Shared by all the
+// callers of a compartment. Compartments only get sealed capabilities to them.
+CallGatePair cm_call_gate_pairs[kFirstDynamicCompartmentId][kCompartmentCallMaxArgs + 1];
+
+// Thread contexts of a compartment (see compartments/compartment_threads.cpp).
+struct CompartmentThreads {
+  // Range reserved for the compartment, where the contexts' stacks and TLS must lie.
+  Range range = Range::kEmpty;
+  // Context the compartment was initialized on. Only used, under cm_mutex, to initialize the
+  // compartment and to create new contexts.
+  ThreadCompartmentContext main_context = {};
+  // Descriptor of COMPARTMENT_NEW_THREAD_CONTEXT_SYMBOL, run on main_context.
+  Compartment new_context_desc = {};
+  ptraddr_t* context_sp = nullptr;
+  ptraddr_t* context_tp = nullptr;
+  // Contexts released by threads that exited, to be reused by new threads. A context's compartment
+  // thread never exits, so contexts are never destroyed.
+  std::vector<ThreadCompartmentContext> free_contexts;
+};
+
+// Indexed by compartment ID, same size as the descriptor table.
+std::vector<std::unique_ptr<CompartmentThreads>> cm_threads;
+
+// Serializes the changes to the compartment manager's state: adding compartments, granting call
+// gates, setting up thread contexts and draining traces. Recursive, because setting up a context may
+// happen while a compartment is initializing (if it calls another compartment).
+std::recursive_mutex cm_mutex;
+
+// Bytes of the descriptor table that are backed by read-write memory.
+size_t cm_compartments_committed;
+
+// Next ID to allocate when a compartment is added without specifying one.
+CompartmentId cm_next_dynamic_id = kFirstDynamicCompartmentId;
+
+// Memory range reserved for a compartment.
+struct ReservedRange {
+  Range range;
+  CompartmentId id;
+};
+
+// Reserved ranges, indexed by base address. They do not intersect each other.
+std::map<ptraddr_t, ReservedRange> cm_reserved_ranges;
+
 // Assumption used during the stack size calculation.
 static_assert(sizeof(Elf64_auxv_t) == 16, "");
 
@@ -90,7 +183,7 @@ static_assert(sizeof(Elf64_auxv_t) == 16, "");
 // named name, or nullptr if it doesn't exist.
 const char* GetFullEnvString(const char* name) {
   size_t name_len = strlen(name);
-  for (char** env = environ; env != nullptr; ++env) {
+  for (char** env = environ; *env != nullptr; ++env) {
     const char* str = *env;
     if (strncmp(str, name, name_len) == 0 && str[name_len] == '=')
       return str;
@@ -119,23 +212,46 @@ bool IsRangeFree(Range range) {
     return false;
   }
 
-  for (const Compartment& comp : cm_compartments) {
-    // Ignore this compartment if it hasn't been initialised.
-    if (!archcap_c_tag_get(comp.entry_point))
-      continue;
-
-    // Infer the compartment's range from its DDC.
-    Range comp_range{archcap_c_base_get(comp.ddc), archcap_c_limit_get(comp.ddc)};
-
-    if (comp_range.Intersects(range)) {
-      std::cerr << "Range " << range << " clashes with already allocated compartment's range "
-                << comp_range << "\n";
+  // Since the reserved ranges are disjoint, only the one with the highest base below range.top may
+  // intersect range.
+  auto next = cm_reserved_ranges.lower_bound(range.top);
+  if (next != cm_reserved_ranges.begin()) {
+    const ReservedRange& prev = std::prev(next)->second;
+    if (prev.range.Intersects(range)) {
+      std::cerr << "Range " << range << " clashes with the range of compartment " << std::dec
+                << prev.id << " " << prev.range << "\n";
       return false;
     }
   }
   return true;
 }
 
+// Grows the descriptor table to include id, committing memory for it as needed.
+void GrowCompartmentTable(CompartmentId id) {
+  if (id < cm_compartment_count)
+    return;
+
+  size_t required = (id + 1) * sizeof(Compartment);
+  if (required > cm_compartments_committed) {
+    size_t committed = align_up(required, static_cast<size_t>(sysconf(_SC_PAGESIZE)));
+    char* table = reinterpret_cast<char*>(cm_compartments);
+    if (mprotect(table + cm_compartments_committed, committed - cm_compartments_committed,
+                 PROT_READ | PROT_WRITE) != 0) {
+      perror("mprotect() failed");
+      exit(1);
+    }
+    cm_compartments_committed = committed;
+  }
+
+  cm_traces.resize(id + 1);
+  cm_call_gate_tables.resize(id + 1);
+  cm_channel_tables.resize(id + 1);
+  cm_threads.resize(id + 1);
+  // The new descriptors are zeroed (invalid) until the compartment is set up, so they can be
+  // published straight away.
+  __atomic_store_n(&cm_compartment_count, id + 1, __ATOMIC_RELEASE);
+}
+
 bool SetupMappings(const StaticElfExecutable& elf, size_t memory_range_length, size_t stack_size,
                    void** stack_top, Range* mmap_range) {
   long page_size = sysconf(_SC_PAGESIZE);
@@ -251,6 +367,9 @@ bool SetupCompartmentStack(void** stack_top, size_t stack_size, const std::vecto
   set_auxval(AT_PHENT, exec.GetAuxval(AT_PHENT));
   set_auxval(AT_PHDR, exec.GetAuxval(AT_PHDR));
   set_auxval(AT_PAGESZ, getauxval(AT_PAGESZ));
+  // Forward the CPU feature bits, so that compartments can select optimised code paths at runtime.
+  set_auxval(AT_HWCAP, getauxval(AT_HWCAP));
+  set_auxval(AT_HWCAP2, getauxval(AT_HWCAP2));
 
   // Setup envp.
   const void* null = nullptr;
@@ -305,8 +424,154 @@ void* GetElfFunctionSymbol(const StaticElfExecutable& elf, const char* name) {
   return reinterpret_cast<void*>(sym);
 }
 
+const char* TraceLevelName(uint64_t level) {
+  switch (level) {
+    case COMPARTMENT_TRACE_LEVEL_ERROR:
+      return "E";
+    case COMPARTMENT_TRACE_LEVEL_INFO:
+      return "I";
+    case COMPARTMENT_TRACE_LEVEL_DEBUG:
+      return "D";
+    default:
+      return "?";
+  }
+}
+
+// The ring is written by the compartment, so nothing in it can be trusted: only print messages that
+// are NUL-terminated strings within the compartment's image.
+const char* TraceMessage(const TraceState& trace, const char* message) {
+  ptraddr_t addr = reinterpret_cast<ptraddr_t>(message);
+  if (!trace.image_range.Contains(addr))
+    return "<invalid message>";
+
+  size_t max_length = trace.image_range.top - addr;
+  if (strnlen(message, max_length) == max_length)
+    return "<invalid message>";
+
+  return message;
+}
+
+// Copies event index of the ring into *event. Returns false if the slot does not hold that event
+// completely: it is still being written, or has already been overwritten by a later event.
+bool ReadTraceEvent(const CompartmentTraceRing* ring, uint64_t index,
+                    CompartmentTraceEvent* event) {
+  const CompartmentTraceEvent& slot = ring->events[index & (kCompartmentTraceRingSize - 1)];
+  if (__atomic_load_n(&slot.sequence, __ATOMIC_ACQUIRE) != index + 1)
+    return false;
+
+  event->timestamp = __atomic_load_n(&slot.timestamp, __ATOMIC_RELAXED);
+  event->message = __atomic_load_n(&slot.message, __ATOMIC_RELAXED);
+  event->args[0] = __atomic_load_n(&slot.args[0], __ATOMIC_RELAXED);
+  event->args[1] = __atomic_load_n(&slot.args[1], __ATOMIC_RELAXED);
+  event->level = __atomic_load_n(&slot.level, __ATOMIC_RELAXED);
+
+  // Make sure that the slot was not rewritten while we were copying it.
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&slot.sequence, __ATOMIC_RELAXED) == index + 1;
+}
+
+void DrainTracesAtExit() {
+  CompartmentManagerDrainTraces(std::cerr);
+}
+
+// Whether the compartment has been added and initialized, i.e. can be called.
+bool IsCompartmentAdded(CompartmentId id) {
+  return id < cm_compartment_count && archcap_c_tag_get(cm_compartments[id].entry_point);
+}
+
+// Runs the compartment described by desc on context, returning its return value.
+uintcap_t EnterCompartment(const Compartment& desc, ThreadCompartmentContext* context) {
+  CompartmentEnterRequest request{&desc, context};
+  return CompartmentCallImpl<false>(
+      archcap_c_from_pcc(reinterpret_cast<void*>(&CompartmentEnter)),
+      reinterpret_cast<CompartmentId>(&request));
+}
+
+// Returns an unused context of the compartment, creating one if none is available.
+ThreadCompartmentContext NewThreadContext(CompartmentId id) {
+  CompartmentThreads& threads = *cm_threads[id];
+  if (!threads.free_contexts.empty()) {
+    ThreadCompartmentContext context = threads.free_contexts.back();
+    threads.free_contexts.pop_back();
+    return context;
+  }
+
+  if (EnterCompartment(threads.new_context_desc, &threads.main_context) != 0) {
+    std::cerr << "Compartment " << std::dec << id << " failed to create a thread context\n";
+    exit(1);
+  }
+
+  // The values come from the compartment: make sure that they are within its range.
+  ptraddr_t sp = *threads.context_sp;
+  ptraddr_t tp = *threads.context_tp;
+  if (!threads.range.Contains(sp) || !threads.range.Contains(tp) || (sp & 0xf) != 0) {
+    std::cerr << std::hex << "Invalid thread context returned by compartment " << std::dec << id
+              << std::hex << " (SP = " << sp << ", TPIDR = " << tp << ", range = " << threads.range
+              << ")\n";
+    exit(1);
+  }
+
+  // Like for the compartment's main context, null capabilities with the address set are all that
+  // hybrid code needs.
+  ThreadCompartmentContext context;
+  context.csp = archcap_c_address_set(static_cast<void* __capability>(nullptr),
+                                      reinterpret_cast<void*>(sp));
+  context.ctpidr = archcap_c_address_set(static_cast<void* __capability>(nullptr),
+                                         reinterpret_cast<void*>(tp));
+  return context;
+}
+
+// Owns the calling thread's cm_thread_contexts table, and returns its contexts to their
+// compartments when the thread exits.
+class ThreadContextTable {
+ public:
+  ~ThreadContextTable() {
+    if (cm_thread_contexts == nullptr)
+      return;
+
+    std::lock_guard<std::recursive_mutex> lock(cm_mutex);
+    for (CompartmentId id = 0; id < cm_compartment_count; ++id) {
+      if (archcap_c_address_get(cm_thread_contexts[id].csp) != 0)
+        cm_threads[id]->free_contexts.push_back(cm_thread_contexts[id]);
+    }
+    munmap(cm_thread_contexts, kMaxCompartments * sizeof(ThreadCompartmentContext));
+    cm_thread_contexts = nullptr;
+  }
+
+  // Allocates the table if the thread does not have one yet.
+  void Allocate() {
+    if (cm_thread_contexts != nullptr)
+      return;
+
+    // Only the pages of the compartments that the thread calls are ever touched.
+    void* table = mmap(nullptr, kMaxCompartments * sizeof(ThreadCompartmentContext),
+                       PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (table == MAP_FAILED) {
+      perror("mmap() failed");
+      exit(1);
+    }
+    cm_thread_contexts = static_cast<ThreadCompartmentContext*>(table);
+  }
+};
+
+thread_local ThreadContextTable thread_context_table;
+
 } // namespace
 
+extern "C" ThreadCompartmentContext* CompartmentGetThreadContext(CompartmentId id) {
+  std::lock_guard<std::recursive_mutex> lock(cm_mutex);
+  if (!IsCompartmentAdded(id)) {
+    std::cerr << "Compartment ID " << std::dec << id << " is invalid or not initialized\n";
+    exit(1);
+  }
+
+  thread_context_table.Allocate();
+  ThreadCompartmentContext& context = cm_thread_contexts[id];
+  if (archcap_c_address_get(context.csp) == 0)
+    context = NewThreadContext(id);
+  return &context;
+}
+
 
 void CompartmentManagerInit() {
   // Read /proc/self/maps to find the lowest mapped address.
@@ -320,13 +585,52 @@ void CompartmentManagerInit() {
     std::cerr << "Failed to read /proc/self/maps\n";
     exit(1);
   }
+
+  // Reserve the descriptor table's address space. Like the rest of the compartment manager's
+  // mappings, it ends up above cm_lowest_address, out of the compartments' reach.
+  void* table = mmap(nullptr, kMaxCompartments * sizeof(Compartment), PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (table == MAP_FAILED) {
+    perror("mmap() failed");
+    exit(1);
+  }
+  cm_compartments = static_cast<Compartment*>(table);
+
+  atexit(DrainTracesAtExit);
+  CompartmentProfileDumpAtExit();
+}
+
+#if defined(COMPARTMENT_SWITCH_COUNTING)
+uint64_t CompartmentManagerSwitchCount() {
+  return __atomic_load_n(&cm_switch_count, __ATOMIC_RELAXED);
 }
+#endif
 
-void CompartmentAdd(CompartmentId id, const std::string& path, const std::vector<std::string>& args,
-                    size_t memory_range_length) {
-  // Note: a proper implementation would need to check that the compartment ID isn't already
-  // allocated, or even better allocate it itself and return it to the caller.
-  assert(id < MAX_COMPARTMENTS);
+void CompartmentManagerDumpStats(std::ostream& os, CompartmentStatsFormat format) {
+  CompartmentProfileDump(os, format);
+}
+
+#if defined(COMPARTMENT_PROFILING)
+extern "C" void CompartmentProfileReturn(uint64_t start, uint64_t end, CompartmentId caller) {
+  CompartmentProfileRecord(caller, cm_thread_current_compartment, end - start);
+  cm_thread_current_compartment = caller;
+}
+#endif
+
+CompartmentId CompartmentAdd(const std::string& path, const std::vector<std::string>& args,
+                             size_t memory_range_length) {
+  std::lock_guard<std::recursive_mutex> lock(cm_mutex);
+  return CompartmentAdd(cm_next_dynamic_id++, path, args, memory_range_length);
+}
+
+CompartmentId CompartmentAdd(CompartmentId id, const std::string& path,
+                             const std::vector<std::string>& args, size_t memory_range_length) {
+  std::lock_guard<std::recursive_mutex> lock(cm_mutex);
+  if (id >= kMaxCompartments || IsCompartmentAdded(id) ||
+      (id < cm_threads.size() && cm_threads[id] != nullptr)) {
+    std::cerr << "Compartment ID " << std::dec << id << " is invalid or already allocated\n";
+    exit(1);
+  }
 
   // Step 1: process the compartment's ELF file.
   int fd = open(path.c_str(), O_RDONLY);
@@ -342,21 +646,42 @@ void CompartmentAdd(CompartmentId id, const std::string& path, const std::vector
   // Find the symbols we need.
   void* entry_point_sym = GetElfFunctionSymbol(elf, ___STRING(COMPARTMENT_ENTRY_SYMBOL));
 
-  void* __capability* cm_call_cap_sym = GetElfDataSymbol<void* __capability>(elf,
+  // One capability per switch stub.
+  using CallCapabilities = void* __capability[kCompartmentCallMaxArgs + 1];
+  CallCapabilities* cm_call_cap_sym = GetElfDataSymbol<CallCapabilities>(elf,
       ___STRING(COMPARTMENT_MANAGER_CALL_CAPABILITY_SYMBOL));
   void* __capability* cm_return_cap_sym = GetElfDataSymbol<void* __capability>(elf,
       ___STRING(COMPARTMENT_MANAGER_RETURN_CAPABILITY_SYMBOL));
 
+  CallGates* call_gates_sym = GetElfDataSymbol<CallGates>(elf,
+      ___STRING(COMPARTMENT_CALL_GATES_SYMBOL));
+  ChannelTable* channels_sym = GetElfDataSymbol<ChannelTable>(elf,
+      ___STRING(COMPARTMENT_CHANNELS_SYMBOL));
+
   ptraddr_t* mmap_range_base_sym = GetElfDataSymbol<ptraddr_t>(elf,
       ___STRING(COMPARTMENT_MMAP_RANGE_BASE_SYMBOL));
   ptraddr_t* mmap_range_top_sym = GetElfDataSymbol<ptraddr_t>(elf,
       ___STRING(COMPARTMENT_MMAP_RANGE_TOP_SYMBOL));
 
+  const CompartmentTraceRing* trace_ring_sym = GetElfDataSymbol<CompartmentTraceRing>(elf,
+      ___STRING(COMPARTMENT_TRACE_RING_SYMBOL));
+
+  void* new_thread_context_sym = GetElfFunctionSymbol(elf,
+      ___STRING(COMPARTMENT_NEW_THREAD_CONTEXT_SYMBOL));
+  ptraddr_t* thread_context_sp_sym = GetElfDataSymbol<ptraddr_t>(elf,
+      ___STRING(COMPARTMENT_THREAD_CONTEXT_SP_SYMBOL));
+  ptraddr_t* thread_context_tp_sym = GetElfDataSymbol<ptraddr_t>(elf,
+      ___STRING(COMPARTMENT_THREAD_CONTEXT_TP_SYMBOL));
+
   // Step 2: setup the compartment's memory mappings.
   void* stack_top;
   Range mmap_range;
   if (!SetupMappings(elf, memory_range_length, kCompartmentStackSize, &stack_top, &mmap_range))
     exit(1);
+  ptraddr_t range_base = elf.total_range().base;
+  cm_reserved_ranges[range_base] = {{range_base, range_base + memory_range_length}, id};
+
+  GrowCompartmentTable(id);
 
   std::vector<std::string> main_args = {path};
   main_args.reserve(args.size() + 1);
@@ -370,6 +695,17 @@ void CompartmentAdd(CompartmentId id, const std::string& path, const std::vector
   *mmap_range_base_sym = mmap_range.base;
   *mmap_range_top_sym = mmap_range.top;
 
+  cm_call_gate_tables[id] = call_gates_sym;
+  cm_channel_tables[id] = channels_sym;
+
+  TraceState& trace = cm_traces[id];
+  trace.ring = trace_ring_sym;
+  trace.image_range = elf.total_range();
+  trace.drained = 0;
+
+  size_t name_pos = path.find_last_of('/');
+  CompartmentProfileSetName(id, path.substr(name_pos == std::string::npos ? 0 : name_pos + 1));
+
   // Step 3: compute compartment capabilities.
   uintcap_t cm_ddc = archcap_c_ddc_get();
 
@@ -390,11 +726,24 @@ void CompartmentAdd(CompartmentId id, const std::string& path, const std::vector
   void* __capability init_entry_point = Capability(c_entry_point)
       .SetAddress(elf.entry_point());
 
+  // Thread context service. Same permissions and bounds as well.
+  void* __capability new_thread_context_entry_point = Capability(c_entry_point)
+      .SetAddress(new_thread_context_sym);
+
   // We only use hybrid code, so we only need to give the compartment a valid SP, not a valid
   // CSP. A null capability with the pointer set to SP is what we need here.
   void* __capability csp = nullptr;
   csp = archcap_c_address_set(csp, stack_top);
 
+  cm_threads[id] = std::make_unique<CompartmentThreads>();
+  CompartmentThreads& threads = *cm_threads[id];
+  threads.range = {range_base, range_base + memory_range_length};
+  threads.new_context_desc.ddc = ddc;
+  threads.new_context_desc.entry_point = new_thread_context_entry_point;
+  threads.new_context_desc.id = id;
+  threads.context_sp = thread_context_sp_sym;
+  threads.context_tp = thread_context_tp_sym;
+
   // Step 4: initialize the compartment.
 
   // Set the return entry point to allow the compartment to return once it's initialized.
@@ -406,35 +755,160 @@ void CompartmentAdd(CompartmentId id, const std::string& path, const std::vector
       .SetAddress(&CompartmentSwitchReturn)
       .SetPerms(kCompartmentManagerEntryPointPerms);
 
-  // Setup the compartment descriptor for CompartmentCall().
-  Compartment& desc = cm_compartments[id];
-  desc.csp = csp;
-  desc.ddc = ddc;
+  // The compartment is initialized through a descriptor of its own, outside of the table, so that
+  // it cannot be called until it is initialized.
+  Compartment init_desc;
+  init_desc.ddc = ddc;
+  init_desc.entry_point = init_entry_point;
+  init_desc.id = id;
+  // Ask the switch stub to update the context when the compartment returns, so that the new SP
+  // and TPIDR values are saved for the next time the main context is used.
+  init_desc.update_on_return = true;
+  threads.main_context.csp = csp;
   // During execve(), the kernel sets TPIDR to 0, so let's do the same.
-  desc.ctpidr = nullptr;
-  desc.entry_point = init_entry_point;
-  // Ask CompartmentSwitch to update the ambient capabilities when the compartment returns, so that
-  // the new SP and TPIDR values are saved for the next time the compartment is called.
-  desc.update_on_return = true;
+  threads.main_context.ctpidr = nullptr;
 
   // Call into the compartment to let it initialize itself.
-  CompartmentCall(id);
+  EnterCompartment(init_desc, &threads.main_context);
 
   // Make sure the compartment's new SP value is sane.
-  CheckSpWithinStackBounds(archcap_c_address_get(desc.csp), reinterpret_cast<ptraddr_t>(stack_top),
-                           kCompartmentStackSize);
+  CheckSpWithinStackBounds(archcap_c_address_get(threads.main_context.csp),
+                           reinterpret_cast<ptraddr_t>(stack_top), kCompartmentStackSize);
 
   // Step 5: finalize compartment configuration
 
-  // Update the compartment's entry point: set it up to call the function defined by the compartment
-  // as its entry point (COMPARTMENT_ENTRY_SYMBOL).
-  desc.entry_point = c_entry_point;
-  // Further calls to the compartment do not preserve its ambient capabilities when it returns.
+  // Setup the compartment descriptor for CompartmentCall(). Calls run on the calling thread's own
+  // context, and do not preserve its ambient capabilities when the compartment returns.
+  Compartment& desc = cm_compartments[id];
+  desc.ddc = ddc;
+  desc.id = id;
   desc.update_on_return = false;
+  // Publish the entry point last: it is what makes the compartment callable. The function defined
+  // by the compartment as its entry point (COMPARTMENT_ENTRY_SYMBOL) is called.
+  std::atomic_thread_fence(std::memory_order_release);
+  desc.entry_point = c_entry_point;
 
-  // Set the call entry point to allow the compartment to call the compartment manager.
+  // Set the call entry points to allow the compartment to call the compartment manager.
   // TODO: same as for cm_return_cap_sym
-  *cm_call_cap_sym = Capability(cm_ddc)
-      .SetAddress(&CompartmentSwitch)
-      .SetPerms(kCompartmentManagerEntryPointPerms);
+  for (size_t nargs = 0; nargs <= kCompartmentCallMaxArgs; ++nargs) {
+    (*cm_call_cap_sym)[nargs] = Capability(cm_ddc)
+        .SetAddress(kCompartmentSwitchStubs[nargs])
+        .SetPerms(kCompartmentManagerEntryPointPerms);
+  }
+
+  return id;
+}
+
+void CompartmentGrantCallGate(CompartmentId caller, CompartmentId callee) {
+  std::lock_guard<std::recursive_mutex> lock(cm_mutex);
+  if (callee >= kFirstDynamicCompartmentId || !IsCompartmentAdded(callee) ||
+      !IsCompartmentAdded(caller)) {
+    std::cerr << "Cannot grant a call gate from compartment " << std::dec << caller
+              << " to compartment " << callee << "\n";
+    exit(1);
+  }
+
+  uintcap_t cm_ddc = archcap_c_ddc_get();
+  for (size_t nargs = 0; nargs <= kCompartmentCallMaxArgs; ++nargs) {
+    // The descriptor capability is only ever held by the gate stub, which uses it as a pointer.
+    CallGatePair& pair = cm_call_gate_pairs[callee][nargs];
+    pair.descriptor = Capability(cm_ddc)
+        .SetBounds(&cm_compartments[callee], sizeof(Compartment))
+        .SetPerms(ARCHCAP_PERM_GLOBAL | ARCHCAP_PERM_LOAD);
+    pair.stub = Capability(cm_ddc)
+        .SetAddress(kCompartmentGateStubs[nargs])
+        .SetPerms(kCompartmentManagerEntryPointPerms);
+
+    // The caller can only branch through the gate, it cannot read the pair or modify the gate.
+    (*cm_call_gate_tables[caller])[callee][nargs] = Capability(cm_ddc)
+        .SetBounds(&pair, sizeof(pair))
+        .SetPerms(ARCHCAP_PERM_GLOBAL | ARCHCAP_PERM_LOAD | ARCHCAP_PERM_LOAD_CAP)
+        .SealLoadPairBranch();
+  }
+}
+
+void CompartmentConnectChannel(CompartmentId producer, CompartmentId consumer, size_t channel,
+                               size_t slot_size, size_t slot_count) {
+  std::lock_guard<std::recursive_mutex> lock(cm_mutex);
+  if (producer == consumer || !IsCompartmentAdded(producer) || !IsCompartmentAdded(consumer) ||
+      channel >= kMaxCompartmentChannels ||
+      archcap_c_tag_get((*cm_channel_tables[producer])[channel]) ||
+      archcap_c_tag_get((*cm_channel_tables[consumer])[channel])) {
+    std::cerr << "Cannot connect channel " << std::dec << channel << " from compartment "
+              << producer << " to compartment " << consumer << "\n";
+    exit(1);
+  }
+  if (slot_size == 0 || slot_count == 0 || (slot_count & (slot_count - 1)) != 0 ||
+      slot_count > (SIZE_MAX - sizeof(CompartmentChannelHeader)) / slot_size) {
+    std::cerr << "Invalid channel geometry (" << std::dec << slot_count << " slots of "
+              << slot_size << " B)\n";
+    exit(1);
+  }
+
+  // The region is mapped by the compartment manager, hence out of both compartments' ranges: they
+  // can only access it through the capabilities below.
+  size_t length = align_up(sizeof(CompartmentChannelHeader) + slot_size * slot_count,
+                           static_cast<size_t>(sysconf(_SC_PAGESIZE)));
+  void* region = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (region == MAP_FAILED) {
+    perror("mmap() failed");
+    exit(1);
+  }
+  CompartmentChannelHeader* header = static_cast<CompartmentChannelHeader*>(region);
+  header->slot_size = slot_size;
+  header->slot_count = slot_count;
+
+  // Data only: capabilities cannot be passed through a channel.
+  void* __capability region_cap = Capability(archcap_c_ddc_get())
+      .SetBounds(region, length)
+      .SetPerms(ARCHCAP_PERM_GLOBAL | ARCHCAP_PERM_LOAD | ARCHCAP_PERM_STORE);
+  ptraddr_t base = reinterpret_cast<ptraddr_t>(region);
+  if (archcap_c_base_get(region_cap) != base || archcap_c_limit_get(region_cap) != base + length) {
+    std::cerr << "Channel region of " << std::dec << length << " B cannot be bounded exactly\n";
+    exit(1);
+  }
+
+  (*cm_channel_tables[producer])[channel] = region_cap;
+  (*cm_channel_tables[consumer])[channel] = region_cap;
+}
+
+void CompartmentDrainTrace(CompartmentId id, std::ostream& os) {
+  std::lock_guard<std::recursive_mutex> lock(cm_mutex);
+  assert(id < cm_traces.size());
+
+  TraceState& trace = cm_traces[id];
+  if (trace.ring == nullptr)
+    return;
+
+  // head only bounds the events to read: each event is published by its own sequence number.
+  uint64_t head = __atomic_load_n(&trace.ring->head, __ATOMIC_RELAXED);
+  if (head < trace.drained)
+    trace.drained = head;
+  if (head - trace.drained > kCompartmentTraceRingSize) {
+    os << "[Compartment " << std::dec << id << "] " << head - trace.drained - kCompartmentTraceRingSize
+       << " trace events lost\n";
+    trace.drained = head - kCompartmentTraceRingSize;
+  }
+
+  uint64_t skipped = 0;
+  for (; trace.drained < head; ++trace.drained) {
+    CompartmentTraceEvent event;
+    if (!ReadTraceEvent(trace.ring, trace.drained, &event)) {
+      ++skipped;
+      continue;
+    }
+    os << "[Compartment " << std::dec << id << "] " << event.timestamp << " "
+       << TraceLevelName(event.level) << " " << TraceMessage(trace, event.message) << " "
+       << event.args[0] << " " << event.args[1] << "\n";
+  }
+  if (skipped != 0) {
+    os << "[Compartment " << std::dec << id << "] " << skipped
+       << " trace events skipped (being written)\n";
+  }
+}
+
+void CompartmentManagerDrainTraces(std::ostream& os) {
+  std::lock_guard<std::recursive_mutex> lock(cm_mutex);
+  for (CompartmentId id = 0; id < cm_traces.size(); ++id)
+    CompartmentDrainTrace(id, os);
 }
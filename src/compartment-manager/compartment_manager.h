@@ -6,19 +6,73 @@
 
 #pragma once
 
+#include <stdint.h>
+#include <ostream>
 #include <string>
 #include <vector>
 
 #include "compartment_interface.h"
+#include "compartment_profile.h"
+
+// The functions below may be called from any thread of the compartment manager. Every thread can
+// call into compartments concurrently: the first time a thread calls a compartment, the compartment
+// manager gives it a context of its own in that compartment (stack and TLS, see
+// compartments/compartment_threads.cpp), which it uses for all its calls into the compartment. The
+// context is reused by another thread once the thread exits.
+// Threads created by compartments must not call into other compartments.
 
 void CompartmentManagerInit();
 
-// Add a compartment to the manager and initialize it (run it until main()).
+// Add a compartment to the manager and initialize it (run it until main()). Returns its ID.
 // Arguments:
-// - id: compartment ID, must be less than MAX_COMPARTMENTS and not allocated to an existing
-//       compartment.
+// - id: compartment ID, must be less than kMaxCompartments and not allocated to an existing
+//       compartment. Should be one of the statically allocated IDs (see compartment_interface.h).
 // - path: path to the compartment ELF file
 // - args: arguments to pass to the compartment when initializing it
 // - memory_range_length: size of the range reserved to the compartment
-void CompartmentAdd(CompartmentId id, const std::string& path, const std::vector<std::string>& args,
-                    size_t memory_range_length);
+CompartmentId CompartmentAdd(CompartmentId id, const std::string& path,
+                             const std::vector<std::string>& args, size_t memory_range_length);
+
+// Same as above, with an ID allocated by the compartment manager (from
+// kFirstDynamicCompartmentId onwards).
+CompartmentId CompartmentAdd(const std::string& path, const std::vector<std::string>& args,
+                             size_t memory_range_length);
+
+// Give the caller compartment a call gate to the callee compartment, which it can then call with
+// CompartmentCallThroughGate<callee>() (see compartment_interface.h). Both compartments must have
+// been added, and the callee must have a statically allocated ID. Gates stay valid as long as the
+// compartments exist.
+void CompartmentGrantCallGate(CompartmentId caller, CompartmentId callee);
+
+// Connect the producer compartment to the consumer compartment with a channel (see
+// compartments/compartment_channel.h): a ring of slot_count slots of slot_size bytes each, in a
+// region shared by both compartments. Each of them gets a capability to the region at index channel
+// of its channel table, which must be free. slot_count must be a power of 2. Channels stay valid as
+// long as the compartments exist.
+void CompartmentConnectChannel(CompartmentId producer, CompartmentId consumer, size_t channel,
+                               size_t slot_size, size_t slot_count);
+
+#if defined(COMPARTMENT_SWITCH_COUNTING)
+// Number of compartment switches (CompartmentCall()s, from the compartment manager or from
+// compartments, including those initializing compartments and setting up thread contexts) made so
+// far, by all threads. The counter is shared by all threads, so it is only maintained in builds
+// that define COMPARTMENT_SWITCH_COUNTING (for both the C++ code and the switch stubs), such as the
+// benchmarks.
+uint64_t CompartmentManagerSwitchCount();
+#endif
+
+// Write the compartment call profile recorded so far (calls, total and maximum round-trip time, and
+// latency histogram per (caller, callee) pair, see compartment_profile.h) to os. Profiling must be
+// compiled in with -DCOMPARTMENT_PROFILING. The profile can also be written at exit, by setting
+// COMPARTMENT_PROFILE_OUTPUT (see CompartmentProfileDumpAtExit()).
+void CompartmentManagerDumpStats(std::ostream& os,
+                                 CompartmentStatsFormat format = CompartmentStatsFormat::kText);
+
+// Print the events recorded in the compartment's trace ring since the last call (see
+// compartments/compartment_trace.h) to os. May be called while the compartment is running, on any
+// number of threads: events that are still being written are skipped. The rings of all
+// compartments are also drained to std::cerr at exit.
+void CompartmentDrainTrace(CompartmentId id, std::ostream& os);
+
+// Same as CompartmentDrainTrace(), for all compartments.
+void CompartmentManagerDrainTraces(std::ostream& os);
@@ -7,45 +7,156 @@
 #pragma once
 
 // Member offsets and size of the Compartment struct, to be used from assembly.
-#define COMPARTMENT_STRUCT_CSP_OFFSET                   0
-#define COMPARTMENT_STRUCT_CTPIDR_OFFSET                32
-#define COMPARTMENT_STRUCT_UPDATE_ON_RETURN_OFFSET      64
-#define COMPARTMENT_STRUCT_SIZE                         80
+#define COMPARTMENT_STRUCT_DDC_OFFSET                   0
+#define COMPARTMENT_STRUCT_ID_OFFSET                    32
+#define COMPARTMENT_STRUCT_UPDATE_ON_RETURN_OFFSET      40
+#define COMPARTMENT_STRUCT_SIZE_SHIFT                   6
+#define COMPARTMENT_STRUCT_SIZE                         (1 << COMPARTMENT_STRUCT_SIZE_SHIFT)
 
-#define MAX_COMPARTMENTS                                2
+// Member offsets and size of the ThreadCompartmentContext struct.
+#define THREAD_COMPARTMENT_CONTEXT_CSP_OFFSET           0
+#define THREAD_COMPARTMENT_CONTEXT_SIZE_SHIFT           5
+#define THREAD_COMPARTMENT_CONTEXT_SIZE                 (1 << THREAD_COMPARTMENT_CONTEXT_SIZE_SHIFT)
+
+// Layout of the context that the switch stubs save on the stack: the caller's Restricted
+// registers, CLR, and the context to update when the compartment returns (if any). With
+// COMPARTMENT_PROFILING, it is followed by the time of the switch and the caller's ID (see
+// CompartmentProfileReturn()).
+#define COMPARTMENT_FRAME_CSP_OFFSET                    0
+#define COMPARTMENT_FRAME_CTPIDR_OFFSET                 32
+#define COMPARTMENT_FRAME_CONTEXT_OFFSET                64
+#if defined(COMPARTMENT_PROFILING)
+#define COMPARTMENT_FRAME_PROFILE_START_OFFSET          80
+#define COMPARTMENT_FRAME_PROFILE_CALLER_OFFSET         88
+#define COMPARTMENT_FRAME_SIZE                          96
+#else
+#define COMPARTMENT_FRAME_SIZE                          80
+#endif
+
+#define CACHE_LINE_SIZE                                 64
 
 #ifndef __ASSEMBLY__
 
-struct Compartment {
-  void* __capability csp;
+// Compartment descriptor, shared by all the threads calling into the compartment. Its size is a
+// power of 2, so that descriptors can be indexed with a shift, and it fits in one cache line.
+struct alignas(CACHE_LINE_SIZE) Compartment {
   void* __capability ddc;
-  void* __capability ctpidr;
   void* __capability entry_point;
-  // If set to true, when the compartment returns, CompartmentSwitch saves the compartment's new
-  // register values (except PCC) to its descriptor.
+  CompartmentId id;
+  // If set to true, when the compartment returns, the switch stubs save the compartment's new SP
+  // and TPIDR values to the context it ran on.
   bool update_on_return;
 };
 
 // Make sure that the offsets and size match what the assembly implementation expects.
 // Members are loaded in pairs, so we make sure that every other member follows the member that
 // the assembly expects.
-static_assert(offsetof(Compartment, csp) ==
-              COMPARTMENT_STRUCT_CSP_OFFSET, "");
 static_assert(offsetof(Compartment, ddc) ==
-              COMPARTMENT_STRUCT_CSP_OFFSET + sizeof(void* __capability), "");
-static_assert(offsetof(Compartment, ctpidr) ==
-              COMPARTMENT_STRUCT_CTPIDR_OFFSET , "");
+              COMPARTMENT_STRUCT_DDC_OFFSET, "");
 static_assert(offsetof(Compartment, entry_point) ==
-              COMPARTMENT_STRUCT_CTPIDR_OFFSET + sizeof(void* __capability), "");
+              COMPARTMENT_STRUCT_DDC_OFFSET + sizeof(void* __capability), "");
+static_assert(offsetof(Compartment, id) ==
+              COMPARTMENT_STRUCT_ID_OFFSET, "");
 static_assert(offsetof(Compartment, update_on_return) ==
               COMPARTMENT_STRUCT_UPDATE_ON_RETURN_OFFSET, "");
 static_assert(sizeof(Compartment) == COMPARTMENT_STRUCT_SIZE, "");
+static_assert(sizeof(Compartment) == CACHE_LINE_SIZE, "");
+
+// State of a compartment that is specific to one thread of the compartment manager: each thread
+// calling into a compartment runs it on its own stack, with its own TLS.
+struct ThreadCompartmentContext {
+  void* __capability csp;
+  void* __capability ctpidr;
+};
+
+static_assert(offsetof(ThreadCompartmentContext, csp) ==
+              THREAD_COMPARTMENT_CONTEXT_CSP_OFFSET, "");
+static_assert(offsetof(ThreadCompartmentContext, ctpidr) ==
+              THREAD_COMPARTMENT_CONTEXT_CSP_OFFSET + sizeof(void* __capability), "");
+static_assert(sizeof(ThreadCompartmentContext) == THREAD_COMPARTMENT_CONTEXT_SIZE, "");
+
+// Request passed to CompartmentEnter, in place of the compartment ID.
+struct CompartmentEnterRequest {
+  const Compartment* desc;
+  ThreadCompartmentContext* context;
+};
+
+static_assert(offsetof(CompartmentEnterRequest, context) ==
+              offsetof(CompartmentEnterRequest, desc) + sizeof(void*), "");
 
 extern "C" {
-  void CompartmentSwitch(CompartmentId id, uintcap_t, uintcap_t, uintcap_t,
-                         uintcap_t, uintcap_t, uintcap_t);
+  // Table of the calling thread's contexts, indexed by compartment ID. Allocated on the thread's
+  // first compartment call, and looked up by the switch stubs.
+  extern thread_local ThreadCompartmentContext* cm_thread_contexts;
+
+  // Called by the switch stubs when the calling thread has no context for compartment id yet.
+  // Returns a pointer to the context in cm_thread_contexts, after setting it up. Exits if id is
+  // invalid.
+  ThreadCompartmentContext* CompartmentGetThreadContext(CompartmentId id);
+
+#if defined(COMPARTMENT_PROFILING)
+  // ID of the compartment that the calling thread is running, kCompartmentProfileMainCaller if none
+  // (see compartment_profile.h). Updated by the switch stubs, to know the caller of each call.
+  extern thread_local CompartmentId cm_thread_current_compartment;
+
+  // Called by the switch stubs when a compartment returns, with the times of the switch and of the
+  // return, and the ID of the caller, which becomes the current compartment again.
+  void CompartmentProfileReturn(uint64_t start, uint64_t end, CompartmentId caller);
+#endif
+}
+
+// Compartment switch stubs, one per number of arguments. They are not C functions: the target
+// compartment ID is passed in x9, and the arguments in c0 to c<n - 1> (see compartment_interface.h
+// and compartment_interface_impl.h).
+extern "C" {
+  void CompartmentSwitch0();
+  void CompartmentSwitch1();
+  void CompartmentSwitch2();
+  void CompartmentSwitch3();
+  void CompartmentSwitch4();
+  void CompartmentSwitch5();
+  void CompartmentSwitch6();
+
+  // Call gate stubs, one per number of arguments. They are reached through LDPBLR, with a
+  // capability to the callee's descriptor in c29 and the caller's FP in x9 (see
+  // CompartmentGrantCallGate() in compartment_manager.h).
+  void CompartmentGate0();
+  void CompartmentGate1();
+  void CompartmentGate2();
+  void CompartmentGate3();
+  void CompartmentGate4();
+  void CompartmentGate5();
+  void CompartmentGate6();
+
+  // Runs the compartment described by a CompartmentEnterRequest, whose address is passed in x9,
+  // on the requested context rather than the calling thread's. Only used by the compartment
+  // manager itself, for calls that are not made through the descriptor table.
+  void CompartmentEnter();
 
   void CompartmentSwitchReturn();
 };
 
+// Indexed by number of arguments.
+static void (* const kCompartmentSwitchStubs[])() = {
+  CompartmentSwitch0, CompartmentSwitch1, CompartmentSwitch2, CompartmentSwitch3,
+  CompartmentSwitch4, CompartmentSwitch5, CompartmentSwitch6,
+};
+static_assert(sizeof(kCompartmentSwitchStubs) / sizeof(kCompartmentSwitchStubs[0]) ==
+              kCompartmentCallMaxArgs + 1, "");
+
+// Indexed by number of arguments.
+static void (* const kCompartmentGateStubs[])() = {
+  CompartmentGate0, CompartmentGate1, CompartmentGate2, CompartmentGate3,
+  CompartmentGate4, CompartmentGate5, CompartmentGate6,
+};
+static_assert(sizeof(kCompartmentGateStubs) / sizeof(kCompartmentGateStubs[0]) ==
+              kCompartmentCallMaxArgs + 1, "");
+
+// Target of a call gate, laid out as LDPBLR expects: the capability loaded into c29 comes first,
+// then the capability branched to.
+struct CallGatePair {
+  void* __capability descriptor;
+  void* __capability stub;
+};
+
 #endif // __ASSEMBLY__
@@ -0,0 +1,226 @@
+/*
+ * Copyright (c) 2020 Arm Limited. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include "compartment_profile.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <vector>
+
+namespace {
+
+#if defined(COMPARTMENT_PROFILING)
+constexpr bool kProfilingEnabled = true;
+#else
+constexpr bool kProfilingEnabled = false;
+#endif
+
+// Counters of a (caller, callee) pair. Updated with atomic operations, as the same pair may be
+// recorded by several threads at a time.
+struct alignas(64) PairCounters {
+  // Caller and callee IDs, packed by PairKey(). 0 if the entry is free.
+  uint64_t key;
+  uint64_t calls;
+  uint64_t total_ticks;
+  uint64_t max_ticks;
+  uint64_t histogram[kCompartmentProfileBuckets];
+};
+
+// Open-addressing hash table of the pairs, so that recording a call takes no lock. Entries are
+// claimed on the first call of a pair and never freed. Must be a power of 2.
+constexpr size_t kMaxPairs = 1024;
+PairCounters pairs[kMaxPairs];
+// Calls that were not recorded because the table was full.
+uint64_t lost_calls;
+
+std::mutex names_mutex;
+std::map<CompartmentId, std::string> names;
+
+uint64_t PairKey(CompartmentId caller, CompartmentId callee) {
+  // IDs are less than kMaxCompartments, kCompartmentProfileMainCaller excepted. The key is never 0.
+  return (static_cast<uint64_t>(caller & 0xffffffff) << 32 | (callee & 0xffffffff)) + 1;
+}
+
+size_t Bucket(uint64_t ticks) {
+  size_t bucket = ticks == 0 ? 0 : 64 - __builtin_clzll(ticks);
+  return std::min(bucket, kCompartmentProfileBuckets - 1);
+}
+
+// Frequency of the counter, 0 if unknown.
+uint64_t TicksPerSecond() {
+#if defined(__aarch64__)
+  uint64_t freq;
+  asm volatile("mrs %0, cntfrq_el0" : "=r"(freq));
+  return freq;
+#else
+  // The TSC frequency is not architecturally discoverable.
+  return 0;
+#endif
+}
+
+std::string Name(CompartmentId id) {
+  if (id == kCompartmentProfileMainCaller)
+    return "main";
+  std::lock_guard<std::mutex> lock(names_mutex);
+  auto it = names.find(id);
+  return it != names.end() ? it->second : std::to_string(id);
+}
+
+// Copy of the pairs recorded so far, by decreasing total time. The copy is not atomic with respect
+// to concurrent calls, but each counter is.
+std::vector<PairCounters> SnapshotPairs() {
+  std::vector<PairCounters> snapshot;
+  for (PairCounters& entry : pairs) {
+    if (__atomic_load_n(&entry.key, __ATOMIC_ACQUIRE) == 0)
+      continue;
+    PairCounters copy;
+    copy.key = entry.key;
+    copy.calls = __atomic_load_n(&entry.calls, __ATOMIC_RELAXED);
+    copy.total_ticks = __atomic_load_n(&entry.total_ticks, __ATOMIC_RELAXED);
+    copy.max_ticks = __atomic_load_n(&entry.max_ticks, __ATOMIC_RELAXED);
+    for (size_t i = 0; i < kCompartmentProfileBuckets; ++i)
+      copy.histogram[i] = __atomic_load_n(&entry.histogram[i], __ATOMIC_RELAXED);
+    snapshot.push_back(copy);
+  }
+  std::sort(snapshot.begin(), snapshot.end(), [](const PairCounters& a, const PairCounters& b) {
+    return a.total_ticks > b.total_ticks;
+  });
+  return snapshot;
+}
+
+CompartmentId Caller(const PairCounters& entry) {
+  return (entry.key - 1) >> 32;
+}
+
+CompartmentId Callee(const PairCounters& entry) {
+  return (entry.key - 1) & 0xffffffff;
+}
+
+void DumpText(std::ostream& os) {
+  if (!kProfilingEnabled) {
+    os << "Compartment call profiling is compiled out (build with -DCOMPARTMENT_PROFILING)\n";
+    return;
+  }
+
+  os << "Compartment calls (round trip, in ticks";
+  if (uint64_t freq = TicksPerSecond())
+    os << " of " << std::dec << freq << " Hz";
+  os << "):\n";
+  os << "  caller -> callee                      calls    mean ticks     max ticks\n";
+  for (const PairCounters& entry : SnapshotPairs()) {
+    std::string pair = Name(Caller(entry)) + " -> " + Name(Callee(entry));
+    os << "  " << std::left << std::setw(32) << pair << std::right << std::dec
+       << std::setw(12) << entry.calls
+       << std::setw(14) << (entry.calls != 0 ? entry.total_ticks / entry.calls : 0)
+       << std::setw(14) << entry.max_ticks << "\n";
+    // Only the buckets that are not empty, as [lower bound in ticks]: count.
+    os << "    histogram:";
+    for (size_t i = 0; i < kCompartmentProfileBuckets; ++i) {
+      if (entry.histogram[i] != 0)
+        os << " [" << (i == 0 ? 0 : uint64_t{1} << (i - 1)) << "]: " << entry.histogram[i];
+    }
+    os << "\n";
+  }
+  if (uint64_t lost = __atomic_load_n(&lost_calls, __ATOMIC_RELAXED))
+    os << "  " << lost << " calls not recorded (too many pairs)\n";
+}
+
+void DumpJson(std::ostream& os) {
+  os << std::dec;
+  os << "{\n";
+  os << "  \"enabled\": " << (kProfilingEnabled ? "true" : "false") << ",\n";
+  os << "  \"ticks_per_second\": " << TicksPerSecond() << ",\n";
+  os << "  \"lost_calls\": " << __atomic_load_n(&lost_calls, __ATOMIC_RELAXED) << ",\n";
+  os << "  \"pairs\": [";
+  std::vector<PairCounters> snapshot = SnapshotPairs();
+  for (size_t i = 0; i < snapshot.size(); ++i) {
+    const PairCounters& entry = snapshot[i];
+    // Names are only made of path characters, nothing that needs escaping in practice.
+    os << (i == 0 ? "\n" : ",\n");
+    os << "    {\"caller\": \"" << Name(Caller(entry)) << "\", \"callee\": \""
+       << Name(Callee(entry)) << "\", \"calls\": " << entry.calls
+       << ", \"total_ticks\": " << entry.total_ticks << ", \"max_ticks\": " << entry.max_ticks
+       << ", \"histogram\": [";
+    for (size_t b = 0; b < kCompartmentProfileBuckets; ++b)
+      os << (b == 0 ? "" : ", ") << entry.histogram[b];
+    os << "]}";
+  }
+  os << "\n  ]\n";
+  os << "}\n";
+}
+
+void DumpAtExit() {
+  const char* output = getenv("COMPARTMENT_PROFILE_OUTPUT");
+  if (strcmp(output, "-") == 0) {
+    DumpText(std::cerr);
+    return;
+  }
+  std::ofstream os{output};
+  DumpJson(os);
+  if (!os)
+    std::cerr << "Failed to write the compartment call profile to " << output << "\n";
+}
+
+}
+
+void CompartmentProfileRecord(CompartmentId caller, CompartmentId callee, uint64_t ticks) {
+  uint64_t key = PairKey(caller, callee);
+  size_t index = (key * 0x9e3779b97f4a7c15) >> 54;
+  static_assert(kMaxPairs == size_t{1} << (64 - 54), "");
+
+  for (size_t probe = 0; probe < kMaxPairs; ++probe, index = (index + 1) & (kMaxPairs - 1)) {
+    PairCounters& entry = pairs[index];
+    uint64_t entry_key = __atomic_load_n(&entry.key, __ATOMIC_ACQUIRE);
+    if (entry_key == 0) {
+      // Claim the entry, unless another thread has just claimed it (possibly for the same pair).
+      uint64_t expected = 0;
+      if (__atomic_compare_exchange_n(&entry.key, &expected, key, false, __ATOMIC_ACQ_REL,
+                                      __ATOMIC_ACQUIRE))
+        entry_key = key;
+      else
+        entry_key = expected;
+    }
+    if (entry_key != key)
+      continue;
+
+    __atomic_fetch_add(&entry.calls, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&entry.total_ticks, ticks, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&entry.histogram[Bucket(ticks)], 1, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&entry.max_ticks, __ATOMIC_RELAXED);
+    while (ticks > max &&
+           !__atomic_compare_exchange_n(&entry.max_ticks, &max, ticks, true, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED)) {
+    }
+    return;
+  }
+  __atomic_fetch_add(&lost_calls, 1, __ATOMIC_RELAXED);
+}
+
+void CompartmentProfileSetName(CompartmentId id, const std::string& name) {
+  std::lock_guard<std::mutex> lock(names_mutex);
+  names[id] = name;
+}
+
+void CompartmentProfileDump(std::ostream& os, CompartmentStatsFormat format) {
+  if (format == CompartmentStatsFormat::kJson)
+    DumpJson(os);
+  else
+    DumpText(os);
+}
+
+void CompartmentProfileDumpAtExit() {
+  static std::once_flag registered;
+  if (!kProfilingEnabled || getenv("COMPARTMENT_PROFILE_OUTPUT") == nullptr)
+    return;
+  std::call_once(registered, [] { atexit(DumpAtExit); });
+}
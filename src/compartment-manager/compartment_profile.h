@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2020 Arm Limited. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <ostream>
+#include <string>
+
+#include "compartment_interface.h"
+
+// Profiling of compartment calls, per (caller, callee) pair: number of calls, total and maximum
+// round-trip time, and a histogram of the round-trip time on a log scale. Times are measured in
+// ticks of the counter read by CompartmentTraceTimestamp() (CNTVCT_EL0 on AArch64, the TSC on
+// x86-64), from just before switching to the callee to just after it returns, so they include the
+// callee's own calls.
+//
+// Profiling is compiled in with -DCOMPARTMENT_PROFILING, which must be passed both to the C++ code
+// and to the assembly of the switch stubs. The compartment manager then records every switch (see
+// compartment_manager_asm.S), as does the in-process implementation of CompartmentCall() (see
+// compartments/compartment_in_process.cpp). Otherwise, nothing is recorded, and the switch stubs
+// and their frames are the same as without this file.
+//
+// The counters are in the memory of the compartment manager (or of the executable calling
+// compartments in-process), out of the compartments' reach.
+
+// Caller ID of the calls made by the compartment manager itself (i.e. by the main executable).
+constexpr CompartmentId kCompartmentProfileMainCaller = 0xffffffff;
+
+// Bucket 0 of the histogram counts the calls that took 0 ticks, bucket i > 0 those that took
+// [2^(i - 1), 2^i) ticks. The last bucket also counts all the longer calls.
+constexpr size_t kCompartmentProfileBuckets = 40;
+
+enum class CompartmentStatsFormat {
+  kText,
+  kJson,
+};
+
+// Records a call from caller to callee that took ticks. Thread-safe and lock-free.
+void CompartmentProfileRecord(CompartmentId caller, CompartmentId callee, uint64_t ticks);
+
+// Names the compartment in the output of CompartmentProfileDump(), instead of its ID.
+void CompartmentProfileSetName(CompartmentId id, const std::string& name);
+
+// Writes the counters recorded so far to os, in the requested format. The pairs are sorted by total
+// time, in decreasing order.
+void CompartmentProfileDump(std::ostream& os, CompartmentStatsFormat format);
+
+// If the COMPARTMENT_PROFILE_OUTPUT environment variable is set, arranges for the counters to be
+// written at exit: as JSON to the file it names, or as text to stderr if it is "-". Does nothing
+// if profiling is compiled out.
+void CompartmentProfileDumpAtExit();
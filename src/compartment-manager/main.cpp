@@ -4,11 +4,14 @@
  * SPDX-License-Identifier: BSD-3-Clause
  */
 
+#include <getopt.h>
 #include <filesystem>
 #include <iostream>
 
+#include "compartment_async.h"
 #include "compartment_config.h"
 #include "compartment_manager.h"
+#include "compartments/protocol.h"
 
 namespace {
 
@@ -33,14 +36,20 @@ std::string DefaultComputeNodeCPath(const std::string& dirname) {
   return dirname + "compartments/compute_node_c";
 }
 
+std::string DefaultComputeNodeFusedPath(const std::string& dirname) {
+  return dirname + "compartments/compute_node_fused";
+}
+
 void Usage(const std::string& progname, const std::string& dirname) {
-  std::cout << "Usage: " << progname << " [client_path [server_path]]\n";
+  std::cout << "Usage: " << progname << " [-t split|fused] [client_path [server_path]]\n";
+  std::cout << "    -t, --topology: compute nodes topology (see compartment_config.h), default split\n";
   std::cout << "Default compartment paths (if not specified):\n";
   std::cout << "    client_path: " << DefaultClientPath(dirname) << "\n";
   std::cout << "    server_path: " << DefaultServerPath(dirname) << "\n";
   std::cout << "    compute_node_a_path: " << DefaultComputeNodeAPath(dirname) << "\n";
   std::cout << "    compute_node_b_path: " << DefaultComputeNodeBPath(dirname) << "\n";
   std::cout << "    compute_node_c_path: " << DefaultComputeNodeCPath(dirname) << "\n";
+  std::cout << "    compute_node_fused_path: " << DefaultComputeNodeFusedPath(dirname) << "\n";
 }
 
 }
@@ -60,32 +69,51 @@ int main(int argc, char** argv) {
   std::string compute_node_a_path = DefaultComputeNodeAPath(dirname);
   std::string compute_node_b_path = DefaultComputeNodeBPath(dirname);
   std::string compute_node_c_path = DefaultComputeNodeCPath(dirname);
+  std::string compute_node_fused_path = DefaultComputeNodeFusedPath(dirname);
+  ComputeNodeTopology topology = ComputeNodeTopology::kSplit;
+
+  static const struct option kLongOptions[] = {
+    {"help", no_argument, nullptr, 'h'},
+    {"topology", required_argument, nullptr, 't'},
+    {nullptr, 0, nullptr, 0},
+  };
+  int opt;
+  while ((opt = getopt_long(argc, argv, "ht:", kLongOptions, nullptr)) != -1) {
+    switch (opt) {
+      case 'h':
+        Usage(progname, dirname);
+        return 0;
+      case 't':
+        if (!ParseComputeNodeTopology(optarg, &topology)) {
+          std::cerr << "Error: unknown topology " << optarg << "\n";
+          return 1;
+        }
+        break;
+      default:
+        Usage(progname, dirname);
+        return 1;
+    }
+  }
 
-  switch (argc) {
-    case 3:
-      if (!std::filesystem::exists(argv[2])) {
-        std::cerr << "Error: " << argv[2] << " does not exist\n";
+  char** positional_args = argv + optind;
+  switch (argc - optind) {
+    case 2:
+      if (!std::filesystem::exists(positional_args[1])) {
+        std::cerr << "Error: " << positional_args[1] << " does not exist\n";
         return 1;
       }
-      server_path = argv[2];
+      server_path = positional_args[1];
 
       [[fallthrough]];
-    case 2: {
-      std::string arg = argv[1];
-      if (arg == "-h" || arg == "--help") {
-        Usage(progname, dirname);
-        return 0;
-      }
-
-      if (!std::filesystem::exists(argv[1])) {
-        std::cerr << "Error: " << argv[1] << " does not exist\n";
+    case 1:
+      if (!std::filesystem::exists(positional_args[0])) {
+        std::cerr << "Error: " << positional_args[0] << " does not exist\n";
         return 1;
       }
-      client_path = argv[1];
+      client_path = positional_args[0];
 
       break;
-    }
-    case 1:
+    case 0:
       break;
     default:
       Usage(progname, dirname);
@@ -95,9 +123,27 @@ int main(int argc, char** argv) {
   CompartmentManagerInit();
   CompartmentAdd(kClientCompartmentId, client_path, {}, kCompartmentMemoryRangeLength);
   CompartmentAdd(kServerCompartmentId, server_path, {}, kCompartmentMemoryRangeLength);
-  CompartmentAdd(kComputeNodeACompartmentId, compute_node_a_path, {}, kCompartmentMemoryRangeLength);
-  CompartmentAdd(kComputeNodeBCompartmentId, compute_node_b_path, {}, kCompartmentMemoryRangeLength);
-  CompartmentAdd(kComputeNodeCCompartmentId, compute_node_c_path, {}, kCompartmentMemoryRangeLength);
+  switch (topology) {
+    case ComputeNodeTopology::kSplit:
+      CompartmentAdd(kComputeNodeACompartmentId, compute_node_a_path, {},
+                     kCompartmentMemoryRangeLength);
+      CompartmentAdd(kComputeNodeBCompartmentId, compute_node_b_path, {},
+                     kCompartmentMemoryRangeLength);
+      CompartmentAdd(kComputeNodeCCompartmentId, compute_node_c_path, {},
+                     kCompartmentMemoryRangeLength);
+      // Node A always calls Node B, and Node B always calls Node C: spare them the ID lookups.
+      CompartmentGrantCallGate(kComputeNodeACompartmentId, kComputeNodeBCompartmentId);
+      CompartmentGrantCallGate(kComputeNodeBCompartmentId, kComputeNodeCCompartmentId);
+      break;
+    case ComputeNodeTopology::kFused:
+      // The fused compute node takes Node A's place, Node B and Node C have no compartment.
+      CompartmentAdd(kComputeNodeACompartmentId, compute_node_fused_path, {},
+                     kCompartmentMemoryRangeLength);
+      break;
+  }
+  // Node A's lane workers call Node B, so they must be threads of ours.
+  CompartmentLendThreads(kComputeNodeACompartmentId, KdfLaneThreadsFromEnv() - 1,
+                         KdfRequestType::kLaneWorker);
 
   // Start the client compartment and wait until it's done.
   CompartmentCall(kClientCompartmentId);
@@ -6,6 +6,27 @@
 
 #pragma once
 
+// The macros below define the symbols that must be defined by every compartment and are looked up
+// by the compartment manager.
+// Apart from the entry symbol, the trace ring (see compartments/compartment_trace.h) and the thread
+// context service (see compartments/compartment_threads.cpp), all symbols are initialized by the
+// compartment manager.
+// The entry symbol may be overridden when building a compartment's code to be linked together with
+// other compartments (see compartments/compartment_in_process.h).
+#ifndef COMPARTMENT_ENTRY_SYMBOL
+#define COMPARTMENT_ENTRY_SYMBOL __compartment_entry
+#endif
+#define COMPARTMENT_MANAGER_CALL_CAPABILITY_SYMBOL __compartment_manager_call
+#define COMPARTMENT_MANAGER_RETURN_CAPABILITY_SYMBOL __compartment_manager_return
+#define COMPARTMENT_CALL_GATES_SYMBOL __compartment_call_gates
+#define COMPARTMENT_CHANNELS_SYMBOL __compartment_channels
+#define COMPARTMENT_MMAP_RANGE_BASE_SYMBOL __compartment_mmap_range_base
+#define COMPARTMENT_MMAP_RANGE_TOP_SYMBOL __compartment_mmap_range_top
+#define COMPARTMENT_TRACE_RING_SYMBOL __compartment_trace_ring
+#define COMPARTMENT_NEW_THREAD_CONTEXT_SYMBOL __compartment_new_thread_context
+#define COMPARTMENT_THREAD_CONTEXT_SP_SYMBOL __compartment_thread_context_sp
+#define COMPARTMENT_THREAD_CONTEXT_TP_SYMBOL __compartment_thread_context_tp
+
 #ifndef __ASSEMBLY__
 
 #include <stddef.h>
@@ -13,23 +34,38 @@
 
 #include <type_traits>
 
+#if !defined(__CHERI__)
+// Host builds: uintcap_t and __capability come from the archcap.h stand-in (see host/archcap.h).
+#include <archcap.h>
+#endif
+
 using CompartmentId = size_t;
 
-// Allocated compartment IDs (statically to simplify things).
+// Statically allocated compartment IDs, for the compartments that others call by ID.
 constexpr CompartmentId kClientCompartmentId = 0;
 constexpr CompartmentId kServerCompartmentId = 1;
 constexpr CompartmentId kComputeNodeACompartmentId = 3;
 constexpr CompartmentId kComputeNodeBCompartmentId = 4;
 constexpr CompartmentId kComputeNodeCCompartmentId = 5;
+// Compartments of the compartment switch benchmark (see benchmarks/switch_benchmark.cpp).
+constexpr CompartmentId kSwitchNullCompartmentId = 6;
+constexpr CompartmentId kSwitchEchoCompartmentId = 7;
+constexpr CompartmentId kSwitchRelayCompartmentId = 8;
+// Compartments of the channel test (see tests/channel_test.cpp).
+constexpr CompartmentId kChannelProducerCompartmentId = 9;
+constexpr CompartmentId kChannelConsumerCompartmentId = 10;
 
-// Call into the compartment with the requested ID, with 0 to 6 arguments (they must all be passed
-// in registers, so using a variadic prototype would not be a good idea).
-// The compartment returns one value.
-// This can be used from both the compartment manager (running in Executive), and compartments
-// (running in Restricted).
-uintcap_t CompartmentCall(CompartmentId id,
-                          uintcap_t arg0 = 0, uintcap_t arg1 = 0, uintcap_t arg2 = 0,
-                          uintcap_t arg3 = 0, uintcap_t arg4 = 0, uintcap_t arg5 = 0);
+// IDs from this one onwards are allocated by the compartment manager, when adding a compartment
+// without specifying its ID.
+constexpr CompartmentId kFirstDynamicCompartmentId = 16;
+
+// Maximum number of arguments of a compartment call.
+constexpr size_t kCompartmentCallMaxArgs = 6;
+
+// Whether T is passed in an X register (scalar types whose size is 8 or less), as opposed to a C
+// register (capabilities).
+template <typename T>
+constexpr bool kIsScalarArg = std::is_scalar<T>::value && sizeof(T) <= 8;
 
 // Converts a variable of any type that is normally stored in an X or C register to uintcap_t,
 // without extraneous instructions. Useful for functions that take uintcap_t as a catch-all type.
@@ -37,10 +73,10 @@ uintcap_t CompartmentCall(CompartmentId id,
 // char* __capability data_cap = ...;
 // CompartmentCall(id, AsUintcap(4), AsUintcap(kEnumVal), AsUintcap(data_cap));
 //
-// This overload is strictly for types fitting in an X register (scalar types whose size is 8 or
-// less).
-template <typename T, typename = std::enable_if_t<std::is_scalar<T>::value && sizeof(T) <= 8>>
+// This overload is strictly for types fitting in an X register (see kIsScalarArg).
+template <typename T, typename = std::enable_if_t<kIsScalarArg<T>>>
 static inline uintcap_t AsUintcap(T arg) {
+#if defined(__CHERI__)
   // There's no easy way to tell the compiler that a variable in an X register should be moved
   // to a C register, without conversion. Work around this by placing the argument in x0 and the
   // return value in c0.
@@ -49,19 +85,65 @@ static inline uintcap_t AsUintcap(T arg) {
   // Let the compiler know that ret has been initialised by the register allocation above.
   asm("" : "=C"(ret) : "r"(arg_));
   return ret;
+#else
+  // Without capabilities, uintcap_t is a plain integer type.
+  return (uintcap_t)arg;
+#endif
 }
 
 static inline uintcap_t AsUintcap(const void* __capability arg) {
   return reinterpret_cast<uintcap_t>(arg);
 }
 
-#endif // __ASSEMBLY__
+#if defined(__CHERI__)
+static inline uintcap_t AsUintcap(uintcap_t arg) {
+  return arg;
+}
+#endif
 
-// The macros below define the symbols that must be defined by every compartment and are looked up
-// by the compartment manager.
-// Apart from the entry symbol, all symbols are initialized by the compartment manager.
-#define COMPARTMENT_ENTRY_SYMBOL __compartment_entry
-#define COMPARTMENT_MANAGER_CALL_CAPABILITY_SYMBOL __compartment_manager_call
-#define COMPARTMENT_MANAGER_RETURN_CAPABILITY_SYMBOL __compartment_manager_return
-#define COMPARTMENT_MMAP_RANGE_BASE_SYMBOL __compartment_mmap_range_base
-#define COMPARTMENT_MMAP_RANGE_TOP_SYMBOL __compartment_mmap_range_top
+#if defined(__CHERI__) && !defined(COMPARTMENT_CALL_IN_PROCESS)
+#include "compartment_interface_impl.h"
+#else
+// Implemented by compartments/compartment_in_process.cpp. COMPARTMENT_CALL_IN_PROCESS must be
+// defined when building code that calls in-process compartments on Morello.
+uintcap_t CompartmentCallInProcess(CompartmentId id, uintcap_t arg0 = 0, uintcap_t arg1 = 0,
+                                   uintcap_t arg2 = 0, uintcap_t arg3 = 0, uintcap_t arg4 = 0,
+                                   uintcap_t arg5 = 0);
+#endif
+
+// Call into the compartment with the requested ID, with 0 to kCompartmentCallMaxArgs arguments.
+// Arguments may be scalars or capabilities (uintcap_t or capability pointers), as for AsUintcap().
+// The compartment returns one value.
+// This can be used from both the compartment manager (running in Executive), and compartments
+// (running in Restricted). Each number of arguments has its own compartment switch stub, and each
+// argument is passed in the way its type requires, so that a call only pays for the arguments it
+// passes.
+template <typename... Args>
+static inline uintcap_t CompartmentCall(CompartmentId id, Args... args) {
+  static_assert(sizeof...(Args) <= kCompartmentCallMaxArgs, "Too many compartment call arguments");
+#if defined(__CHERI__) && !defined(COMPARTMENT_CALL_IN_PROCESS)
+  return CompartmentCallImpl<false>(COMPARTMENT_MANAGER_CALL_CAPABILITY_SYMBOL[sizeof...(Args)], id,
+                                    args...);
+#else
+  return CompartmentCallInProcess(id, AsUintcap(args)...);
+#endif
+}
+
+// Same as CompartmentCall(), through the call gate that the compartment manager granted the calling
+// compartment for kCallee (see CompartmentGrantCallGate() in compartment_manager.h). A call gate
+// leads straight to the callee's descriptor, sparing the ID check and descriptor lookup of
+// CompartmentCall(). Only statically allocated compartments have call gates.
+// Calling through a gate that has not been granted faults.
+template <CompartmentId kCallee, typename... Args>
+static inline uintcap_t CompartmentCallThroughGate(Args... args) {
+  static_assert(kCallee < kFirstDynamicCompartmentId, "Only static compartments have call gates");
+  static_assert(sizeof...(Args) <= kCompartmentCallMaxArgs, "Too many compartment call arguments");
+#if defined(__CHERI__) && !defined(COMPARTMENT_CALL_IN_PROCESS)
+  return CompartmentCallImpl<true>(COMPARTMENT_CALL_GATES_SYMBOL[kCallee][sizeof...(Args)], 0,
+                                   args...);
+#else
+  return CompartmentCallInProcess(kCallee, AsUintcap(args)...);
+#endif
+}
+
+#endif // __ASSEMBLY__
@@ -6,39 +6,113 @@
 
 #pragma once
 
-#include "compartment_interface.h"
+// Implementation of CompartmentCall() with the compartment manager, shared by the compartment
+// manager and compartments. Only to be included by compartment_interface.h.
+
+#include <tuple>
+
+// Capabilities to the compartment manager's switch stubs, indexed by number of arguments (see
+// CompartmentSwitch<n> in compartment_manager_asm.S). Set by the compartment manager, when adding a
+// compartment on the compartment side, and at startup on its own side.
+extern "C" void* __capability
+    COMPARTMENT_MANAGER_CALL_CAPABILITY_SYMBOL[kCompartmentCallMaxArgs + 1];
+
+// Call gates granted by the compartment manager, indexed by callee ID and number of arguments (see
+// CompartmentGate<n> in compartment_manager_asm.S). Each gate is a capability sealed for LDPBLR to a
+// pair of capabilities: the callee's descriptor, and the switch stub. Null if not granted.
+extern "C" void* __capability
+    COMPARTMENT_CALL_GATES_SYMBOL[kFirstDynamicCompartmentId][kCompartmentCallMaxArgs + 1];
+
+// Declares c<n> and sets it to argument n. Scalars are written to x<n> as-is (like AsUintcap()
+// does), which clears the rest of c<n>, rather than being moved to c<n> from another register.
+#define COMPARTMENT_CALL_ARG(n)                                                 \
+  register uintcap_t c##n asm("c" #n);                                          \
+  if constexpr (kIsScalarArg<std::tuple_element_t<n, std::tuple<Args...>>>) {   \
+    register std::tuple_element_t<n, std::tuple<Args...>> x##n asm("x" #n) =    \
+        std::get<n>(arg_tuple);                                                 \
+    asm("" : "=C"(c##n) : "r"(x##n));                                           \
+  } else {                                                                      \
+    c##n = AsUintcap(std::get<n>(arg_tuple));                                   \
+  }
 
 #pragma clang diagnostic push
 // Clang is unhappy about clobbering FP (see asm() below) when there is already a function call in
-// the same function, namely the compartment manager's CompartmentCall() implementation. Since
-// we do not actually clobber FP in the asm() statement, it is safe to ignore this warning here.
+// the same function. Since we do not actually clobber FP in the asm() statement, it is safe to
+// ignore this warning here.
 #pragma clang diagnostic ignored "-Winline-asm"
 
-template <typename Fn>
-static inline
-uintcap_t CompartmentCallImpl(CompartmentId id,
-                              uintcap_t arg0, uintcap_t arg1, uintcap_t arg2,
-                              uintcap_t arg3, uintcap_t arg4, uintcap_t arg5,
-                              Fn comp_switch_c_ptr) {
-  register uintcap_t c0 asm("c0") = AsUintcap(id);
-  register uintcap_t c1 asm("c1") = arg0;
-  register uintcap_t c2 asm("c2") = arg1;
-  register uintcap_t c3 asm("c3") = arg2;
-  register uintcap_t c4 asm("c4") = arg3;
-  register uintcap_t c5 asm("c5") = arg4;
-  register uintcap_t c6 asm("c6") = arg5;
-
-  asm("blr %[fn]"
-      : "+C"(c0)
-      : [fn]"C"(comp_switch_c_ptr), "C"(c1), "C"(c2), "C"(c3), "C"(c4), "C"(c5), "C"(c6)
-      // Callee-saved registers are not preserved by the compartment switcher, so mark all of them
-      // as clobbered to get the compiler to save and restore them.
-      // Also mark FP and LR as clobbered, because we are effectively making a function call and
-      // therefore the compiler should create a frame record.
-      // Note that FP is not actually clobbered, because CompartmentSwitch() does preserve FP.
-      : "x19", "x20", "x21", "x22", "x23", "x24", "x25", "x26", "x27", "x28", "fp", "lr");
-
-  return c0;
+// The stubs take the compartment ID in x9 and the arguments in c0 to c<n - 1>, where the target
+// compartment expects them, and return the compartment's return value in c0. Registers that are
+// not used to pass arguments are cleared by the stub.
+// Call gates are invoked with LDPBLR instead, which loads the callee's descriptor into c29 and
+// branches to the gate's stub; FP is passed in x9 so that the stub can restore it.
+// Callee-saved registers are not preserved by the compartment switcher (the compartment's stack
+// frames are discarded when it returns), so mark all of them as clobbered to get the compiler to
+// save and restore them. The argument registers are marked as outputs for the same reason.
+// Also mark FP and LR as clobbered, because we are effectively making a function call and
+// therefore the compiler should create a frame record.
+// Note that FP is not actually clobbered, because the stubs do preserve FP.
+#define COMPARTMENT_CALL_ASM(insn, ...)                                                   \
+  asm volatile(insn                                                                       \
+               : "+r"(x9), __VA_ARGS__                                                    \
+               : [target]"C"(target)                                                      \
+               : "x19", "x20", "x21", "x22", "x23", "x24", "x25", "x26", "x27", "x28",    \
+                 "v8", "v9", "v10", "v11", "v12", "v13", "v14", "v15", "fp", "lr", "memory")
+
+#define COMPARTMENT_CALL(...)                                                             \
+  if constexpr (kThroughGate)                                                             \
+    COMPARTMENT_CALL_ASM("mov x9, x29\n\tldpblr c29, [%[target]]", __VA_ARGS__);          \
+  else                                                                                    \
+    COMPARTMENT_CALL_ASM("blr %[target]", __VA_ARGS__)
+
+// Not inlined, so that the registers that are live across the call are saved by the caller like
+// for any function call (the stubs do not preserve them either).
+// target is either the capability to the switch stub (and id the target compartment ID), or the
+// call gate if kThroughGate is true.
+template <bool kThroughGate, typename... Args>
+__attribute__((noinline))
+static uintcap_t CompartmentCallImpl(void* __capability target, CompartmentId id, Args... args) {
+  constexpr size_t kNumArgs = sizeof...(Args);
+  std::tuple<Args...> arg_tuple{args...};
+  (void)arg_tuple;
+  register uint64_t x9 asm("x9") = id;
+
+  if constexpr (kNumArgs == 0) {
+    register uintcap_t c0 asm("c0");
+    COMPARTMENT_CALL("=C"(c0));
+    return c0;
+  } else if constexpr (kNumArgs == 1) {
+    COMPARTMENT_CALL_ARG(0)
+    COMPARTMENT_CALL("+C"(c0));
+    return c0;
+  } else if constexpr (kNumArgs == 2) {
+    COMPARTMENT_CALL_ARG(0) COMPARTMENT_CALL_ARG(1)
+    COMPARTMENT_CALL("+C"(c0), "+C"(c1));
+    return c0;
+  } else if constexpr (kNumArgs == 3) {
+    COMPARTMENT_CALL_ARG(0) COMPARTMENT_CALL_ARG(1) COMPARTMENT_CALL_ARG(2)
+    COMPARTMENT_CALL("+C"(c0), "+C"(c1), "+C"(c2));
+    return c0;
+  } else if constexpr (kNumArgs == 4) {
+    COMPARTMENT_CALL_ARG(0) COMPARTMENT_CALL_ARG(1) COMPARTMENT_CALL_ARG(2)
+    COMPARTMENT_CALL_ARG(3)
+    COMPARTMENT_CALL("+C"(c0), "+C"(c1), "+C"(c2), "+C"(c3));
+    return c0;
+  } else if constexpr (kNumArgs == 5) {
+    COMPARTMENT_CALL_ARG(0) COMPARTMENT_CALL_ARG(1) COMPARTMENT_CALL_ARG(2)
+    COMPARTMENT_CALL_ARG(3) COMPARTMENT_CALL_ARG(4)
+    COMPARTMENT_CALL("+C"(c0), "+C"(c1), "+C"(c2), "+C"(c3), "+C"(c4));
+    return c0;
+  } else {
+    COMPARTMENT_CALL_ARG(0) COMPARTMENT_CALL_ARG(1) COMPARTMENT_CALL_ARG(2)
+    COMPARTMENT_CALL_ARG(3) COMPARTMENT_CALL_ARG(4) COMPARTMENT_CALL_ARG(5)
+    COMPARTMENT_CALL("+C"(c0), "+C"(c1), "+C"(c2), "+C"(c3), "+C"(c4), "+C"(c5));
+    return c0;
+  }
 }
 
 #pragma clang diagnostic pop
+
+#undef COMPARTMENT_CALL
+#undef COMPARTMENT_CALL_ASM
+#undef COMPARTMENT_CALL_ARG
@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2020 Arm Limited. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+// Ends of the channel exercised by the channel test (see tests/channel_test.cpp and
+// kChannelTestChannel). Built twice:
+// - channel_producer: enqueues numbered messages.
+// - channel_consumer (CHANNEL_PEER_CONSUMER defined): dequeues them, and checks their contents.
+
+#include <iostream>
+
+#include "compartment_helpers.h"
+#include "protocol.h"
+
+#if defined(CHANNEL_PEER_CONSUMER)
+#define CHANNEL_PEER_NAME "Channel consumer"
+#else
+#define CHANNEL_PEER_NAME "Channel producer"
+#endif
+
+namespace {
+
+// Opened by the first request: the channel is only connected once both compartments are
+// initialized.
+ChannelEndpoint endpoint;
+bool endpoint_open = false;
+
+#if defined(CHANNEL_PEER_CONSUMER)
+bool MessageValid(const ChannelTestMessage& message, uint64_t seq) {
+  if (message.seq != seq)
+    return false;
+  for (size_t i = 0; i < sizeof(message.payload) / sizeof(message.payload[0]); ++i) {
+    if (message.payload[i] != ChannelTestPayload(seq, i))
+      return false;
+  }
+  return true;
+}
+#endif
+
+}
+
+COMPARTMENT_ENTRY_POINT(uint64_t first_seq, size_t count) {
+  if (!endpoint_open) {
+    // The endpoint copies whole slots to and from our messages.
+    if (!endpoint.Open(kChannelTestChannel) || endpoint.slot_size() != sizeof(ChannelTestMessage))
+      CompartmentReturn(-1);
+    endpoint_open = true;
+  }
+
+  size_t i;
+  for (i = 0; i < count; ++i) {
+    ChannelTestMessage message;
+#if defined(CHANNEL_PEER_CONSUMER)
+    if (!endpoint.TryDequeue(&message))
+      break;
+    if (!MessageValid(message, first_seq + i))
+      CompartmentReturn(-1);
+#else
+    message.seq = first_seq + i;
+    for (size_t j = 0; j < sizeof(message.payload) / sizeof(message.payload[0]); ++j)
+      message.payload[j] = ChannelTestPayload(message.seq, j);
+    if (!endpoint.TryEnqueue(&message))
+      break;
+#endif
+  }
+  CompartmentReturn(i);
+}
+
+int main(int, char** argv) {
+  std::cout << "[" CHANNEL_PEER_NAME "] Compartment @" << argv[0] << " initialized" << std::endl;
+
+  // Return to the compartment manager, letting it know that we have completed our initialization.
+  CompartmentReturn();
+}
@@ -4,6 +4,7 @@
  * SPDX-License-Identifier: BSD-3-Clause
  */
 
+#include <string.h>
 #include <iostream>
 
 #include <archcap.h>
@@ -37,26 +38,56 @@ COMPARTMENT_ENTRY_POINT(void) {
   CompartmentReturn();
 }
 
+#elif defined(COMPARTMENT_CLIENT_GENERATE_KEYS_BULK)
+
+COMPARTMENT_ENTRY_POINT(void) {
+  // Request several key pairs at once, as a client setting up multiple sessions would. The
+  // write-only capability covers the whole array.
+  constexpr size_t kNumKeyPairs = 4;
+  KeyPair client_keys[kNumKeyPairs];
+  KeyPair* __capability client_keys_cap = archcap_c_ddc_cast(client_keys);
+  client_keys_cap = archcap_c_bounds_set(client_keys_cap, sizeof(client_keys));
+  client_keys_cap = archcap_c_perms_set(client_keys_cap, ARCHCAP_PERM_GLOBAL | ARCHCAP_PERM_STORE);
+
+  uintcap_t ret = CompartmentCall(kServerCompartmentId, AsUintcap(RequestType::kGenerateClientKeys),
+                                  AsUintcap(client_keys_cap), AsUintcap(kNumKeyPairs));
+  if (ret == 0) {
+    for (const KeyPair& key_pair : client_keys) {
+      std::cout << "[Client] Generated public key: ";
+      PrintKey(&key_pair.public_key);
+      std::cout << "[Client] Generated private key: ";
+      PrintKey(&key_pair.private_key);
+    }
+  } else {
+    std::cout << "[Client] Server failed to generate keys\n";
+  }
+
+  CompartmentReturn();
+}
+
 #elif defined(COMPARTMENT_CLIENT_DERIVE_SECRET_KEY)
 
 COMPARTMENT_ENTRY_POINT(void) {
-  // Derive a client secret based on MCC based key derivation function. We construct a write-only capability to that effect,
-  // and pass it to the server.
-  // const char* passwd = "dsbd_cheri";
-  // const char* salt = "$123fvp_morello123$";
+  // Derive a client secret based on MCC based key derivation function. We construct a read-only
+  // capability to the inputs and a write-only capability to the secret, and pass them to Node A.
+  // The fields are fixed-size and need not be NUL-terminated.
   KDF_Inputs input;
-  &input->passwd = "dsbd_cheri";
-  &input->salt = "$123fvp_morello123$";
+  memcpy(input.passwd, "dsbd_cheri", sizeof(input.passwd));
+  memcpy(input.salt, "$123fvp_morello123$", sizeof(input.salt));
+  input.N = kScryptDefaultN;
+  input.r = kScryptDefaultR;
+  input.p = kScryptDefaultP;
   KDF_Inputs* __capability input_cap = archcap_c_ddc_cast(&input);
   input_cap = archcap_c_perms_set(input_cap, ARCHCAP_PERM_GLOBAL | ARCHCAP_PERM_LOAD);
   Secret client_derived_secret;
   Secret* __capability client_derived_secret_cap = archcap_c_ddc_cast(&client_derived_secret);
   client_derived_secret_cap = archcap_c_perms_set(client_derived_secret_cap, ARCHCAP_PERM_GLOBAL | ARCHCAP_PERM_STORE);
 
-  uintcap_t ret = CompartmentCall(kComputeNodeACompartmentId, AsUintcap(input_cap), AsUintcap(client_derived_secret_cap));
+  uintcap_t ret = CompartmentCall(kComputeNodeACompartmentId, AsUintcap(KdfRequestType::kDerive),
+                                  AsUintcap(input_cap), AsUintcap(client_derived_secret_cap));
   if (ret == 0) {
     std::cout << "[Client] Derived Secret: ";
-    PrintKey(&client_derived_secret.output);
+    PrintSecret(client_derived_secret);
   } else {
     std::cout << "[Client] Nodes failed to derive secret\n";
   }
@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2020 Arm Limited. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Channels between two compartments. A channel is a region of memory shared by a producer and a
+// consumer compartment, holding a single-producer / single-consumer ring of fixed-size slots. The
+// compartment manager maps the region outside of both compartments' ranges, and gives each of them
+// a capability bounded to it (see CompartmentConnectChannel()), in their channel table
+// (COMPARTMENT_CHANNELS_SYMBOL). Messages then go through memory only: no compartment switch is
+// involved. See ChannelEndpoint in compartment_helpers.h for the compartment side.
+//
+// The capabilities only allow loading and storing data, so that capabilities cannot be passed
+// through a channel. The header and slots are writable by both compartments, so neither can trust
+// what the other writes there.
+
+// Number of entries in a compartment's channel table.
+constexpr size_t kMaxCompartmentChannels = 8;
+
+// The producer and consumer indices are on separate cache lines, so that each side only writes to
+// its own.
+constexpr size_t kCompartmentChannelCacheLineSize = 64;
+
+// Laid out at the start of the region, followed by the slots.
+struct CompartmentChannelHeader {
+  // Set by the compartment manager, not meant to change afterwards (the endpoints keep their own
+  // copy, see ChannelEndpoint::Open()).
+  uint64_t slot_size;
+  // Power of 2.
+  uint64_t slot_count;
+
+  // Number of slots enqueued so far; slot i is stored in slot i % slot_count. Written by the
+  // producer.
+  alignas(kCompartmentChannelCacheLineSize) uint64_t head;
+  // Number of slots dequeued so far. Written by the consumer.
+  alignas(kCompartmentChannelCacheLineSize) uint64_t tail;
+};
+
+static_assert(sizeof(CompartmentChannelHeader) % kCompartmentChannelCacheLineSize == 0, "");
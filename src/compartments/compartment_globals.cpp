@@ -8,10 +8,12 @@
 
 // All the variables below are initialised by the compartment manager.
 extern "C" {
-  uintcap_t (* __capability COMPARTMENT_MANAGER_CALL_CAPABILITY_SYMBOL)(
-        CompartmentId, uintcap_t, uintcap_t, uintcap_t, uintcap_t, uintcap_t, uintcap_t);
+  void* __capability COMPARTMENT_MANAGER_CALL_CAPABILITY_SYMBOL[kCompartmentCallMaxArgs + 1];
   void (* __capability COMPARTMENT_MANAGER_RETURN_CAPABILITY_SYMBOL)(uintcap_t)
       __attribute__((noreturn));
+  void* __capability
+      COMPARTMENT_CALL_GATES_SYMBOL[kFirstDynamicCompartmentId][kCompartmentCallMaxArgs + 1];
+  void* __capability COMPARTMENT_CHANNELS_SYMBOL[kMaxCompartmentChannels];
 
   ptraddr_t COMPARTMENT_MMAP_RANGE_BASE_SYMBOL;
   ptraddr_t COMPARTMENT_MMAP_RANGE_TOP_SYMBOL;
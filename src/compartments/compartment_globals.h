@@ -10,13 +10,23 @@
 
 #include <stdint.h>
 
+#include "compartment_channel.h"
+
+// COMPARTMENT_MANAGER_CALL_CAPABILITY_SYMBOL and COMPARTMENT_CALL_GATES_SYMBOL are declared in
+// compartment_interface_impl.h.
 extern "C" {
-  extern uintcap_t (* __capability COMPARTMENT_MANAGER_CALL_CAPABILITY_SYMBOL)(
-        CompartmentId, uintcap_t, uintcap_t, uintcap_t, uintcap_t, uintcap_t, uintcap_t);
   // Use the noreturn attribute because [[noreturn]] cannot be used on function pointers.
   extern void (* __capability COMPARTMENT_MANAGER_RETURN_CAPABILITY_SYMBOL)(uintcap_t)
       __attribute__((noreturn));
 
+  // Channels connected to this compartment (see compartment_channel.h), null if not connected.
+  extern void* __capability COMPARTMENT_CHANNELS_SYMBOL[kMaxCompartmentChannels];
+
   extern ptraddr_t COMPARTMENT_MMAP_RANGE_BASE_SYMBOL;
   extern ptraddr_t COMPARTMENT_MMAP_RANGE_TOP_SYMBOL;
+
+  // Written by COMPARTMENT_NEW_THREAD_CONTEXT_SYMBOL (see compartment_threads.cpp), read by the
+  // compartment manager.
+  extern ptraddr_t COMPARTMENT_THREAD_CONTEXT_SP_SYMBOL;
+  extern ptraddr_t COMPARTMENT_THREAD_CONTEXT_TP_SYMBOL;
 }
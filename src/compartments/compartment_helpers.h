@@ -8,6 +8,11 @@
 
 #include "compartment_interface.h"
 
+#include <archcap.h>
+
+#include "compartment_channel.h"
+#include "compartment_globals.h"
+
 // Causes the compartment to return to its caller (through the compartment manager).
 // ret specifies the return value.
 // Attention: when a compartment returns, all the stack frames between the compartment entry and
@@ -20,3 +25,112 @@
 //   ...
 // }
 #define COMPARTMENT_ENTRY_POINT(...) extern "C" void COMPARTMENT_ENTRY_SYMBOL(__VA_ARGS__)
+
+// Derives a capability to the buffer [ptr, ptr + length) from DDC, restricted to the requested
+// permissions. Use this rather than archcap_c_ddc_cast() when the buffer is not described by the
+// pointee type (e.g. a variable-length block), so that the callee can access all of it but nothing
+// beyond it.
+template <typename T>
+static inline T* __capability DeriveBufferCapability(T* ptr, size_t length,
+                                                      archcap_perms_t perms) {
+  void* __capability cap = reinterpret_cast<void* __capability>(archcap_c_ddc_get());
+  cap = archcap_c_address_set(cap, ptr);
+  cap = archcap_c_bounds_set(cap, length);
+  cap = archcap_c_perms_set(cap, perms);
+  return static_cast<T* __capability>(cap);
+}
+
+// Checks that a capability provided by another compartment is appropriate for accessing length
+// bytes from its address with the requested permissions, by inspecting its tag, bounds and
+// permissions. Note that this is not an exhaustive check, and there is no reliable way to ensure
+// that the underlying memory is accessible.
+template <typename T>
+static inline bool IsCapabilityAccessible(const T* __capability cap, size_t length,
+                                          archcap_perms_t perms) {
+  return archcap_c_tag_get(cap) &&
+         (archcap_c_limit_get(cap) - archcap_c_address_get(cap)) >= length &&
+         (archcap_c_perms_get(cap) & perms) == perms;
+}
+
+// One side of a channel (see compartment_channel.h). A producer endpoint must only be used to
+// enqueue, and a consumer endpoint to dequeue, each by one thread at a time. Neither operation
+// blocks: the caller decides how to wait if the ring is full or empty (e.g. spin, or yield).
+// Slots are written by the other compartment, so their contents must be validated like any other
+// input from another compartment.
+class ChannelEndpoint {
+ public:
+  // Opens the channel at index channel of the compartment's channel table. Returns false if the
+  // channel is not connected, or if its header does not match the region.
+  bool Open(size_t channel) {
+    if (channel >= kMaxCompartmentChannels)
+      return false;
+    void* __capability region = COMPARTMENT_CHANNELS_SYMBOL[channel];
+    if (!IsCapabilityAccessible(region, sizeof(CompartmentChannelHeader),
+                                ARCHCAP_PERM_LOAD | ARCHCAP_PERM_STORE))
+      return false;
+
+    // Keep our own copy of the geometry: the other side could change the header afterwards.
+    header_ = static_cast<CompartmentChannelHeader* __capability>(region);
+    uint64_t slot_size = header_->slot_size;
+    uint64_t slot_count = header_->slot_count;
+    size_t slots_length = archcap_c_limit_get(region) - archcap_c_address_get(region) -
+                          sizeof(CompartmentChannelHeader);
+    if (slot_size == 0 || slot_count == 0 || (slot_count & (slot_count - 1)) != 0 ||
+        slot_count > slots_length / slot_size)
+      return false;
+    slot_size_ = slot_size;
+    slot_mask_ = slot_count - 1;
+    slots_ = static_cast<uint8_t* __capability>(region) + sizeof(CompartmentChannelHeader);
+
+    head_ = __atomic_load_n(&header_->head, __ATOMIC_ACQUIRE);
+    tail_ = __atomic_load_n(&header_->tail, __ATOMIC_ACQUIRE);
+    return true;
+  }
+
+  size_t slot_size() const {
+    return slot_size_;
+  }
+
+  // Producer side: copies slot_size() bytes from data to the next slot. Returns false if the ring
+  // is full.
+  bool TryEnqueue(const void* data) {
+    if (head_ - tail_ > slot_mask_) {
+      // Only read the consumer's index when the ring looks full, so that its cache line is not
+      // pulled in for every slot.
+      tail_ = __atomic_load_n(&header_->tail, __ATOMIC_ACQUIRE);
+      if (head_ - tail_ > slot_mask_)
+        return false;
+    }
+    memcpy_c(Slot(head_), archcap_c_ddc_cast(data), slot_size_);
+    __atomic_store_n(&header_->head, ++head_, __ATOMIC_RELEASE);
+    return true;
+  }
+
+  // Consumer side: copies the next slot's slot_size() bytes to data. Returns false if the ring is
+  // empty.
+  bool TryDequeue(void* data) {
+    if (tail_ == head_) {
+      // Same as above, for the producer's index.
+      head_ = __atomic_load_n(&header_->head, __ATOMIC_ACQUIRE);
+      if (tail_ == head_)
+        return false;
+    }
+    memcpy_c(archcap_c_ddc_cast(data), Slot(tail_), slot_size_);
+    __atomic_store_n(&header_->tail, ++tail_, __ATOMIC_RELEASE);
+    return true;
+  }
+
+ private:
+  uint8_t* __capability Slot(uint64_t index) const {
+    return slots_ + (index & slot_mask_) * slot_size_;
+  }
+
+  CompartmentChannelHeader* __capability header_ = nullptr;
+  uint8_t* __capability slots_ = nullptr;
+  size_t slot_size_ = 0;
+  uint64_t slot_mask_ = 0;
+  // Producer: next slot to write, and last known consumer index. Consumer: last known producer
+  // index, and next slot to read.
+  uint64_t head_ = 0;
+  uint64_t tail_ = 0;
+};
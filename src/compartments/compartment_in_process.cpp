@@ -0,0 +1,181 @@
+/*
+ * Copyright (c) 2020 Arm Limited. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include "compartment_in_process.h"
+
+#include <setjmp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <iostream>
+#include <vector>
+
+#include "compartment_helpers.h"
+#include "utils/align.h"
+
+#if defined(COMPARTMENT_PROFILING)
+#include "compartment-manager/compartment_profile.h"
+#include "compartment_trace.h"
+#endif
+
+namespace {
+
+struct InProcessCompartment {
+  InProcessEntryPoint entry_point = nullptr;
+};
+
+std::vector<InProcessCompartment> compartments;
+#if defined(COMPARTMENT_SWITCH_COUNTING)
+uint64_t call_count = 0;
+#endif
+
+// A call into a compartment that has not returned yet. CompartmentReturn() unwinds to the innermost
+// frame of the current thread, discarding the stack frames in between, as the compartment manager
+// does.
+struct CallFrame {
+  jmp_buf env;
+  // Written by CompartmentReturn() before unwinding, so it must not be cached across setjmp().
+  volatile uintcap_t ret;
+  CallFrame* caller;
+#if defined(COMPARTMENT_PROFILING)
+  uint64_t start;
+  CompartmentId caller_id;
+#endif
+};
+
+thread_local CallFrame* current_frame = nullptr;
+
+bool IsCompartmentAdded(CompartmentId id) {
+  return id < compartments.size() && compartments[id].entry_point != nullptr;
+}
+
+#if defined(COMPARTMENT_PROFILING)
+// Same as cm_thread_current_compartment with the compartment manager.
+thread_local CompartmentId current_compartment = kCompartmentProfileMainCaller;
+#endif
+
+}
+
+bool InProcessCompartmentAdd(CompartmentId id, const char* name, InProcessMain main_fn,
+                             InProcessEntryPoint entry_point) {
+  if (id >= compartments.size())
+    compartments.resize(id + 1);
+  if (compartments[id].entry_point != nullptr) {
+    std::cerr << "Compartment ID " << id << " is already allocated\n";
+    return false;
+  }
+
+#if defined(COMPARTMENT_PROFILING)
+  CompartmentProfileSetName(id, name);
+  CompartmentProfileDumpAtExit();
+#endif
+
+  CallFrame frame;
+  frame.caller = current_frame;
+  current_frame = &frame;
+  if (setjmp(frame.env) == 0) {
+    char* argv[] = {const_cast<char*>(name), nullptr};
+    int status = main_fn(1, argv);
+    current_frame = frame.caller;
+    std::cerr << name << ": main() returned " << status << " instead of CompartmentReturn()\n";
+    return false;
+  }
+  current_frame = frame.caller;
+
+  // Like the compartment manager, only allow calls once the compartment is initialized.
+  compartments[id].entry_point = entry_point;
+  return true;
+}
+
+// The channel table of all the in-process compartments. It is weak so that a compartment linking
+// in-process compartments (see compute_node_fused.cpp) keeps the one from compartment_globals.cpp,
+// which the compartment manager fills.
+extern "C" {
+  __attribute__((weak)) void* __capability COMPARTMENT_CHANNELS_SYMBOL[kMaxCompartmentChannels];
+}
+
+bool InProcessCompartmentConnectChannel(CompartmentId producer, CompartmentId consumer,
+                                        size_t channel, size_t slot_size, size_t slot_count) {
+  if (producer == consumer || !IsCompartmentAdded(producer) || !IsCompartmentAdded(consumer) ||
+      channel >= kMaxCompartmentChannels ||
+      archcap_c_tag_get(COMPARTMENT_CHANNELS_SYMBOL[channel])) {
+    std::cerr << "Cannot connect channel " << channel << " from compartment " << producer
+              << " to compartment " << consumer << "\n";
+    return false;
+  }
+  if (slot_size == 0 || slot_count == 0 || (slot_count & (slot_count - 1)) != 0 ||
+      slot_count > (SIZE_MAX - sizeof(CompartmentChannelHeader)) / slot_size) {
+    std::cerr << "Invalid channel geometry (" << slot_count << " slots of " << slot_size
+              << " B)\n";
+    return false;
+  }
+
+  // Never freed, like the channels of the compartment manager.
+  size_t length = align_up(sizeof(CompartmentChannelHeader) + slot_size * slot_count,
+                           kCompartmentChannelCacheLineSize);
+  void* region = aligned_alloc(kCompartmentChannelCacheLineSize, length);
+  if (region == nullptr) {
+    std::cerr << "Cannot allocate channel " << channel << "\n";
+    return false;
+  }
+  memset(region, 0, length);
+  CompartmentChannelHeader* header = static_cast<CompartmentChannelHeader*>(region);
+  header->slot_size = slot_size;
+  header->slot_count = slot_count;
+
+  COMPARTMENT_CHANNELS_SYMBOL[channel] = archcap_c_ddc_cast(region);
+  return true;
+}
+
+#if defined(COMPARTMENT_SWITCH_COUNTING)
+uint64_t InProcessCompartmentCallCount() {
+  return __atomic_load_n(&call_count, __ATOMIC_RELAXED);
+}
+#endif
+
+uintcap_t CompartmentCallInProcess(CompartmentId id,
+                                   uintcap_t arg0, uintcap_t arg1, uintcap_t arg2,
+                                   uintcap_t arg3, uintcap_t arg4, uintcap_t arg5) {
+  if (id >= compartments.size() || compartments[id].entry_point == nullptr) {
+    std::cerr << "CompartmentCall(): invalid compartment ID " << id << "\n";
+    abort();
+  }
+#if defined(COMPARTMENT_SWITCH_COUNTING)
+  __atomic_fetch_add(&call_count, 1, __ATOMIC_RELAXED);
+#endif
+
+  CallFrame frame;
+  frame.caller = current_frame;
+  current_frame = &frame;
+#if defined(COMPARTMENT_PROFILING)
+  // Unlike with the compartment manager, the initialization of compartments is not profiled.
+  frame.caller_id = current_compartment;
+  current_compartment = id;
+  frame.start = CompartmentTraceTimestamp();
+#endif
+  if (setjmp(frame.env) == 0) {
+    compartments[id].entry_point(arg0, arg1, arg2, arg3, arg4, arg5);
+    // Entry points have no return address to return to with the compartment manager either.
+    std::cerr << "CompartmentCall(): compartment " << id << " returned without "
+              << "CompartmentReturn()\n";
+    abort();
+  }
+#if defined(COMPARTMENT_PROFILING)
+  CompartmentProfileRecord(frame.caller_id, id, CompartmentTraceTimestamp() - frame.start);
+  current_compartment = frame.caller_id;
+#endif
+  current_frame = frame.caller;
+  return frame.ret;
+}
+
+void CompartmentReturn(uintcap_t ret) {
+  CallFrame* frame = current_frame;
+  if (frame == nullptr) {
+    std::cerr << "CompartmentReturn() called outside of a compartment\n";
+    abort();
+  }
+  frame->ret = ret;
+  longjmp(frame->env, 1);
+}
@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2020 Arm Limited. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "compartment_interface.h"
+
+// In-process compartments: the code of several compartments is linked into a single executable, and
+// CompartmentCall() / CompartmentReturn() become plain function calls / returns, without any
+// isolation. compartment_in_process.cpp implements CompartmentCall() (see
+// CompartmentCallInProcess() in compartment_interface.h) and replaces compartment_helpers.cpp, so
+// that the compartments' code is used unmodified. On Morello, all the code calling in-process
+// compartments must be built with COMPARTMENT_CALL_IN_PROCESS defined. This is meant to
+// measure the compartments' code without the cost of compartmentalization, including on hosts
+// without Morello support (see host/archcap.h).
+// It is also used inside a compartment, to merge several compartments into one (see
+// compute_node_fused.cpp).
+//
+// To allow linking several compartments together, each one must be built with its own
+// COMPARTMENT_ENTRY_SYMBOL, and its main() renamed (see the *_in_process libraries in Android.bp).
+// Compartments run on the caller's stack and in the caller's thread, and all their calls must be
+// made from threads they created or from the threads calling into them, as is the case with the
+// compartment manager.
+
+// Entry point of an in-process compartment. The arguments are passed as by the compartment switch
+// stubs, i.e. in registers, whatever the actual prototype of the entry point.
+using InProcessEntryPoint = void (*)(uintcap_t, uintcap_t, uintcap_t, uintcap_t, uintcap_t,
+                                     uintcap_t);
+using InProcessMain = int (*)(int, char**);
+
+// Declares the entry point and main() of an in-process compartment, as renamed when building it.
+#define DECLARE_IN_PROCESS_COMPARTMENT(entry_symbol, main_symbol)                             \
+  extern "C" void entry_symbol(uintcap_t, uintcap_t, uintcap_t, uintcap_t, uintcap_t, uintcap_t); \
+  int main_symbol(int, char**)
+
+// Add an in-process compartment and initialize it, by calling main_fn until it calls
+// CompartmentReturn(). name is passed to main_fn as argv[0].
+// Returns false if main_fn returned instead (initialization failure).
+// Must not be called concurrently with CompartmentCall().
+bool InProcessCompartmentAdd(CompartmentId id, const char* name, InProcessMain main_fn,
+                             InProcessEntryPoint entry_point);
+
+// Same as CompartmentConnectChannel() (see compartment-manager/compartment_manager.h), for
+// in-process compartments. These share a single channel table, so index channel must be free in
+// all of them. Returns false if the compartments or the geometry are invalid.
+// Must not be called concurrently with CompartmentCall().
+bool InProcessCompartmentConnectChannel(CompartmentId producer, CompartmentId consumer,
+                                        size_t channel, size_t slot_size, size_t slot_count);
+
+#if defined(COMPARTMENT_SWITCH_COUNTING)
+// Number of CompartmentCall()s made so far, by all threads. Each of them would be a compartment
+// switch (and the matching return) with the compartment manager. Like
+// CompartmentManagerSwitchCount(), only maintained in builds that define
+// COMPARTMENT_SWITCH_COUNTING.
+uint64_t InProcessCompartmentCallCount();
+#endif
@@ -5,6 +5,7 @@
  */
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/mman.h>
@@ -23,6 +24,9 @@
 
 extern "C" void* __real_mmap(void*, size_t, int, int, int, off_t);
 
+// Serialises updates of the remaining range, for compartments running multiple threads.
+static pthread_mutex_t mmap_range_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 // Restrict mappings to the compartment's range by using MAP_FIXED and global variables, initialised
 // by the compartment manager to the base and top of the range reserved to this compartment's
 // mappings.
@@ -49,8 +53,11 @@ extern "C" void* __wrap_mmap(void* addr, size_t length, int prot, int flags, int
 
   size_t aligned_length = align_up(length, sysconf(_SC_PAGE_SIZE));
 
+  pthread_mutex_lock(&mmap_range_mutex);
+
   // Refuse to allocate more than the remaining range allows.
   if (aligned_length > COMPARTMENT_MMAP_RANGE_TOP_SYMBOL - COMPARTMENT_MMAP_RANGE_BASE_SYMBOL) {
+    pthread_mutex_unlock(&mmap_range_mutex);
     errno = ENOMEM;
     return MAP_FAILED;
   }
@@ -61,11 +68,13 @@ extern "C" void* __wrap_mmap(void* addr, size_t length, int prot, int flags, int
   void* res = __real_mmap(reinterpret_cast<void*>(map_addr), length, prot, flags | MAP_FIXED,
                           fd, offset);
 
-  // Update the top of the remaining range. This is clearly not thread-safe, some kind of atomics or
-  // mutex would be needed to support compartments with multiple threads.
+  // Update the top of the remaining range (still under the lock, so that concurrent calls are
+  // handed disjoint pages).
   if (res != MAP_FAILED)
     COMPARTMENT_MMAP_RANGE_TOP_SYMBOL = map_addr;
 
+  pthread_mutex_unlock(&mmap_range_mutex);
+
   return res;
 }
 
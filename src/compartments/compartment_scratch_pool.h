@@ -0,0 +1,110 @@
+/*
+ * Copyright (c) 2020 Arm Limited. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#pragma once
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+#include "utils/align.h"
+
+// Scratch memory shared by the threads of a compartment: a region mapped once by Init(), that
+// requests borrow parts of and give back. A compartment's munmap() does not make the address space
+// available again (see compartment_mmap.cpp), so large buffers that are allocated and freed with
+// each request, or kept per thread, would end up exhausting the compartment's range. The pool
+// bounds the scratch memory of the whole compartment instead, however many threads call into it.
+class CompartmentScratchPool {
+ public:
+  // Maps a pool of size bytes, and faults in its first prefault_length bytes (e.g. the part of the
+  // pool that a typical request uses). Returns false if the memory cannot be mapped.
+  bool Init(size_t size, size_t prefault_length) {
+    // Over-allocate so that the pool can be aligned: mmap() only guarantees page alignment.
+    void* map = mmap(nullptr, size + kHugePageSize, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED)
+      return false;
+
+    base_ = align_up(static_cast<uint8_t*>(map), kHugePageSize);
+    size_ = size;
+    // Only a hint: if transparent huge pages are disabled, we simply get small pages.
+    madvise(base_, size_, MADV_HUGEPAGE);
+    memset(base_, 0, std::min(align_up(prefault_length, kHugePageSize), size_));
+    return true;
+  }
+
+  // Returns length bytes of scratch memory, waiting until enough of the pool is free if needed, or
+  // nullptr if the request can never be satisfied. A thread must not acquire more scratch memory
+  // while holding some, or it may wait forever.
+  uint8_t* Acquire(size_t length) {
+    if (base_ == nullptr || length > size_)
+      return nullptr;
+    length = align_up(length, kHugePageSize);
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    size_t offset;
+    std::vector<Block>::iterator next;
+    pool_cv_.wait(lock, [&] { return FindFreeBlock(length, &offset, &next); });
+    used_.insert(next, {offset, length});
+    return base_ + offset;
+  }
+
+  void Release(uint8_t* scratch) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      size_t offset = scratch - base_;
+      auto it = std::find_if(used_.begin(), used_.end(),
+                             [&](const Block& block) { return block.offset == offset; });
+      // Releasing scratch that was not lent by Acquire() would corrupt the list of used blocks.
+      assert(it != used_.end());
+      used_.erase(it);
+    }
+    pool_cv_.notify_all();
+  }
+
+ private:
+  // Size of a PMD-level huge page with a 4 KiB translation granule.
+  static constexpr size_t kHugePageSize = 2 * 1024 * 1024;
+
+  // Part of the pool lent to a request.
+  struct Block {
+    size_t offset;
+    size_t length;
+  };
+
+  // Looks for the lowest free range of length bytes, so that requests keep reusing the pages that
+  // are already faulted in. Sets *offset to its offset and *next to the first used block after it.
+  bool FindFreeBlock(size_t length, size_t* offset, std::vector<Block>::iterator* next) {
+    size_t free_offset = 0;
+    for (auto it = used_.begin(); it != used_.end(); ++it) {
+      if (it->offset - free_offset >= length) {
+        *offset = free_offset;
+        *next = it;
+        return true;
+      }
+      free_offset = it->offset + it->length;
+    }
+    if (size_ - free_offset < length)
+      return false;
+    *offset = free_offset;
+    *next = used_.end();
+    return true;
+  }
+
+  uint8_t* base_ = nullptr;
+  size_t size_ = 0;
+  std::mutex mutex_;
+  std::condition_variable pool_cv_;
+  // Blocks currently lent to requests, sorted by offset.
+  std::vector<Block> used_;
+};
@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2020 Arm Limited. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+// Thread contexts of the compartment, on the compartment's side.
+// Each thread of the compartment manager that calls into the compartment runs it on a context of
+// its own: a stack and a TLS block (TPIDR). The compartment manager cannot create such a context by
+// itself, since only the compartment's libc knows how to lay out a thread's TLS. Instead, it asks
+// the compartment to create a thread, and borrows its stack and TLS: the thread parks itself
+// forever with all signals blocked, leaving its stack below the parking frame to the compartment
+// manager thread that the context is assigned to. From the compartment's point of view, code
+// running on that context runs in the parked thread.
+
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <condition_variable>
+#include <mutex>
+
+#include "compartment_globals.h"
+#include "compartment_helpers.h"
+
+extern "C" {
+  ptraddr_t COMPARTMENT_THREAD_CONTEXT_SP_SYMBOL;
+  ptraddr_t COMPARTMENT_THREAD_CONTEXT_TP_SYMBOL;
+}
+
+namespace {
+
+// Stack size of the threads backing the contexts, like the compartment's main stack (see
+// kCompartmentStackSize). The stack is mapped from the compartment's mmap() range.
+constexpr size_t kThreadContextStackSize = 1024 * 1024;
+
+// Space left to the parked thread below its parking frame.
+constexpr size_t kParkedThreadStackSize = 4096;
+
+// The compartment manager creates one context at a time. The state is static rather than on the
+// stack of COMPARTMENT_NEW_THREAD_CONTEXT_SYMBOL, whose frames are discarded when it returns.
+std::mutex new_thread_mutex;
+std::condition_variable new_thread_cv;
+bool new_thread_reported;
+
+void* ParkedThread(void*) {
+  ptraddr_t frame = reinterpret_cast<ptraddr_t>(__builtin_frame_address(0));
+  {
+    std::lock_guard<std::mutex> lock(new_thread_mutex);
+    COMPARTMENT_THREAD_CONTEXT_SP_SYMBOL = (frame - kParkedThreadStackSize) & ~ptraddr_t{0xf};
+    COMPARTMENT_THREAD_CONTEXT_TP_SYMBOL =
+        reinterpret_cast<ptraddr_t>(__builtin_thread_pointer());
+    new_thread_reported = true;
+    new_thread_cv.notify_one();
+  }
+
+  // All signals are blocked, so this never returns.
+  for (;;)
+    pause();
+}
+
+// Returns directly through the compartment manager's capability, so that this also works in
+// compartments that implement CompartmentReturn() in-process (see compute_node_fused.cpp).
+[[noreturn]] void ReturnToCompartmentManager(uintcap_t ret) {
+  COMPARTMENT_MANAGER_RETURN_CAPABILITY_SYMBOL(ret);
+}
+
+}
+
+// Called by the compartment manager (on the compartment's main context) to create a new thread
+// context. Sets COMPARTMENT_THREAD_CONTEXT_SP_SYMBOL and COMPARTMENT_THREAD_CONTEXT_TP_SYMBOL, and
+// returns 0 on success.
+extern "C" void COMPARTMENT_NEW_THREAD_CONTEXT_SYMBOL() {
+  new_thread_reported = false;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, kThreadContextStackSize);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+  // The new thread inherits the signal mask, so that no signal handler ever runs on the stack that
+  // it lends to the compartment manager.
+  sigset_t all_signals, old_signals;
+  sigfillset(&all_signals);
+  pthread_sigmask(SIG_SETMASK, &all_signals, &old_signals);
+  pthread_t thread;
+  int err = pthread_create(&thread, &attr, ParkedThread, nullptr);
+  pthread_sigmask(SIG_SETMASK, &old_signals, nullptr);
+  pthread_attr_destroy(&attr);
+  if (err != 0)
+    ReturnToCompartmentManager(-1);
+
+  {
+    std::unique_lock<std::mutex> lock(new_thread_mutex);
+    new_thread_cv.wait(lock, [] { return new_thread_reported; });
+  }
+  ReturnToCompartmentManager(0);
+}
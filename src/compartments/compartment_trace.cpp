@@ -0,0 +1,32 @@
+/*
+ * Copyright (c) 2020 Arm Limited. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include "compartment_trace.h"
+
+#include "compartment_interface.h"
+
+// Looked up and read by the compartment manager.
+extern "C" {
+  CompartmentTraceRing COMPARTMENT_TRACE_RING_SYMBOL;
+}
+
+void CompartmentTraceRecord(uint64_t level, const char* message, uint64_t arg0, uint64_t arg1) {
+  // Claim a slot. The compartment manager may read it at any time: mark the event as incomplete
+  // before writing it, and publish its sequence number once it is written (see
+  // CompartmentDrainTrace()).
+  uint64_t index = __atomic_fetch_add(&COMPARTMENT_TRACE_RING_SYMBOL.head, 1, __ATOMIC_RELAXED);
+  CompartmentTraceEvent& event =
+      COMPARTMENT_TRACE_RING_SYMBOL.events[index & (kCompartmentTraceRingSize - 1)];
+
+  __atomic_store_n(&event.sequence, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&event.timestamp, CompartmentTraceTimestamp(), __ATOMIC_RELAXED);
+  __atomic_store_n(&event.message, message, __ATOMIC_RELAXED);
+  __atomic_store_n(&event.args[0], arg0, __ATOMIC_RELAXED);
+  __atomic_store_n(&event.args[1], arg1, __ATOMIC_RELAXED);
+  __atomic_store_n(&event.level, level, __ATOMIC_RELAXED);
+  __atomic_store_n(&event.sequence, index + 1, __ATOMIC_RELEASE);
+}
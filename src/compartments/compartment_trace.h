@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2020 Arm Limited. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Lightweight tracing for compartments. Rather than writing to the console, which costs a
+// formatted write and a syscall per message, compartments record events in a fixed-size ring in
+// their own memory. The compartment manager looks up the ring (COMPARTMENT_TRACE_RING_SYMBOL) when
+// adding the compartment, and prints and empties it on demand (see CompartmentDrainTrace()) and at
+// exit. Only the most recent kCompartmentTraceRingSize events are kept. The ring may be drained
+// while the compartment is running, possibly on several threads: events that are still being
+// written at that point are skipped.
+//
+// Usage example:
+// COMPARTMENT_TRACE(INFO, "[Node A] Derivation started, N / r", N, r);
+//
+// The message must be a string literal, and is printed as-is (it is not a format string), followed
+// by the arguments.
+
+// Trace levels. Events above COMPARTMENT_TRACE_LEVEL are compiled out entirely, so that they cost
+// nothing; the level can be set per build with -DCOMPARTMENT_TRACE_LEVEL=<n>.
+#define COMPARTMENT_TRACE_LEVEL_NONE    0
+#define COMPARTMENT_TRACE_LEVEL_ERROR   1
+#define COMPARTMENT_TRACE_LEVEL_INFO    2
+#define COMPARTMENT_TRACE_LEVEL_DEBUG   3
+
+#ifndef COMPARTMENT_TRACE_LEVEL
+#define COMPARTMENT_TRACE_LEVEL COMPARTMENT_TRACE_LEVEL_INFO
+#endif
+
+// Must be a power of 2.
+constexpr size_t kCompartmentTraceRingSize = 256;
+
+struct CompartmentTraceEvent {
+  // i + 1 once event i is completely written, 0 while it is being written (see
+  // CompartmentTraceRecord()).
+  uint64_t sequence;
+  // Free-running counter value when the event was recorded (see CompartmentTraceTimestamp()).
+  uint64_t timestamp;
+  // String literal in the compartment's image.
+  const char* message;
+  uint64_t args[2];
+  uint64_t level;
+};
+
+struct CompartmentTraceRing {
+  // Number of events recorded since the compartment started; event i is stored in
+  // events[i % kCompartmentTraceRingSize].
+  uint64_t head;
+  CompartmentTraceEvent events[kCompartmentTraceRingSize];
+};
+
+static_assert((kCompartmentTraceRingSize & (kCompartmentTraceRingSize - 1)) == 0, "");
+
+// Reads a cheap, monotonic counter (no syscall). Its frequency is that of the architectural timer
+// on AArch64, and of the TSC on x86-64.
+static inline uint64_t CompartmentTraceTimestamp() {
+#if defined(__aarch64__)
+  uint64_t cnt;
+  asm volatile("mrs %0, cntvct_el0" : "=r"(cnt));
+  return cnt;
+#elif defined(__x86_64__)
+  return __builtin_ia32_rdtsc();
+#else
+  return 0;
+#endif
+}
+
+// Records an event in this compartment's ring. Use COMPARTMENT_TRACE() rather than calling this
+// directly. Thread-safe.
+void CompartmentTraceRecord(uint64_t level, const char* message, uint64_t arg0, uint64_t arg1);
+
+#define COMPARTMENT_TRACE(level, message, ...) \
+  CompartmentTrace<COMPARTMENT_TRACE_LEVEL_##level>("" message, ##__VA_ARGS__)
+
+template <uint64_t level>
+static inline void CompartmentTrace(const char* message, uint64_t arg0 = 0, uint64_t arg1 = 0) {
+  if (level <= COMPARTMENT_TRACE_LEVEL)
+    CompartmentTraceRecord(level, message, arg0, arg1);
+}
@@ -1,337 +1,373 @@
 
+#include <assert.h>
+#include <string.h>
 #include <sys/random.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
 #include <iostream>
+#include <mutex>
+#include <vector>
 #include <archcap.h>
 #include "compartment_helpers.h"
+#include "compartment_scratch_pool.h"
+#include "compartment_trace.h"
+#include "kdf/pbkdf2_sha256.h"
 #include "protocol.h"
 
-#define RNDr(S, W, i, ii)			\
-	RND(S[(64 - i) % 8], S[(65 - i) % 8],	\
-	    S[(66 - i) % 8], S[(67 - i) % 8],	\
-	    S[(68 - i) % 8], S[(69 - i) % 8],	\
-	    S[(70 - i) % 8], S[(71 - i) % 8],	\
-	    W[i + ii] + Krnd[i + ii])
-
-/* Message schedule computation */
-#define MSCH(W, ii, i)				\
-	W[i + ii + 16] = s1(W[i + ii + 14]) + W[i + ii + 9] + s0(W[i + ii + 1]) + W[i + ii]
-
-// Known only to Node A 
-const int PARALLELIZATION_FACTOR = 2;
-
-typedef struct {
-	uint32_t state[8];
-	uint64_t count;
-	uint8_t buf[64];
-} SHA256_CTX;
-
-typedef struct {
-	SHA256_CTX ictx;
-	SHA256_CTX octx;
-} HMAC_SHA256_CTX;
-
-static const uint32_t initial_state[8] = {
-	0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
-	0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
-};
-
-static inline void be32enc(void * pp, uint32_t x)
-{
-	uint8_t * p = (uint8_t *)pp;
+namespace {
+
+// Worker threads running the ROMix lanes. Node A does not create them: threads created by a
+// compartment cannot call other compartments (see README), and the lanes call Node B. The main
+// executable lends threads to Node A instead (see KdfRequestType::kLaneWorker), which then stay in
+// the pool until the process exits, so the pool is never destroyed. Without workers, the lanes run
+// on the thread making the request.
+class LanePool {
+ public:
+  // Makes the calling thread a worker.
+  [[noreturn]] void Work() {
+    size_t num_workers = num_workers_.fetch_add(1, std::memory_order_relaxed) + 1;
+    COMPARTMENT_TRACE(INFO, "[Node A] Lane worker joined, workers", num_workers);
+    WorkerLoop();
+  }
+
+  // Number of threads running the items of a Run() call: the workers and the calling thread.
+  size_t NumThreads() const {
+    return num_workers_.load(std::memory_order_relaxed) + 1;
+  }
+
+  // Runs fn(i) for every i in [0, count), spreading the calls over the workers and the calling
+  // thread, and returns once all of them have completed. Concurrent requests take turns using the
+  // workers, or run all the items themselves if there are none.
+  void Run(size_t count, const std::function<void(size_t)>& fn) {
+    if (num_workers_.load(std::memory_order_relaxed) == 0) {
+      for (size_t i = 0; i < count; ++i)
+        fn(i);
+      return;
+    }
 
-	p[3] = x & 0xff;
-	p[2] = (x >> 8) & 0xff;
-	p[1] = (x >> 16) & 0xff;
-	p[0] = (x >> 24) & 0xff;
-}
+    std::lock_guard<std::mutex> run_lock(run_mutex_);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      fn_ = &fn;
+      count_ = count;
+      next_ = 0;
+      pending_ = count;
+      ++generation_;
+    }
+    work_cv_.notify_all();
+
+    RunItems();
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_cv_.wait(lock, [this] { return pending_ == 0; });
+    fn_ = nullptr;
+  }
+
+ private:
+  [[noreturn]] void WorkerLoop() {
+    uint64_t seen_generation = 0;
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        work_cv_.wait(lock, [&] { return generation_ != seen_generation; });
+        seen_generation = generation_;
+      }
+      RunItems();
+    }
+  }
+
+  void RunItems() {
+    for (;;) {
+      size_t i;
+      const std::function<void(size_t)>* fn;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (next_ >= count_)
+          return;
+        i = next_++;
+        fn = fn_;
+      }
+
+      (*fn)(i);
+
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (--pending_ == 0)
+        done_cv_.notify_all();
+    }
+  }
+
+  // Held by the thread whose items the workers are running.
+  std::mutex run_mutex_;
+  std::mutex mutex_;
+  std::condition_variable work_cv_;
+  std::condition_variable done_cv_;
+  const std::function<void(size_t)>* fn_ = nullptr;
+  size_t count_ = 0;
+  size_t next_ = 0;
+  size_t pending_ = 0;
+  uint64_t generation_ = 0;
+  std::atomic<size_t> num_workers_{0};
+};
 
-static void be32enc_vect(uint8_t * dst, const uint32_t * src, size_t len)
-{
-	size_t i;
-	/* Sanity-check. */
-	assert(len % 4 == 0);
+LanePool& lane_pool = *new LanePool;
 
-	/* Encode vector, one word at a time. */
-	for (i = 0; i < len / 4; i++)
-		be32enc(dst + i * 4, src[i]);
 }
 
-static inline void be32enc(void * pp, uint32_t x)
-{
-	uint8_t * p = (uint8_t *)pp;
-
-	p[3] = x & 0xff;
-	p[2] = (x >> 8) & 0xff;
-	p[1] = (x >> 16) & 0xff;
-	p[0] = (x >> 24) & 0xff;
-}
+namespace {
+
+// Upper bound on the size of the ROMix blocks of the batch items that are derived together (see
+// derive_batch()). An item that needs more is derived on its own.
+constexpr size_t kBatchBlocksBudget = 4 * 1024 * 1024;
+
+// Memory for the ROMix blocks, shared by all the threads calling into Node A (see
+// compartment_scratch_pool.h). The blocks of any valid item fit (see ScryptParametersValid()).
+CompartmentScratchPool blocks_pool;
+
+// Per-request state, kept across requests so that its buffers are only allocated when a request
+// needs more than any previous one. Each thread calling into Node A has its own.
+struct KdfBatch {
+  void Resize(size_t count) {
+    inputs.resize(count);
+    secrets.resize(count);
+    statuses.resize(count);
+    password_contexts.resize(count);
+    blocks_offsets.resize(count);
+  }
+
+  std::vector<KDF_Inputs> inputs;
+  std::vector<Secret> secrets;
+  std::vector<KdfStatus> statuses;
+  // The password's HMAC key schedule is shared by both PBKDF2 passes.
+  std::vector<HMAC_SHA256_CTX> password_contexts;
+  std::vector<size_t> blocks_offsets;
+};
 
-static inline uint32_t be32dec(const void * pp)
-{
-	const uint8_t * p = (uint8_t const *)pp;
+thread_local KdfBatch kdf_batch;
 
-	return ((uint32_t)(p[3]) | ((uint32_t)(p[2]) << 8) |
-	    ((uint32_t)(p[1]) << 16) | ((uint32_t)(p[0]) << 24));
-}
+// A group of consecutive ROMix lanes of a batch item, sent to Node B in a single request.
+struct LaneGroup {
+  size_t item;
+  uint8_t* blocks;
+  size_t count;
+};
 
-static void be32dec_vect(uint32_t * dst, const uint8_t * src, size_t len)
-{
-	size_t i;
-	/* Sanity-check. */
-	assert(len % 4 == 0);
-	/* Decode vector, one word at a time. */
-	for (i = 0; i < len / 4; i++)
-		dst[i] = be32dec(src + i * 4);
 }
 
-static void SHA256_Transform(uint32_t state[static restrict 8], const uint8_t block[static restrict 64], uint32_t W[static restrict 64], uint32_t S[static restrict 8])
+/*
+ * B_i <-- MF(B_i, N) for the count lanes at blocks, computed by Node B (which
+ * interleaves them).  Returns false if Node B failed.
+ */
+bool romix_lane_group(uint8_t* blocks, size_t count, uint64_t N, size_t r)
 {
-	int i;
-	/* 1. Prepare the first part of the message schedule W. */
-	be32dec_vect(W, block, 64);
-
-	/* 2. Initialize working variables. */
-	memcpy(S, state, 32);
-
-	/* 3. Mix. */
-	for (i = 0; i < 64; i += 16) {
-		RNDr(S, W, 0, i);
-		RNDr(S, W, 1, i);
-		RNDr(S, W, 2, i);
-		RNDr(S, W, 3, i);
-		RNDr(S, W, 4, i);
-		RNDr(S, W, 5, i);
-		RNDr(S, W, 6, i);
-		RNDr(S, W, 7, i);
-		RNDr(S, W, 8, i);
-		RNDr(S, W, 9, i);
-		RNDr(S, W, 10, i);
-		RNDr(S, W, 11, i);
-		RNDr(S, W, 12, i);
-		RNDr(S, W, 13, i);
-		RNDr(S, W, 14, i);
-		RNDr(S, W, 15, i);
-
-		if (i == 48)
-			break;
-		MSCH(W, 0, i);
-		MSCH(W, 1, i);
-		MSCH(W, 2, i);
-		MSCH(W, 3, i);
-		MSCH(W, 4, i);
-		MSCH(W, 5, i);
-		MSCH(W, 6, i);
-		MSCH(W, 7, i);
-		MSCH(W, 8, i);
-		MSCH(W, 9, i);
-		MSCH(W, 10, i);
-		MSCH(W, 11, i);
-		MSCH(W, 12, i);
-		MSCH(W, 13, i);
-		MSCH(W, 14, i);
-		MSCH(W, 15, i);
+	uint8_t* __capability blocks_segment_cap = DeriveBufferCapability(
+	    blocks, count * 128 * r,
+	    ARCHCAP_PERM_GLOBAL | ARCHCAP_PERM_STORE | ARCHCAP_PERM_LOAD);
+
+	uintcap_t ret = CompartmentCallThroughGate<kComputeNodeBCompartmentId>(
+	    blocks_segment_cap, N, r, count);
+	if (ret != 0) {
+		COMPARTMENT_TRACE(ERROR, "[Node A] Node B failed to send block, lanes", count);
+		return false;
 	}
-
-	/* 4. Mix local working variables into global state. */
-	for (i = 0; i < 8; i++)
-		state[i] += S[i];
+	return true;
 }
 
-
-static void SHA256_Init(SHA256_CTX * ctx)
+/**
+ * add_lane_groups(item, blocks, r, p, groups):
+ * Split the p lanes of blocks into groups that Node B can interleave, unless
+ * that would leave lane threads idle, and append them to groups.
+ */
+void add_lane_groups(size_t item, uint8_t* blocks, size_t r, size_t p,
+    std::vector<LaneGroup>* groups)
 {
-	/* Zero bits processed so far. */
-	ctx->count = 0;
-
-	/* Initialize state. */
-	memcpy(ctx->state, initial_state, sizeof(initial_state));
+	const size_t lane_threads = lane_pool.NumThreads();
+	const size_t lanes_per_thread = (p + lane_threads - 1) / lane_threads;
+	const size_t group = std::min(lanes_per_thread, kRomixMaxInterleavedLanes);
 
+	/* 2: for i = 0 to p - 1 do */
+	for (size_t i = 0; i < p; i += group)
+		groups->push_back({item, &blocks[i * 128 * r], std::min(group, p - i)});
 }
 
-static void SHA256_Update(SHA256_CTX * ctx, const void * in, size_t len, uint32_t tmp32[static restrict 72])
-{
-	uint32_t r;
-	const uint8_t * src = in;
-
-	/* Return immediately if we have nothing to do. */
-	if (len == 0)
-		return;
-
-	/* Number of bytes left in the buffer from previous updates. */
-	r = (ctx->count >> 3) & 0x3f;
-
-	/* Update number of bits. */
-	ctx->count += (uint64_t)(len) << 3;
+bool sanityChecks(size_t buflen, uint64_t N, size_t r, size_t p){
 
-	/* Handle the case where we don't need to perform any transforms. */
-	if (len < 64 - r) {
-		memcpy(&ctx->buf[r], src, len);
-		return;
-	}
-
-	/* Finish the current block. */
-	memcpy(&ctx->buf[r], src, 64 - r);
-	SHA256_Transform(ctx->state, ctx->buf, &tmp32[0], &tmp32[64]);
-	src += 64 - r;
-	len -= 64 - r;
-
-	/* Perform complete blocks. */
-	while (len >= 64) {
-		SHA256_Transform(ctx->state, src, &tmp32[0], &tmp32[64]);
-		src += 64;
-		len -= 64;
+    #if SIZE_MAX > UINT32_MAX
+	if (buflen > (((uint64_t)(1) << 32) - 1) * 32) {
+		return false;
 	}
+    #endif
 
-	/* Copy left over data into buffer. */
-	memcpy(ctx->buf, src, len);
-}
-
-static void init(HMAC_SHA256_CTX* ctx, const void * _K, size_t Klen, uint32_t tmp32[static restrict 72], uint8_t pad[static restrict 64],
-    uint8_t khash[static restrict 32]){
-
-    const uint8_t * K = _K;
-	size_t i;
-
-    SHA256_Init(&ctx->ictx);
-    memset(pad, 0x36, 64);
-	for (i = 0; i < Klen; i++)
-		pad[i] ^= K[i];
-    
-    SHA256_Update(&ctx->ictx, pad, 64, tmp32);
-
-    SHA256_Init(&ctx->octx);
-	memset(pad, 0x5c, 64);
-	for (i = 0; i < Klen; i++)
-		pad[i] ^= K[i];
-    
-    SHA256_Update(&ctx->octx, pad, 64, tmp32);
+    return ScryptParametersValid(N, r, p);
 
 }
 
-void key_derivation_function(const uint8_t * passwd, size_t passwdlen, const uint8_t * salt,
-    size_t saltlen, uint64_t c, uint8_t * buf, size_t dkLen){
-
-    HMAC_SHA256_CTX Phctx, PShctx, hctx;
-    uint8_t ivec[4];
-    uint32_t tmp32[72];
-	uint8_t tmp8[96];
-	size_t i;
-    uint8_t U[32];
-	uint8_t T[32];
-	uint64_t j;
-	int k;
-	size_t clen;
-
-    if(dkLen <= 32 * (size_t)(UINT32_MAX)){
-        
-        init(&Phctx, passwd, passwdlen, tmp32, &tmp8[0], &tmp8[64]);
-
-        memcpy(&PShctx, &Phctx, sizeof(HMAC_SHA256_CTX));
-	    SHA256_Update(&PShctx->ictx, salt, saltlen, tmp32);
-
-        /* Iterate through the blocks. */
-	    for (i = 0; i * 32 < dkLen; i++) {
-		    /* Generate INT(i + 1). */
-		    be32enc(ivec, (uint32_t)(i + 1));
-
-		    /* Compute U_1 = PRF(P, S || INT(i)). */
-		    memcpy(&hctx, &PShctx, sizeof(HMAC_SHA256_CTX));
-		    SHA256_Update(&hctx->ictx, ivec, 4, tmp32);
-            be32enc_vect(U, hctx->state, 32);
-
-		    /* T_i = U_1 ... */
-		    memcpy(T, U, 32);
-
-		    /* Copy as many bytes as necessary into buf. */
-		    clen = dkLen - i * 32;
-		    if (clen > 32)
-			    clen = 32;
-		    memcpy(&buf[i * 32], T, clen);
-	    }
-
-    }
+/**
+ * derive_items(batch, begin, end, blocks):
+ * Compute the secrets of the valid items in [begin, end) of batch, using
+ * blocks for their ROMix blocks (at the offsets set in the batch).  Each
+ * step runs on the lane pool across all the items, so that the ROMix lanes of
+ * different items are spread over the lane threads as well.
+ */
+void derive_items(KdfBatch& batch, size_t begin, size_t end, uint8_t* blocks)
+{
+	std::vector<size_t> items;
+	std::vector<LaneGroup> groups;
+	for (size_t i = begin; i < end; i++) {
+		if (batch.statuses[i] != KdfStatus::kOk)
+			continue;
+		items.push_back(i);
+		add_lane_groups(i, &blocks[batch.blocks_offsets[i]], batch.inputs[i].r,
+		    batch.inputs[i].p, &groups);
+	}
 
+	/* 1: (B_0 ... B_{p-1}) <-- PBKDF2(P, S, 1, p * MFLen) */
+	lane_pool.Run(items.size(), [&](size_t j) {
+		const size_t i = items[j];
+		const KDF_Inputs& inputs = batch.inputs[i];
+		HMAC_SHA256_Init(&batch.password_contexts[i],
+		    reinterpret_cast<const uint8_t*>(inputs.passwd),
+		    strnlen(inputs.passwd, sizeof(inputs.passwd)));
+		key_derivation_function(&batch.password_contexts[i],
+		    reinterpret_cast<const uint8_t*>(inputs.salt),
+		    strnlen(inputs.salt, sizeof(inputs.salt)), 1,
+		    &blocks[batch.blocks_offsets[i]], inputs.p * 128 * inputs.r);
+	});
+
+	/* 3: B_i <-- MF(B_i, N) */
+	std::mutex failed_mutex;
+	lane_pool.Run(groups.size(), [&](size_t g) {
+		const LaneGroup& group = groups[g];
+		const KDF_Inputs& inputs = batch.inputs[group.item];
+		if (!romix_lane_group(group.blocks, group.count, inputs.N, inputs.r)) {
+			std::lock_guard<std::mutex> lock(failed_mutex);
+			batch.statuses[group.item] = KdfStatus::kFailed;
+		}
+	});
+
+	/* 5: DK <-- PBKDF2(P, B, 1, dkLen) */
+	lane_pool.Run(items.size(), [&](size_t j) {
+		const size_t i = items[j];
+		if (batch.statuses[i] != KdfStatus::kOk)
+			return;
+		const KDF_Inputs& inputs = batch.inputs[i];
+		key_derivation_function(&batch.password_contexts[i], &blocks[batch.blocks_offsets[i]],
+		    inputs.p * 128 * inputs.r, 1, batch.secrets[i].output, OUTPUT_BUFLEN);
+	});
 }
 
-bool sanityChecks(size_t buflen){
-
-    #if SIZE_MAX > UINT32_MAX
-	if (buflen > (((uint64_t)(1) << 32) - 1) * 32) {
-		return false;
-	}
-    #endif
-
-    if ((uint64_t)(r) * (uint64_t)(PARALLELIZATION_FACTOR) >= (1 << 30)) {
-		return false;
+/**
+ * derive_batch(batch, count):
+ * Compute the secrets of the count items of batch and set their status.  The
+ * items are derived in chunks whose ROMix blocks fit in kBatchBlocksBudget,
+ * each borrowing its blocks from blocks_pool.
+ */
+void derive_batch(KdfBatch& batch, size_t count)
+{
+	for (size_t i = 0; i < count; i++) {
+		const KDF_Inputs& inputs = batch.inputs[i];
+		memset(&batch.secrets[i], 0, sizeof(Secret));
+		batch.statuses[i] = KdfStatus::kOk;
+		if (!sanityChecks(OUTPUT_BUFLEN, inputs.N, inputs.r, inputs.p)) {
+			COMPARTMENT_TRACE(ERROR, "[Node A] Invalid scrypt parameters, N / r", inputs.N,
+			    inputs.r);
+			batch.statuses[i] = KdfStatus::kInvalidParameters;
+		}
 	}
 
-    if (r > SIZE_MAX / 128 / PARALLELIZATION_FACTOR) {
-// #if SIZE_MAX / 256 <= UINT32_MAX
-// 	    (r > SIZE_MAX / 256) ||
-// #endif) {
-		return false;
+	size_t begin = 0;
+	while (begin < count) {
+		/* Gather the next chunk of items. */
+		size_t end = begin;
+		size_t size = 0;
+		for (; end < count; end++) {
+			if (batch.statuses[end] != KdfStatus::kOk)
+				continue;
+			const size_t item_size = 128 * batch.inputs[end].r * batch.inputs[end].p;
+			if (size != 0 && size + item_size > kBatchBlocksBudget)
+				break;
+			batch.blocks_offsets[end] = size;
+			size += item_size;
+		}
+
+		if (size != 0) {
+			uint8_t* blocks = blocks_pool.Acquire(size);
+			if (blocks == nullptr) {
+				for (size_t i = begin; i < end; i++) {
+					if (batch.statuses[i] == KdfStatus::kOk)
+						batch.statuses[i] = KdfStatus::kFailed;
+				}
+			} else {
+				derive_items(batch, begin, end, blocks);
+				/* The blocks are password-equivalent. */
+				memset(blocks, 0, size);
+				blocks_pool.Release(blocks);
+			}
+		}
+		begin = end;
 	}
-
-    return true;
-
 }
 
-COMPARTMENT_ENTRY_POINT(KDF_Inputs* __capability input, Secret* __capability client_derived_secret) {
-    uint8_t* blocks;
-	// uint8_t* V;
-	// uint8_t* XY;
-	uint32_t i;
-    Secret secret;
-    
-    bool checks = sanityChecks(OUTPUT_BUFLEN)
-
-    if(!checks){
+COMPARTMENT_ENTRY_POINT(KdfRequestType request, const KDF_Inputs* __capability inputs,
+                        Secret* __capability secrets, size_t count,
+                        KdfStatus* __capability statuses) {
+  switch (request) {
+    case KdfRequestType::kDerive:
+      count = 1;
+      break;
+    case KdfRequestType::kDeriveBatch:
+      if (count == 0 || count > kKdfMaxBatchSize ||
+          !IsCapabilityAccessible(statuses, count * sizeof(KdfStatus), ARCHCAP_PERM_STORE))
         CompartmentReturn(-1);
-    }
-    else {
-        /* Allocate memory. */
-	    if ((blocks = malloc(128 * blockSize * PARALLELIZATION_FACTOR)) == NULL)
-		    CompartmentReturn(-1);
-
-        //do conditional check for the password capability of that is still correct?
-
-        key_derivation_function(&input.passwd, strlen(&input.passwd), &input.salt, strlen(&input.salt), 1, blocks, PARALLELIZATION_FACTOR * 128 * blockSize);
-
-        /* 2: for i = 0 to p - 1 do */
-	    for (i = 0; i < PARALLELIZATION_FACTOR; i++) {
-		    /* 3: B_i <-- MF(B_i, N) */
-            //ensure the blocks data is getting set ele re type cast to temp
-            uint8_t* __capability blocks_segment_cap = archcap_c_ddc_cast(&blocks[i * 128 * blockSize]);
-            blocks_segment_cap = archcap_c_perms_set(blocks_segment_cap, ARCHCAP_PERM_GLOBAL | ARCHCAP_PERM_STORE | ARCHCAP_PERM_LOAD);
-		    // romix(&blocks[i * 128 * r], r, N, V, XY);
-            uintcap_t ret = CompartmentCall(kComputeNodeBCompartmentId, AsUintcap(blocks_segment_cap));
-            if (ret == 0) {
-                std::cout << "[Node A] Returned Block: ";
-                PrintKey(&blocks[i * 128 * blockSize]);
-            } else {
-                std::cout << "[Node A] Node B failed to send block\n";
-            }
-	    }
-
-        key_derivation_function(&input.passwd, strlen(&input.passwd), blocks, PARALLELIZATION_FACTOR * 128 * blockSize, 1, &secret->output, OUTPUT_BUFLEN);
-
-        
-        if (archcap_c_tag_get(client_derived_secret) && (archcap_c_limit_get(client_derived_secret) - archcap_c_address_get(client_derived_secret)) >= sizeof(secret) &&
-          (archcap_c_perms_get(client_derived_secret) & ARCHCAP_PERM_STORE) != 0) {
-            // Use memcpy_c() to write via the client capability. We use DDC to construct a source
-            // capability.
-            memcpy_c(client_derived_secret, archcap_c_ddc_cast(&secret), sizeof(secret));
-            CompartmentReturn(0);
-        } else {
-            CompartmentReturn(-1);
-        }
-    }
-
+      break;
+    case KdfRequestType::kLaneWorker:
+      lane_pool.Work();
+    default:
+      COMPARTMENT_TRACE(ERROR, "[Node A] Unknown request", static_cast<uint64_t>(request));
+      CompartmentReturn(-1);
+  }
+
+  if (!IsCapabilityAccessible(inputs, count * sizeof(KDF_Inputs), ARCHCAP_PERM_LOAD) ||
+      !IsCapabilityAccessible(secrets, count * sizeof(Secret), ARCHCAP_PERM_STORE))
+    CompartmentReturn(-1);
+
+  KdfBatch& batch = kdf_batch;
+  batch.Resize(count);
+  memcpy_c(archcap_c_ddc_cast(batch.inputs.data()), inputs, count * sizeof(KDF_Inputs));
+  COMPARTMENT_TRACE(INFO, "[Node A] Key derivation, items / first N", count, batch.inputs[0].N);
+
+  derive_batch(batch, count);
+
+  // Use memcpy_c() to write via the client capabilities. We use DDC to construct the source
+  // capabilities.
+  memcpy_c(secrets, archcap_c_ddc_cast(batch.secrets.data()), count * sizeof(Secret));
+  if (request == KdfRequestType::kDeriveBatch)
+    memcpy_c(statuses, archcap_c_ddc_cast(batch.statuses.data()), count * sizeof(KdfStatus));
+  const bool failed = request == KdfRequestType::kDerive && batch.statuses[0] != KdfStatus::kOk;
+
+  // The passwords, the secrets and the key schedules must not be kept around once the request is
+  // done. CompartmentReturn() does not unwind, so this is the last chance to wipe them.
+  memset(batch.inputs.data(), 0, count * sizeof(KDF_Inputs));
+  memset(batch.secrets.data(), 0, count * sizeof(Secret));
+  memset(batch.password_contexts.data(), 0, count * sizeof(HMAC_SHA256_CTX));
+  CompartmentReturn(failed ? -1 : 0);
 }
 
 int main(int, char** argv) {
-
-  std::cout << "[Node A] Parallelization Factor Compartment @" << argv[0] << " initialized" << std::endl;
+  SelectSHA256Transform();
+  SelectPBKDF2Lanes();
+
+  // Fault in the blocks of a full chunk, so that typical requests do not take page faults.
+  if (!blocks_pool.Init(kScryptMaxLaneMemory, kBatchBlocksBudget)) {
+    std::cerr << "[Node A] Failed to map the ROMix block memory" << std::endl;
+    return 1;
+  }
+
+  std::cout << "[Node A] Parallelization Factor Compartment @" << argv[0] << " initialized ("
+            << SHA256_Transform_name << " SHA256, " << PBKDF2_SHA256_U1_multi_name
+            << " multi-buffer PBKDF2)"
+            << std::endl;
 
   // Return to the compartment manager, letting it know that we have completed our initialization.
   CompartmentReturn();
@@ -1,161 +1,395 @@
 
+#include <string.h>
+#include <algorithm>
 #include <iostream>
 #include <archcap.h>
 #include "compartment_helpers.h"
+#include "compartment_scratch_pool.h"
+#include "compartment_trace.h"
 #include "protocol.h"
 
 
-// Known only to Node B 
-const int MEMORY_COST_PARAMETER = 8; //actually needs to be as high as 16384;
-
-bool sanityChecks(){
-    if (((MEMORY_COST_PARAMETER & (MEMORY_COST_PARAMETER - 1)) != 0) || (MEMORY_COST_PARAMETER == 0)) {
-		return false;
-	}
-
-    if ((MEMORY_COST_PARAMETER > SIZE_MAX / 128 / blockSize)) {
-		return false;
-	}
-
-    return true;
+// (N, r) come with every request (see KDF_Inputs), Node B only checks that they are acceptable.
+bool sanityChecks(uint64_t N, size_t r){
+    return ScryptParametersValid(N, r, 1);
 }
 
-void blkcpy(uint8_t * dest, uint8_t * src, size_t len)
+/* Blocks are handled as host-endian words, len counts words. */
+void blkcpy(uint32_t * dest, const uint32_t * src, size_t len)
 {
 	size_t i;
 	for (i = 0; i < len; i++)
 		dest[i] = src[i];
 }
 
-void blkxor(uint8_t * dest, uint8_t * src, size_t len)
+void blkxor(uint32_t * dest, const uint32_t * src, size_t len)
 {
 	size_t i;
 	for (i = 0; i < len; i++)
 		dest[i] ^= src[i];
 }
 
-inline uint64_t le64dec(const void * pp)
+static inline uint32_t
+le32dec(const void * pp)
 {
 	const uint8_t * p = (uint8_t const *)pp;
 
-	return ((uint64_t)(p[0]) | ((uint64_t)(p[1]) << 8) |
-	    ((uint64_t)(p[2]) << 16) | ((uint64_t)(p[3]) << 24) |
-	    ((uint64_t)(p[4]) << 32) | ((uint64_t)(p[5]) << 40) |
-	    ((uint64_t)(p[6]) << 48) | ((uint64_t)(p[7]) << 56));
+	return ((uint32_t)(p[0]) | ((uint32_t)(p[1]) << 8) |
+	    ((uint32_t)(p[2]) << 16) | ((uint32_t)(p[3]) << 24));
+}
+
+static inline void
+le32enc(void * pp, uint32_t x)
+{
+	uint8_t * p = (uint8_t *)pp;
+
+	p[0] = x & 0xff;
+	p[1] = (x >> 8) & 0xff;
+	p[2] = (x >> 16) & 0xff;
+	p[3] = (x >> 24) & 0xff;
 }
 
 /**
- * integerify(B, blockSize):
+ * integerify(B, r):
  * Return the result of parsing B_{2r-1} as a little-endian integer.
  */
-uint64_t integerify(uint8_t * B, size_t r)
+uint64_t integerify(const uint32_t * B, size_t r)
 {
-	uint8_t * X = &B[(2 * r - 1) * 64];
-	return (le64dec(X));
+	const uint32_t * X = &B[(2 * r - 1) * 16];
+	return (((uint64_t)(X[1]) << 32) + X[0]);
 }
 
+// Read-write access to a block, as required by Node C.
+constexpr archcap_perms_t kBlockPerms =
+    ARCHCAP_PERM_GLOBAL | ARCHCAP_PERM_STORE | ARCHCAP_PERM_LOAD;
+
+// Returns from the current request (see the entry point).
+[[noreturn]] void ReturnFromRequest(uintcap_t ret);
+
+#if defined(COMPUTE_NODE_B_PER_BLOCK_SALSA)
+
 /**
  * blockmix_salsa8(B, Y, r):
  * Compute B = BlockMix_{salsa20/8, r}(B).  The input B must be 128r bytes in
  * length; the temporary space Y must also be the same size.
+ * This variant calls Node C once per 64-byte sub-block (2r calls per BlockMix),
+ * and is only kept for comparison with the batched variant below.
  */
-void blockmix_salsa8(uint8_t* B, uint8_t* Y, size_t blockSize)
+void blockmix_salsa8(uint32_t* B, uint32_t* Y, size_t r)
 {
-	uint8_t X[64];
+	uint32_t X[16];
 	size_t i;
 
-    bool checks = sanityChecks()
-
-    if(!checks){
-        CompartmentReturn(-1);
-    }
-
 	/* 1: X <-- B_{2r - 1} */
-	blkcpy(X, &B[(2 * blockSize - 1) * 64], 64);
+	blkcpy(X, &B[(2 * r - 1) * 16], 16);
 
 	/* 2: for i = 0 to 2r - 1 do */
-	for (i = 0; i < 2 * blockSize; i++) {
+	for (i = 0; i < 2 * r; i++) {
 		/* 3: X <-- H(X \xor B_i) */
-		blkxor(X, &B[i * 64], 64);
-        
-        uint8_t* __capability block_mixed_hash_cap = archcap_c_ddc_cast(&X);
-        block_mixed_hash_cap = archcap_c_perms_set(block_mixed_hash_cap, ARCHCAP_PERM_GLOBAL | ARCHCAP_PERM_STORE | ARCHCAP_PERM_LOAD);
-        uintcap_t ret = CompartmentCall(kComputeNodeCCompartmentId, AsUintcap(block_mixed_hash_cap));
+		blkxor(X, &B[i * 16], 16);
+
+        uint32_t (* __capability block_mixed_hash_cap)[16] = archcap_c_ddc_cast(&X);
+        block_mixed_hash_cap = archcap_c_perms_set(block_mixed_hash_cap, kBlockPerms);
+        uintcap_t ret = CompartmentCallThroughGate<kComputeNodeCCompartmentId>(
+            SalsaCoreRequestType::kSalsa20_8, block_mixed_hash_cap);
 		// salsa20_8(X);
 
         if (ret == 0) {
-            std::cout << "[Node B] Returned Salsa Core: ";
-            PrintKey(&X);
+            COMPARTMENT_TRACE(DEBUG, "[Node B] Returned Salsa Core (first words)", X[0], X[1]);
         } else {
-            std::cout << "[Node B] Node C failed to return salsa core\n";
+            COMPARTMENT_TRACE(ERROR, "[Node B] Node C failed to return salsa core");
+            ReturnFromRequest(-1);
         }
 
 		/* 4: Y_i <-- X */
-		blkcpy(&Y[i * 64], X, 64);
+		blkcpy(&Y[i * 16], X, 16);
 	}
 
 	/* 6: B' <-- (Y_0, Y_2 ... Y_{2r-2}, Y_1, Y_3 ... Y_{2r-1}) */
-	for (i = 0; i < blockSize; i++)
-		blkcpy(&B[i * 64], &Y[(i * 2) * 64], 64);
-	for (i = 0; i < blockSize; i++)
-		blkcpy(&B[(i + blockSize) * 64], &Y[(i * 2 + 1) * 64], 64);
+	for (i = 0; i < r; i++)
+		blkcpy(&B[i * 16], &Y[(i * 2) * 16], 16);
+	for (i = 0; i < r; i++)
+		blkcpy(&B[(i + r) * 16], &Y[(i * 2 + 1) * 16], 16);
 }
 
-COMPARTMENT_ENTRY_POINT(uint8_t* __capability input_chunk) {
-    uint8_t* V;
-	uint8_t* XY;
-
-    if ((XY = malloc(256 * blockSize)) == NULL)
-		CompartmentReturn(-1);
-	if ((V = malloc(128 * blockSize * MEMORY_COST_PARAMETER)) == NULL)
-		CompartmentReturn(-1);
-    
-    uint8_t* X = XY;
-	uint8_t* Y = &XY[128 * blockSize];
+#else
+
+/**
+ * blockmix_salsa8(B, Y, r):
+ * Compute B = BlockMix_{salsa20/8, r}(B).  The input B must be 128r bytes in
+ * length; the temporary space Y must also be the same size.
+ * The whole BlockMix is delegated to Node C in a single call, which works on B
+ * and Y directly through the capabilities we pass it.
+ */
+void blockmix_salsa8(uint32_t* B, uint32_t* Y, size_t r)
+{
+	uint32_t* __capability B_cap = DeriveBufferCapability(B, 128 * r, kBlockPerms);
+	uint32_t* __capability Y_cap = DeriveBufferCapability(Y, 128 * r, kBlockPerms);
+
+	uintcap_t ret = CompartmentCallThroughGate<kComputeNodeCCompartmentId>(
+	    SalsaCoreRequestType::kBlockMixSalsa8, B_cap, Y_cap, r, static_cast<size_t>(1));
+	if (ret != 0) {
+		COMPARTMENT_TRACE(ERROR, "[Node B] Node C failed to mix block");
+		ReturnFromRequest(-1);
+	}
+}
+
+#endif // COMPUTE_NODE_B_PER_BLOCK_SALSA
+
+namespace {
+
+// Scratch memory for ROMix: one V table (32 * r * N words) per interleaved lane, followed by one XY
+// (64 * r words) per lane.
+// Requests borrow their scratch memory from a pool shared by all the threads calling into Node B
+// (see compartment_scratch_pool.h). The pool is sized for the largest request; smaller requests
+// share it, and wait for memory to be returned when it is all in use. Pages stay faulted in once
+// touched, so only the first requests to use a part of the pool take page faults.
+// The pool is aligned to and advised for transparent huge pages: at production values of N, V is
+// tens of MiB and the random accesses to V_j would otherwise miss the TLB on almost every block.
+class RomixScratchPool : public CompartmentScratchPool {
+ public:
+  // Size of the scratch memory of a request for the given number of lanes of (N, r).
+  static size_t Length(uint64_t N, size_t r, size_t lanes) {
+    return lanes * (128 * r * N + 256 * r);
+  }
+
+  // Maps the pool, and faults in the first prefault_length bytes (the part of the pool that a
+  // single request uses). Returns false if the memory cannot be mapped.
+  bool Init(size_t prefault_length) {
+    return CompartmentScratchPool::Init(kPoolSize, prefault_length);
+  }
+
+  static uint32_t* V(uint8_t* scratch, uint64_t N, size_t r, size_t lane) {
+    return reinterpret_cast<uint32_t*>(scratch) + lane * 32 * r * N;
+  }
+  static uint32_t* XY(uint8_t* scratch, uint64_t N, size_t r, size_t lanes, size_t lane) {
+    return V(scratch, N, r, lanes) + lane * 64 * r;
+  }
+
+ private:
+  // Enough for a request with the maximum number of lanes of the maximum size (see
+  // ScryptParametersValid()).
+  static constexpr size_t kPoolSize = kRomixMaxInterleavedLanes * kScryptMaxLaneMemory;
+};
+
+RomixScratchPool romix_scratch_pool;
+
+// Scratch memory of the request that the calling thread is serving, if any.
+thread_local uint8_t* request_scratch = nullptr;
+
+// V tables at least this large are written with non-temporal stores. Smaller ones are likely to
+// stay in the last-level cache, and are better written normally.
+constexpr size_t kStreamingStoreMinLength = 8 * 1024 * 1024;
+
+} // namespace
+
+#if defined(__has_builtin)
+#if __has_builtin(__builtin_nontemporal_store)
+#define HAVE_NONTEMPORAL_STORE 1
+#endif
+#endif
+
+/**
+ * blkcpy_stream(dest, src, len):
+ * Same as blkcpy(), but with non-temporal stores where the compiler provides
+ * them, so that writing V does not evict the working set from the caches.  Both
+ * buffers must be 16-byte aligned, and len a multiple of 4.
+ */
+static inline void blkcpy_stream(uint32_t * dest, const uint32_t * src, size_t len)
+{
+#if defined(HAVE_NONTEMPORAL_STORE)
+	typedef uint32_t vec128 __attribute__((vector_size(16)));
+	vec128 v;
+	size_t i;
+
+	for (i = 0; i < len; i += 4) {
+		memcpy(&v, &src[i], sizeof(v));
+		__builtin_nontemporal_store(v, (vec128 *)&dest[i]);
+	}
+#else
+	blkcpy(dest, src, len);
+#endif
+}
+
+/**
+ * prefetch_block(B, r):
+ * Start loading the 128r-byte block B into the caches.
+ */
+static inline void prefetch_block(const uint32_t * B, size_t r)
+{
+	size_t k;
+
+	/* One 64-byte cache line at a time. */
+	for (k = 0; k < 32 * r; k += 16)
+		__builtin_prefetch(&B[k]);
+}
+
+/**
+ * smix<kN, kR, L>(XY, V, N, r):
+ * Compute X_l = SMix_r(X_l, N) for L independent lanes, where X_l is the first
+ * 32r words of XY[l], in host byte order.  Each V[l] must be 32rN words in
+ * length, and each XY[l] must be 64r words in length.  Non-zero kN and kR
+ * override N and r, so that the block copies and xors of a specialization work
+ * on compile-time sizes and fully unroll.
+ *
+ * The lanes are processed in turn at every step, so that in the second loop
+ * the random read of V_j for one lane is prefetched while the other lanes are
+ * being mixed, rather than stalling on memory.
+ */
+template <uint64_t kN, size_t kR, size_t L>
+void smix(uint32_t* const * XY, uint32_t* const * V, uint64_t N, size_t r)
+{
+	if (kN != 0)
+		N = kN;
+	if (kR != 0)
+		r = kR;
+
+	uint32_t* X[L];
+	uint32_t* Y[L];
 	uint64_t i;
-	uint64_t j;
-
-    // Needs investigation does store provide the load perm by default?
-    if (archcap_c_tag_get(input_chunk) && (archcap_c_limit_get(input_chunk) - archcap_c_address_get(input_chunk)) >= sizeof(X) &&
-          (archcap_c_perms_get(input_chunk) & ARCHCAP_PERM_LOAD) != 0 && (archcap_c_perms_get(input_chunk) & ARCHCAP_PERM_STORE) != 0) {
-              
-        //check if the capability has any issues doing the blkcpy, else need to do memcpy
-        blkcpy(X, input_chunk, 128 * blockSize);
-
-        for (i = 0; i < MEMORY_COST_PARAMETER; i++) {
-		    /* 3: V_i <-- X */
-		    blkcpy(&V[i * (128 * blockSize)], X, 128 * blockSize);
-		    /* 4: X <-- H(X) */
-		    blockmix_salsa8(X, Y, blockSize);
-	    }
-
-        /* 6: for i = 0 to N - 1 do */
-	    for (i = 0; i < MEMORY_COST_PARAMETER; i++) {
-		    /* 7: j <-- Integerify(X) mod N */
-		    j = integerify(X, blockSize) & (MEMORY_COST_PARAMETER - 1);
-            std::cout << j;
-
-		    /* 8: X <-- H(X \xor V_j) */
-		    blkxor(X, &V[j * (128 * blockSize)], 128 * blockSize);
-		    blockmix_salsa8(X, Y, blockSize);
-	    }
-
-        //investigate the ptr X, does it copy or needs the address & to copy contents
-        memcpy_c(input_chunk, archcap_c_ddc_cast(X), 128 * blockSize);
-        // blkcpy(input_chunk, X, 128 * blockSize);
-        CompartmentReturn(0);
-
-    } else {
-        CompartmentReturn(-1);
+	uint64_t j[L];
+	size_t l;
+	const bool stream = 128 * r * N >= kStreamingStoreMinLength;
+
+	for (l = 0; l < L; l++) {
+		X[l] = XY[l];
+		Y[l] = &XY[l][32 * r];
+	}
+
+	/* 2: for i = 0 to N - 1 do */
+	for (i = 0; i < N; i++) {
+		for (l = 0; l < L; l++) {
+			/* 3: V_i <-- X */
+			if (stream)
+				blkcpy_stream(&V[l][i * (32 * r)], X[l], 32 * r);
+			else
+				blkcpy(&V[l][i * (32 * r)], X[l], 32 * r);
+			/* 4: X <-- H(X) */
+			blockmix_salsa8(X[l], Y[l], r);
+		}
+	}
+
+	/* 7: j <-- Integerify(X) mod N, for the first iteration. */
+	for (l = 0; l < L; l++) {
+		j[l] = integerify(X[l], r) & (N - 1);
+		prefetch_block(&V[l][j[l] * (32 * r)], r);
+	}
+
+	/* 6: for i = 0 to N - 1 do */
+	for (i = 0; i < N; i++) {
+		for (l = 0; l < L; l++) {
+			COMPARTMENT_TRACE(DEBUG, "[Node B] ROMix lane / j", l, j[l]);
+
+			/* 8: X <-- H(X \xor V_j) */
+			blkxor(X[l], &V[l][j[l] * (32 * r)], 32 * r);
+			blockmix_salsa8(X[l], Y[l], r);
+
+			/* 7: j <-- Integerify(X) mod N, for the next iteration. */
+			j[l] = integerify(X[l], r) & (N - 1);
+			prefetch_block(&V[l][j[l] * (32 * r)], r);
+		}
+	}
+}
+
+typedef void (*smix_fn)(uint32_t* const * XY, uint32_t* const * V, uint64_t N, size_t r);
+
+static_assert(kRomixMaxInterleavedLanes == 2, "smix_specializations must cover every lane count");
+
+/* Commonly used (N, r) pairs, with specialized smix() for 1 and 2 lanes. */
+const struct {
+	uint64_t N;
+	size_t r;
+	smix_fn fn[kRomixMaxInterleavedLanes];
+} smix_specializations[] = {
+	{ 1024, 8, { smix<1024, 8, 1>, smix<1024, 8, 2> } },
+	{ 16384, 8, { smix<16384, 8, 1>, smix<16384, 8, 2> } },
+	{ 32768, 8, { smix<32768, 8, 1>, smix<32768, 8, 2> } },
+	{ 16384, 16, { smix<16384, 16, 1>, smix<16384, 16, 2> } },
+};
+
+const smix_fn smix_generic[kRomixMaxInterleavedLanes] = { smix<0, 0, 1>, smix<0, 0, 2> };
+
+/* Returns the smix() specialization for (N, r) and lanes, or the generic one. */
+smix_fn select_smix(uint64_t N, size_t r, size_t lanes)
+{
+	for (const auto& specialization : smix_specializations) {
+		if (specialization.N == N && specialization.r == r)
+			return specialization.fn[lanes - 1];
+	}
+	return smix_generic[lanes - 1];
+}
+
+// Computes B_l <-- MF(B_l, N) for the lanes consecutive 128 * r-byte blocks of chunks, interleaving
+// the lanes in this thread.
+COMPARTMENT_ENTRY_POINT(uint8_t* __capability chunks, uint64_t N, size_t r, size_t lanes) {
+    if (!sanityChecks(N, r) || lanes == 0 || lanes > kRomixMaxInterleavedLanes)
+        ReturnFromRequest(-1);
+
+    if (!IsCapabilityAccessible(chunks, lanes * 128 * r, ARCHCAP_PERM_LOAD | ARCHCAP_PERM_STORE))
+        ReturnFromRequest(-1);
+
+    uint8_t* scratch = romix_scratch_pool.Acquire(RomixScratchPool::Length(N, r, lanes));
+    if (scratch == nullptr)
+        ReturnFromRequest(-1);
+    request_scratch = scratch;
+
+    uint32_t* V[kRomixMaxInterleavedLanes];
+    uint32_t* XY[kRomixMaxInterleavedLanes];
+    size_t l;
+
+    for (l = 0; l < lanes; l++) {
+        V[l] = RomixScratchPool::V(scratch, N, r, l);
+        XY[l] = RomixScratchPool::XY(scratch, N, r, lanes, l);
+        uint32_t* X = XY[l];
+
+        /* 1: X <-- B */
+        // X is SMix's working state, so it must be a copy; it is read straight from the caller's
+        // block. The words only need converting on big-endian hosts, in place.
+        memcpy_c(DeriveBufferCapability(X, 128 * r, kBlockPerms), &chunks[l * 128 * r], 128 * r);
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+        for (size_t k = 0; k < 32 * r; k++)
+            X[k] = le32dec(&X[k]);
+#endif
+    }
+
+    select_smix(N, r, lanes)(XY, V, N, r);
+
+    for (l = 0; l < lanes; l++) {
+        uint32_t* X = XY[l];
+
+        /* 10: B' <-- X */
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+        for (size_t k = 0; k < 32 * r; k++)
+            le32enc(&X[k], X[k]);
+#endif
+        memcpy_c(&chunks[l * 128 * r], DeriveBufferCapability(X, 128 * r, kBlockPerms), 128 * r);
     }
 
+    ReturnFromRequest(0);
+}
+
+// CompartmentReturn() does not unwind the stack, so every return from a request goes through here
+// to give its scratch memory back to the pool.
+void ReturnFromRequest(uintcap_t ret) {
+    if (request_scratch != nullptr) {
+        romix_scratch_pool.Release(request_scratch);
+        request_scratch = nullptr;
+    }
+    CompartmentReturn(ret);
 }
 
 int main(int, char** argv) {
+  // Fault in the scratch memory of a request with the default parameters, so that it does not take
+  // page faults.
+  const size_t default_lanes = std::min<size_t>(kScryptDefaultP, kRomixMaxInterleavedLanes);
+  if (!romix_scratch_pool.Init(
+          RomixScratchPool::Length(kScryptDefaultN, kScryptDefaultR, default_lanes))) {
+    std::cerr << "[Node B] Failed to map the ROMix scratch memory" << std::endl;
+    return 1;
+  }
 
   std::cout << "[Node B] MemCost Factor Compartment @" << argv[0] << " initialized" << std::endl;
 
   // Return to the compartment manager, letting it know that we have completed our initialization.
   CompartmentReturn();
 }
-
@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2020 Arm Limited. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+// Fused compute node: Node A, Node B and Node C linked into a single compartment, for deployments
+// that only need isolation at the Node A boundary. The nodes' code is unchanged, and their calls to
+// each other stay within this compartment, as plain function calls (see
+// compartment_in_process.h). The compartment's interface is Node A's: it is added with
+// kComputeNodeACompartmentId and takes the same KDF_Inputs / Secret capabilities.
+
+#include <iostream>
+
+#include "compartment_globals.h"
+#include "compartment_helpers.h"
+#include "compartment_in_process.h"
+
+DECLARE_IN_PROCESS_COMPARTMENT(compute_node_a_entry, compute_node_a_main);
+DECLARE_IN_PROCESS_COMPARTMENT(compute_node_b_entry, compute_node_b_main);
+DECLARE_IN_PROCESS_COMPARTMENT(compute_node_c_entry, compute_node_c_main);
+
+// CompartmentReturn() unwinds to the innermost in-process call, so returning to the compartment
+// manager is done directly through the capability it provided.
+[[noreturn]] static void ReturnToCompartmentManager(uintcap_t ret) {
+  COMPARTMENT_MANAGER_RETURN_CAPABILITY_SYMBOL(ret);
+}
+
+COMPARTMENT_ENTRY_POINT(uintcap_t arg0, uintcap_t arg1, uintcap_t arg2, uintcap_t arg3,
+                        uintcap_t arg4, uintcap_t arg5) {
+  ReturnToCompartmentManager(
+      CompartmentCall(kComputeNodeACompartmentId, arg0, arg1, arg2, arg3, arg4, arg5));
+}
+
+int main(int, char** argv) {
+  if (!InProcessCompartmentAdd(kComputeNodeACompartmentId, "compute_node_a", compute_node_a_main,
+                               compute_node_a_entry) ||
+      !InProcessCompartmentAdd(kComputeNodeBCompartmentId, "compute_node_b", compute_node_b_main,
+                               compute_node_b_entry) ||
+      !InProcessCompartmentAdd(kComputeNodeCCompartmentId, "compute_node_c", compute_node_c_main,
+                               compute_node_c_entry)) {
+    std::cerr << "[Fused compute node] Failed to initialize the compute nodes" << std::endl;
+    return 1;
+  }
+
+  std::cout << "[Fused compute node] Compartment @" << argv[0] << " initialized" << std::endl;
+
+  // Return to the compartment manager, letting it know that we have completed our initialization.
+  ReturnToCompartmentManager(0);
+}
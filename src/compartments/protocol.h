@@ -6,18 +6,131 @@
 
 #pragma once
 
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <iostream>
 
 // Data types used in the client-server communication.
-#define blockSize 16
 #define OUTPUT_BUFLEN 16
 
+// Default scrypt cost parameters (the interactive login parameters recommended for scrypt). Node B
+// faults in its scratch memory for them at initialization.
+constexpr uint64_t kScryptDefaultN = 16384;
+constexpr uint32_t kScryptDefaultR = 8;
+constexpr uint32_t kScryptDefaultP = 1;
 
+// Upper bound on the memory used by a single ROMix lane (128 * r * (N + 2) bytes: V and the
+// working blocks X and Y), so that Node B's scratch memory fits comfortably in its compartment's
+// range.
+constexpr size_t kScryptMaxLaneMemory = 64 * 1024 * 1024;
+
+// Maximum number of ROMix lanes Node B interleaves in a single request.
+constexpr size_t kRomixMaxInterleavedLanes = 2;
+
+
+// Operations provided by the server compartment.
 enum class RequestType {
+  // Returns a read-only capability to the server's public key.
   kGetServerPublicKey,
+  // Generate a key pair for the client. Arguments: key_pair (KeyPair*, writable). Returns 0 on
+  // success, -1 otherwise.
   kGenerateClientKey,
+  // Generate count key pairs for the client in a single call. Arguments: key_pairs (array of count
+  // KeyPairs, writable), count (at most kMaxBulkKeyPairs). Returns 0 on success, -1 otherwise.
+  kGenerateClientKeys,
+};
+
+// Maximum number of key pairs in a kGenerateClientKeys request.
+constexpr size_t kMaxBulkKeyPairs = 1024;
+
+// Operations provided by the key derivation compartment (Node A).
+enum class KdfRequestType {
+  // Derive a single secret. Arguments: inputs (KDF_Inputs*, readable), secret (Secret*, writable).
+  // Returns 0 on success, -1 otherwise.
+  kDerive,
+  // Derive count secrets, one per KDF_Inputs, in a single call. Arguments: inputs (array of count
+  // KDF_Inputs, readable), secrets (array of count Secrets, writable), count (at most
+  // kKdfMaxBatchSize), statuses (array of count KdfStatus, writable). Returns 0 if the request
+  // itself is valid, in which case the status of each item is written to statuses, -1 otherwise.
+  kDeriveBatch,
+  // Turn the calling thread into one of Node A's lane workers, which run the ROMix lanes of the
+  // other requests concurrently with the threads making them. No arguments. Never returns: the
+  // main executable lends threads for this (see CompartmentLendThreads()).
+  kLaneWorker,
+};
+
+// Number of threads that run the ROMix lanes of a derivation, including the one making the request:
+// the main executable lends all but one of them to Node A (see kLaneWorker). Read from
+// KDF_LANE_THREADS, 1 if it is not set or invalid.
+static inline size_t KdfLaneThreadsFromEnv() {
+  const char* str = getenv("KDF_LANE_THREADS");
+  if (str == nullptr)
+    return 1;
+  char* end;
+  unsigned long parsed = strtoul(str, &end, 10);
+  return *str != '\0' && *end == '\0' && parsed > 0 ? parsed : 1;
+}
+
+// Maximum number of items in a kDeriveBatch request.
+constexpr size_t kKdfMaxBatchSize = 1024;
+
+// Status of an item of a kDeriveBatch request.
+enum class KdfStatus : int32_t {
+  kOk = 0,
+  // The item's scrypt parameters are invalid (see ScryptParametersValid()).
+  kInvalidParameters,
+  // The derivation failed (e.g. out of memory).
+  kFailed,
+};
+
+// Operations provided by the salsa core compartment (Node C). Blocks are arrays of 32-bit words in
+// host byte order, i.e. already decoded from scrypt's little-endian byte representation, so that
+// Node C never converts them.
+enum class SalsaCoreRequestType {
+  // B <-- salsa20/8(B), for a single 16-word block. Arguments: B.
+  kSalsa20_8,
+  // B <-- BlockMix_{salsa20/8, r}(B), applied rounds times to a 32 * r-word (128 * r-byte) block,
+  // using Y as scratch space of the same size. Arguments: B, Y, r, rounds.
+  kBlockMixSalsa8,
+};
+
+// Operations provided by the relay compartment of the switch benchmark, which calls the null
+// compartment (see benchmarks/switch_benchmark.cpp). Arguments passed to the null compartment are
+// scalars.
+enum class SwitchRelayRequestType {
+  // Call the null compartment once, through its call gate, with nargs arguments. Arguments: nargs.
+  // Returns the null compartment's return value.
+  kForward,
+  // Time num_samples batches of batch calls to the null compartment with nargs arguments each,
+  // through its call gate if via_gate is non-zero, by ID otherwise. The duration of each batch, in
+  // CompartmentTraceTimestamp() ticks, is written to samples. Arguments: samples (array of
+  // num_samples uint64_t, writable), num_samples (at most kSwitchMaxSamples), batch, nargs,
+  // via_gate. Returns 0 on success, -1 otherwise.
+  kMeasure,
 };
 
+constexpr size_t kSwitchMaxSamples = 1024 * 1024;
+
+// Channel between the producer and consumer compartments of the channel test (see
+// tests/channel_test.cpp), in both channel tables. Both compartments are called with (first_seq,
+// count): the producer enqueues messages first_seq to first_seq + count - 1, stopping early if the
+// ring is full, and the consumer dequeues up to count messages, stopping early if the ring is
+// empty, and checks that they are messages first_seq onwards. Both return the number of messages
+// enqueued or dequeued, or -1 if the channel cannot be opened or a message is not the expected one.
+// Each compartment must only be called by one thread at a time.
+constexpr size_t kChannelTestChannel = 0;
+
+struct ChannelTestMessage {
+  uint64_t seq;
+  // ChannelTestPayload(seq, i), so that a slot that is partially overwritten is detected.
+  uint64_t payload[7];
+};
+
+static inline uint64_t ChannelTestPayload(uint64_t seq, size_t i) {
+  return (seq + 1) * 0x9e3779b97f4a7c15 + i;
+}
+
 struct Key {
   char data[64];
 };
@@ -34,8 +147,27 @@ struct Secret {
 struct KDF_Inputs {
   char passwd[10];
   char salt[19];
+  // scrypt CPU/memory cost (N), block size (r) and parallelization (p) parameters; see
+  // ScryptParametersValid().
+  uint64_t N;
+  uint32_t r;
+  uint32_t p;
 };
 
+// Returns whether (N, r, p) are valid scrypt parameters that the compute nodes accept: N must be a
+// power of 2 greater than 1, r and p must be non-zero, r * p must be less than 2^30, and neither a
+// ROMix lane (V and its working blocks) nor the p lanes may need more than kScryptMaxLaneMemory
+// bytes.
+static inline bool ScryptParametersValid(uint64_t N, uint64_t r, uint64_t p) {
+  if (N < 2 || (N & (N - 1)) != 0 || r == 0 || p == 0)
+    return false;
+  if (r * p >= (1 << 30))
+    return false;
+  if (r > kScryptMaxLaneMemory / 128 / (N + 2) || p > kScryptMaxLaneMemory / 128 / r)
+    return false;
+  return true;
+}
+
 // Use a template to allow pasing both a pointer and a capability to the key.
 template <typename Kp>
 static inline void PrintKey(Kp key_ptr) {
@@ -45,3 +177,11 @@ static inline void PrintKey(Kp key_ptr) {
   }
   std::cout << std::endl;
 }
+
+static inline void PrintSecret(const Secret& secret) {
+  for (size_t i = 0; i < sizeof(secret.output); ++i) {
+    unsigned c = secret.output[i];
+    std::cout << std::hex << (c >> 4) << (c & 0xf);
+  }
+  std::cout << std::endl;
+}
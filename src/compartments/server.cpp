@@ -4,30 +4,139 @@
  * SPDX-License-Identifier: BSD-3-Clause
  */
 
-#include <sys/random.h>
+#include <string.h>
 
+#include <algorithm>
+#include <condition_variable>
 #include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 #include <archcap.h>
 
 #include "compartment_helpers.h"
+#include "compartment_trace.h"
 #include "protocol.h"
+#include "rng/chacha20_rng.h"
 
 namespace {
 
+// Number of client key pairs kept ready, and the level below which the pool is refilled.
+constexpr size_t kKeyPoolCapacity = 256;
+constexpr size_t kKeyPoolLowWater = 64;
+
 KeyPair server_keys;
 
 // This is no cryptographic key generation, just some random data generation!
-void GenerateKeyPair(KeyPair& key_pair) {
-  for (Key* key : {&key_pair.public_key, &key_pair.private_key}) {
-    // Ignore (unlikely) errors to make things simpler.
-    (void)getrandom(key->data, sizeof(key->data), 0);
-  }
+void GenerateKeyPairs(ChaCha20Rng& rng, KeyPair* key_pairs, size_t count) {
+  rng.Generate(key_pairs, count * sizeof(KeyPair));
 }
 
+void WipeKeyPairs(KeyPair* key_pairs, size_t count) {
+  memset(key_pairs, 0, count * sizeof(KeyPair));
+  asm volatile("" : : "r"(key_pairs) : "memory");
 }
 
-COMPARTMENT_ENTRY_POINT(RequestType request, KeyPair* __capability client_keys) {
+// Pool of pre-generated client key pairs, so that issuing keys costs a memcpy_c() rather than
+// generating them on the request path. A refill thread tops the pool up in bulk between requests,
+// whenever it drops below kKeyPoolLowWater. Requests that drain it entirely generate the missing
+// key pairs themselves.
+class KeyPool {
+ public:
+  // Seeds the generator and fills the pool. Returns false on failure.
+  bool Init() {
+    if (!rng_.Seed())
+      return false;
+    GenerateKeyPairs(rng_, keys_, kKeyPoolCapacity);
+    size_ = kKeyPoolCapacity;
+    return true;
+  }
+
+  // Starts the refill thread. The thread stays blocked while the pool is above the low-water mark.
+  void StartRefill() {
+    std::thread([this] { RefillLoop(); }).detach();
+  }
+
+  // Generates the server's own key pair.
+  void GenerateServerKeys(KeyPair* key_pair) {
+    std::lock_guard<std::mutex> lock(rng_mutex_);
+    GenerateKeyPairs(rng_, key_pair, 1);
+  }
+
+  // Writes count fresh key pairs to dest, which must have been checked to be writable.
+  void Issue(KeyPair* __capability dest, size_t count) {
+    size_t taken;
+    size_t remaining;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      // Key pairs are taken from the top of the pool, so that they are contiguous and can be
+      // copied at once. Their copy in the pool is wiped straight away.
+      taken = std::min(count, size_);
+      size_ -= taken;
+      if (taken > 0) {
+        memcpy_c(dest, archcap_c_ddc_cast(&keys_[size_]), taken * sizeof(KeyPair));
+        WipeKeyPairs(&keys_[size_], taken);
+      }
+      remaining = size_;
+    }
+    if (remaining < kKeyPoolLowWater)
+      refill_cv_.notify_one();
+
+    // The pool ran dry: generate the rest directly, a few key pairs at a time.
+    for (size_t i = taken; i < count;) {
+      KeyPair tmp[16];
+      size_t n = std::min(count - i, sizeof(tmp) / sizeof(tmp[0]));
+      {
+        std::lock_guard<std::mutex> lock(rng_mutex_);
+        GenerateKeyPairs(rng_, tmp, n);
+      }
+      memcpy_c(dest + i, archcap_c_ddc_cast(tmp), n * sizeof(KeyPair));
+      WipeKeyPairs(tmp, n);
+      i += n;
+    }
+
+    COMPARTMENT_TRACE(DEBUG, "[Server] Issued client key pairs, from the pool", count, taken);
+  }
+
+ private:
+  void RefillLoop() {
+    std::vector<KeyPair> staging(kKeyPoolCapacity);
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+      refill_cv_.wait(lock, [this] { return size_ < kKeyPoolLowWater; });
+      size_t missing = kKeyPoolCapacity - size_;
+      // Generate without holding the pool lock, so that requests are not held up meanwhile.
+      lock.unlock();
+      {
+        std::lock_guard<std::mutex> rng_lock(rng_mutex_);
+        GenerateKeyPairs(rng_, staging.data(), missing);
+      }
+      lock.lock();
+      size_t n = std::min(missing, kKeyPoolCapacity - size_);
+      memcpy(&keys_[size_], staging.data(), n * sizeof(KeyPair));
+      size_ += n;
+      WipeKeyPairs(staging.data(), missing);
+      COMPARTMENT_TRACE(DEBUG, "[Server] Refilled the key pool, added", n);
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable refill_cv_;
+  // Ready key pairs are keys_[0, size_).
+  KeyPair keys_[kKeyPoolCapacity];
+  size_t size_ = 0;
+
+  std::mutex rng_mutex_;
+  ChaCha20Rng rng_;
+};
+
+// Never destroyed, as the refill thread uses it until the process exits.
+KeyPool& key_pool = *new KeyPool;
+
+}
+
+COMPARTMENT_ENTRY_POINT(RequestType request, KeyPair* __capability client_keys, size_t count) {
   switch (request) {
     case RequestType::kGetServerPublicKey: {
       // Create a read-only capability to the server public key. The length of the capability is set
@@ -37,30 +146,19 @@ COMPARTMENT_ENTRY_POINT(RequestType request, KeyPair* __capability client_keys)
       // Return the capability to the client compartment.
       CompartmentReturn(AsUintcap(server_pk_cap));
     }
-    case RequestType::kGenerateClientKey: {
-      // Generate a new key pair for the client. We need to use a temporary variable because
-      // getrandom() and therefore GenerateKeyPair() only accept 64-bit pointers, not capabilities,
-      // so we cannot pass client_keys to it directly.
-      KeyPair tmp;
-      GenerateKeyPair(tmp);
-      std::cout << "[Server] Generated public key: ";
-      PrintKey(&tmp.public_key);
-      std::cout << "[Server] Generated private key: ";
-      PrintKey(&tmp.private_key);
-
-      // Check that the client-provided capability is appropriate for storing the generated key pair
-      // to, by inspecting its tag, bounds and permissions. Note that this is not an exhaustive
-      // check, and there is no reliable way to ensure that the underlying memory is accessible.
-      if (archcap_c_tag_get(client_keys) &&
-          (archcap_c_limit_get(client_keys) - archcap_c_address_get(client_keys)) >= sizeof(tmp) &&
-          (archcap_c_perms_get(client_keys) & ARCHCAP_PERM_STORE) != 0) {
-        // Use memcpy_c() to write via the client capability. We use DDC to construct a source
-        // capability.
-        memcpy_c(client_keys, archcap_c_ddc_cast(&tmp), sizeof(tmp));
-        CompartmentReturn(0);
-      } else {
+    case RequestType::kGenerateClientKey:
+    case RequestType::kGenerateClientKeys: {
+      if (request == RequestType::kGenerateClientKey)
+        count = 1;
+      else if (count == 0 || count > kMaxBulkKeyPairs)
         CompartmentReturn(-1);
-      }
+
+      // Check that the client-provided capability is appropriate for storing the key pairs to.
+      // The key pool then writes them via the client capability with memcpy_c().
+      if (!IsCapabilityAccessible(client_keys, count * sizeof(KeyPair), ARCHCAP_PERM_STORE))
+        CompartmentReturn(-1);
+      key_pool.Issue(client_keys, count);
+      CompartmentReturn(0);
     }
     default:
       std::cout << "[Server] Unknown request\n";
@@ -69,7 +167,17 @@ COMPARTMENT_ENTRY_POINT(RequestType request, KeyPair* __capability client_keys)
 }
 
 int main(int, char** argv) {
-  GenerateKeyPair(server_keys);
+  if (!ChaCha20SelfTest()) {
+    std::cerr << "[Server] ChaCha20 self-test failed" << std::endl;
+    return 1;
+  }
+  if (!key_pool.Init()) {
+    std::cerr << "[Server] Failed to seed the key generator" << std::endl;
+    return 1;
+  }
+  key_pool.StartRefill();
+
+  key_pool.GenerateServerKeys(&server_keys);
   std::cout << "[Server] Public key: ";
   PrintKey(&server_keys.public_key);
   std::cout << "[Server] Private key: ";
@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2020 Arm Limited. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+// Relay compartment of the compartment switch benchmark (see benchmarks/switch_benchmark.cpp): it
+// calls the null compartment, either once per request (nested calls, timed by the caller) or in
+// timed batches (compartment to compartment calls, timed here). See SwitchRelayRequestType.
+
+#include <iostream>
+#include <utility>
+
+#include "compartment_helpers.h"
+#include "compartment_trace.h"
+#include "protocol.h"
+
+namespace {
+
+// Calls the null compartment with the arguments 1 to n (sizeof...(I) == n).
+template <bool kViaGate, size_t... I>
+uintcap_t CallNull(std::index_sequence<I...>) {
+  if (kViaGate)
+    return CompartmentCallThroughGate<kSwitchNullCompartmentId>(uint64_t{I + 1}...);
+  return CompartmentCall(kSwitchNullCompartmentId, uint64_t{I + 1}...);
+}
+
+// The calls are instantiated for each number of arguments, so that the timed loop is the same as
+// in the caller's code.
+template <bool kViaGate, size_t kNargs>
+void Measure(uint64_t* __capability samples, size_t num_samples, size_t batch) {
+  for (size_t i = 0; i < num_samples; ++i) {
+    uint64_t start = CompartmentTraceTimestamp();
+    for (size_t j = 0; j < batch; ++j)
+      CallNull<kViaGate>(std::make_index_sequence<kNargs>());
+    samples[i] = CompartmentTraceTimestamp() - start;
+  }
+}
+
+template <bool kViaGate>
+bool MeasureWithArgs(size_t nargs, uint64_t* __capability samples, size_t num_samples,
+                     size_t batch) {
+  switch (nargs) {
+    case 0: Measure<kViaGate, 0>(samples, num_samples, batch); return true;
+    case 1: Measure<kViaGate, 1>(samples, num_samples, batch); return true;
+    case 2: Measure<kViaGate, 2>(samples, num_samples, batch); return true;
+    case 3: Measure<kViaGate, 3>(samples, num_samples, batch); return true;
+    case 4: Measure<kViaGate, 4>(samples, num_samples, batch); return true;
+    case 5: Measure<kViaGate, 5>(samples, num_samples, batch); return true;
+    case 6: Measure<kViaGate, 6>(samples, num_samples, batch); return true;
+    default: return false;
+  }
+}
+
+uintcap_t Forward(size_t nargs) {
+  switch (nargs) {
+    case 0: return CallNull<true>(std::make_index_sequence<0>());
+    case 1: return CallNull<true>(std::make_index_sequence<1>());
+    case 2: return CallNull<true>(std::make_index_sequence<2>());
+    case 3: return CallNull<true>(std::make_index_sequence<3>());
+    case 4: return CallNull<true>(std::make_index_sequence<4>());
+    case 5: return CallNull<true>(std::make_index_sequence<5>());
+    case 6: return CallNull<true>(std::make_index_sequence<6>());
+    default: return -1;
+  }
+}
+
+}
+
+COMPARTMENT_ENTRY_POINT(SwitchRelayRequestType request, uintcap_t arg1, size_t arg2, size_t batch,
+                        size_t nargs, size_t via_gate) {
+  switch (request) {
+    case SwitchRelayRequestType::kForward:
+      CompartmentReturn(Forward(static_cast<size_t>(arg1)));
+
+    case SwitchRelayRequestType::kMeasure: {
+      uint64_t* __capability samples = reinterpret_cast<uint64_t* __capability>(arg1);
+      size_t num_samples = arg2;
+      if (num_samples > kSwitchMaxSamples ||
+          !IsCapabilityAccessible(samples, num_samples * sizeof(uint64_t), ARCHCAP_PERM_STORE))
+        CompartmentReturn(-1);
+
+      bool ok = via_gate != 0 ? MeasureWithArgs<true>(nargs, samples, num_samples, batch)
+                              : MeasureWithArgs<false>(nargs, samples, num_samples, batch);
+      CompartmentReturn(ok ? 0 : -1);
+    }
+  }
+
+  CompartmentReturn(-1);
+}
+
+int main(int, char** argv) {
+  std::cout << "[Switch relay] Compartment @" << argv[0] << " initialized" << std::endl;
+
+  // Return to the compartment manager, letting it know that we have completed our initialization.
+  CompartmentReturn();
+}
@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2020 Arm Limited. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+// Trivial compartment called by the compartment switch benchmark (see
+// benchmarks/switch_benchmark.cpp), so that a call only costs the switch itself. Built twice:
+// - switch_null: returns 0 straight away, whatever the arguments.
+// - switch_echo (SWITCH_TARGET_ECHO defined): returns its first argument unchanged, be it a scalar
+//   or a capability.
+
+#include <iostream>
+
+#include "compartment_helpers.h"
+
+#if defined(SWITCH_TARGET_ECHO)
+#define SWITCH_TARGET_NAME "Switch echo"
+#else
+#define SWITCH_TARGET_NAME "Switch null"
+#endif
+
+COMPARTMENT_ENTRY_POINT([[maybe_unused]] uintcap_t arg0) {
+#if defined(SWITCH_TARGET_ECHO)
+  CompartmentReturn(arg0);
+#else
+  CompartmentReturn(0);
+#endif
+}
+
+int main(int, char** argv) {
+  std::cout << "[" SWITCH_TARGET_NAME "] Compartment @" << argv[0] << " initialized" << std::endl;
+
+  // Return to the compartment manager, letting it know that we have completed our initialization.
+  CompartmentReturn();
+}
@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2020 Arm Limited. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+// Stand-in for Morello's <archcap.h>, for builds targeting a host without capability support (see
+// cd_host_defaults in Android.bp). Only the subset of the API used by code that is also built for
+// the host is provided.
+//
+// Capabilities degrade to plain pointers: any non-null pointer is considered tagged, unbounded and
+// to have all permissions, and the setters only ever change the address. There is therefore no
+// memory isolation whatsoever; this is only meant to run the compartments' code in-process (see
+// compartments/compartment_in_process.h).
+
+#pragma once
+
+#if defined(__CHERI__)
+#error "host/archcap.h must not be used when targeting a capability-enabled architecture"
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define __capability
+
+typedef uintptr_t uintcap_t;
+typedef uint64_t ptraddr_t;
+typedef uint64_t archcap_perms_t;
+
+#define ARCHCAP_PERM_GLOBAL                     (1u << 0)
+#define ARCHCAP_PERM_LOAD                       (1u << 1)
+#define ARCHCAP_PERM_STORE                      (1u << 2)
+#define ARCHCAP_PERM_LOAD_CAP                   (1u << 3)
+#define ARCHCAP_PERM_STORE_CAP                  (1u << 4)
+
+template <typename T>
+static inline ptraddr_t archcap_c_address_get(T cap) {
+  return (ptraddr_t)(uintptr_t)cap;
+}
+
+template <typename T, typename A>
+static inline T archcap_c_address_set(T, A address) {
+  return (T)(uintptr_t)address;
+}
+
+template <typename T>
+static inline bool archcap_c_tag_get(T cap) {
+  return archcap_c_address_get(cap) != 0;
+}
+
+template <typename T>
+static inline ptraddr_t archcap_c_base_get(T) {
+  return 0;
+}
+
+template <typename T>
+static inline ptraddr_t archcap_c_limit_get(T) {
+  return UINTPTR_MAX;
+}
+
+template <typename T>
+static inline archcap_perms_t archcap_c_perms_get(T) {
+  return ~archcap_perms_t{0};
+}
+
+template <typename T>
+static inline T archcap_c_perms_set(T cap, archcap_perms_t) {
+  return cap;
+}
+
+template <typename T>
+static inline T archcap_c_bounds_set(T cap, size_t) {
+  return cap;
+}
+
+// DDC covers the whole address space.
+static inline uintcap_t archcap_c_ddc_get() {
+  return 0;
+}
+
+template <typename T>
+static inline T archcap_c_ddc_cast(T ptr) {
+  return ptr;
+}
+
+static inline void* memcpy_c(void* dest, const void* src, size_t n) {
+  return memcpy(dest, src, n);
+}
@@ -0,0 +1,762 @@
+/*
+ * Copyright (c) 2020 Arm Limited. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include "kdf/pbkdf2_sha256.h"
+
+#include <assert.h>
+#include <string.h>
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#elif defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+static const uint32_t initial_state[8] = {
+	0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+	0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+};
+
+/* SHA256 round constants. */
+alignas(16) static const uint32_t Krnd[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/* Elementary functions used by SHA256 */
+#define Ch(x, y, z)	((x & (y ^ z)) ^ z)
+#define Maj(x, y, z)	((x & (y | z)) | (y & z))
+#define SHR(x, n)	(x >> n)
+#define ROTR(x, n)	((x >> n) | (x << (32 - n)))
+#define S0(x)		(ROTR(x, 2) ^ ROTR(x, 13) ^ ROTR(x, 22))
+#define S1(x)		(ROTR(x, 6) ^ ROTR(x, 11) ^ ROTR(x, 25))
+#define s0(x)		(ROTR(x, 7) ^ ROTR(x, 18) ^ SHR(x, 3))
+#define s1(x)		(ROTR(x, 17) ^ ROTR(x, 19) ^ SHR(x, 10))
+
+/* SHA256 round function */
+#define RND(a, b, c, d, e, f, g, h, k)			\
+	h += S1(e) + Ch(e, f, g) + k;			\
+	d += h;						\
+	h += S0(a) + Maj(a, b, c);
+
+/* Adjusted round function for rotating state */
+#define RNDr(S, W, i, ii)			\
+	RND(S[(64 - i) % 8], S[(65 - i) % 8],	\
+	    S[(66 - i) % 8], S[(67 - i) % 8],	\
+	    S[(68 - i) % 8], S[(69 - i) % 8],	\
+	    S[(70 - i) % 8], S[(71 - i) % 8],	\
+	    W[i + ii] + Krnd[i + ii])
+
+/* Message schedule computation */
+#define MSCH(W, ii, i)				\
+	W[i + ii + 16] = s1(W[i + ii + 14]) + W[i + ii + 9] + s0(W[i + ii + 1]) + W[i + ii]
+
+static inline void be32enc(void * pp, uint32_t x)
+{
+	uint8_t * p = (uint8_t *)pp;
+
+	p[3] = x & 0xff;
+	p[2] = (x >> 8) & 0xff;
+	p[1] = (x >> 16) & 0xff;
+	p[0] = (x >> 24) & 0xff;
+}
+
+static inline void be64enc(void * pp, uint64_t x)
+{
+	uint8_t * p = (uint8_t *)pp;
+
+	be32enc(p, (uint32_t)(x >> 32));
+	be32enc(p + 4, (uint32_t)(x & 0xffffffff));
+}
+
+static void be32enc_vect(uint8_t * dst, const uint32_t * src, size_t len)
+{
+	size_t i;
+	/* Sanity-check. */
+	assert(len % 4 == 0);
+
+	/* Encode vector, one word at a time. */
+	for (i = 0; i < len / 4; i++)
+		be32enc(dst + i * 4, src[i]);
+}
+
+static inline uint32_t be32dec(const void * pp)
+{
+	const uint8_t * p = (uint8_t const *)pp;
+
+	return ((uint32_t)(p[3]) | ((uint32_t)(p[2]) << 8) |
+	    ((uint32_t)(p[1]) << 16) | ((uint32_t)(p[0]) << 24));
+}
+
+static void be32dec_vect(uint32_t * dst, const uint8_t * src, size_t len)
+{
+	size_t i;
+	/* Sanity-check. */
+	assert(len % 4 == 0);
+	/* Decode vector, one word at a time. */
+	for (i = 0; i < len / 4; i++)
+		dst[i] = be32dec(src + i * 4);
+}
+
+/*
+ * SHA256 block functions. Each one mixes nblocks consecutive 64-byte blocks
+ * into state; SHA256_Transform points to the best one for this CPU (see
+ * SelectSHA256Transform()).
+ */
+typedef void (*SHA256_Transform_fn)(uint32_t state[8], const uint8_t * blocks, size_t nblocks);
+
+static void SHA256_Transform_scalar(uint32_t state[8], const uint8_t * blocks, size_t nblocks)
+{
+	uint32_t W[64];
+	uint32_t S[8];
+	int i;
+
+	for (; nblocks > 0; nblocks--, blocks += 64) {
+		/* 1. Prepare the first part of the message schedule W. */
+		be32dec_vect(W, blocks, 64);
+
+		/* 2. Initialize working variables. */
+		memcpy(S, state, 32);
+
+		/* 3. Mix. */
+		for (i = 0; i < 64; i += 16) {
+			RNDr(S, W, 0, i);
+			RNDr(S, W, 1, i);
+			RNDr(S, W, 2, i);
+			RNDr(S, W, 3, i);
+			RNDr(S, W, 4, i);
+			RNDr(S, W, 5, i);
+			RNDr(S, W, 6, i);
+			RNDr(S, W, 7, i);
+			RNDr(S, W, 8, i);
+			RNDr(S, W, 9, i);
+			RNDr(S, W, 10, i);
+			RNDr(S, W, 11, i);
+			RNDr(S, W, 12, i);
+			RNDr(S, W, 13, i);
+			RNDr(S, W, 14, i);
+			RNDr(S, W, 15, i);
+
+			if (i == 48)
+				break;
+			MSCH(W, 0, i);
+			MSCH(W, 1, i);
+			MSCH(W, 2, i);
+			MSCH(W, 3, i);
+			MSCH(W, 4, i);
+			MSCH(W, 5, i);
+			MSCH(W, 6, i);
+			MSCH(W, 7, i);
+			MSCH(W, 8, i);
+			MSCH(W, 9, i);
+			MSCH(W, 10, i);
+			MSCH(W, 11, i);
+			MSCH(W, 12, i);
+			MSCH(W, 13, i);
+			MSCH(W, 14, i);
+			MSCH(W, 15, i);
+		}
+
+		/* 4. Mix local working variables into global state. */
+		for (i = 0; i < 8; i++)
+			state[i] += S[i];
+	}
+}
+
+#if defined(__aarch64__)
+
+/*
+ * ARMv8 SHA2 instructions. They are emitted through inline assembly so that
+ * this file can be built for the baseline architecture; they are only executed
+ * if AT_HWCAP reports HWCAP_SHA2.
+ */
+static inline uint32x4_t sha256h(uint32x4_t abcd, uint32x4_t efgh, uint32x4_t wk)
+{
+	__asm__(".arch_extension sha2\n\tsha256h %q0, %q1, %2.4s"
+	    : "+w"(abcd) : "w"(efgh), "w"(wk));
+	return abcd;
+}
+
+static inline uint32x4_t sha256h2(uint32x4_t efgh, uint32x4_t abcd, uint32x4_t wk)
+{
+	__asm__(".arch_extension sha2\n\tsha256h2 %q0, %q1, %2.4s"
+	    : "+w"(efgh) : "w"(abcd), "w"(wk));
+	return efgh;
+}
+
+static inline uint32x4_t sha256su0(uint32x4_t w0, uint32x4_t w1)
+{
+	__asm__(".arch_extension sha2\n\tsha256su0 %0.4s, %1.4s" : "+w"(w0) : "w"(w1));
+	return w0;
+}
+
+static inline uint32x4_t sha256su1(uint32x4_t w0, uint32x4_t w2, uint32x4_t w3)
+{
+	__asm__(".arch_extension sha2\n\tsha256su1 %0.4s, %1.4s, %2.4s"
+	    : "+w"(w0) : "w"(w2), "w"(w3));
+	return w0;
+}
+
+static void SHA256_Transform_armv8(uint32_t state[8], const uint8_t * blocks, size_t nblocks)
+{
+	uint32x4_t STATE0 = vld1q_u32(&state[0]);	/* ABCD */
+	uint32x4_t STATE1 = vld1q_u32(&state[4]);	/* EFGH */
+	uint32x4_t MSG[4];
+	int i;
+
+	for (; nblocks > 0; nblocks--, blocks += 64) {
+		const uint32x4_t ABCD_SAVE = STATE0;
+		const uint32x4_t EFGH_SAVE = STATE1;
+
+		/* Load the block, converting from big-endian. */
+		for (i = 0; i < 4; i++)
+			MSG[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(&blocks[16 * i])));
+
+		/* 16 groups of 4 rounds; MSG[i % 4] holds W[4i .. 4i + 3]. */
+		for (i = 0; i < 16; i++) {
+			if (i >= 4)
+				MSG[i % 4] = sha256su1(sha256su0(MSG[i % 4], MSG[(i + 1) % 4]),
+				    MSG[(i + 2) % 4], MSG[(i + 3) % 4]);
+
+			const uint32x4_t WK = vaddq_u32(MSG[i % 4], vld1q_u32(&Krnd[4 * i]));
+			const uint32x4_t ABCD = STATE0;
+			STATE0 = sha256h(STATE0, STATE1, WK);
+			STATE1 = sha256h2(STATE1, ABCD, WK);
+		}
+
+		STATE0 = vaddq_u32(STATE0, ABCD_SAVE);
+		STATE1 = vaddq_u32(STATE1, EFGH_SAVE);
+	}
+
+	vst1q_u32(&state[0], STATE0);
+	vst1q_u32(&state[4], STATE1);
+}
+
+#elif defined(__x86_64__)
+
+/* x86 SHA extensions (SHA-NI). */
+__attribute__((target("sha,sse4.1,ssse3")))
+static void SHA256_Transform_shani(uint32_t state[8], const uint8_t * blocks, size_t nblocks)
+{
+	const __m128i BSWAP = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i MSG[4];
+	__m128i TMP, STATE0, STATE1;
+	int i;
+
+	/* The instructions use an ABEF/CDGH split of the state. */
+	TMP = _mm_loadu_si128((const __m128i *)&state[0]);	/* DCBA */
+	STATE1 = _mm_loadu_si128((const __m128i *)&state[4]);	/* HGFE */
+	TMP = _mm_shuffle_epi32(TMP, 0xB1);			/* CDAB */
+	STATE1 = _mm_shuffle_epi32(STATE1, 0x1B);		/* EFGH */
+	STATE0 = _mm_alignr_epi8(TMP, STATE1, 8);		/* ABEF */
+	STATE1 = _mm_blend_epi16(STATE1, TMP, 0xF0);		/* CDGH */
+
+	for (; nblocks > 0; nblocks--, blocks += 64) {
+		const __m128i ABEF_SAVE = STATE0;
+		const __m128i CDGH_SAVE = STATE1;
+
+		/* Load the block, converting from big-endian. */
+		for (i = 0; i < 4; i++)
+			MSG[i] = _mm_shuffle_epi8(
+			    _mm_loadu_si128((const __m128i *)&blocks[16 * i]), BSWAP);
+
+		/* 16 groups of 4 rounds; MSG[i % 4] holds W[4i .. 4i + 3]. */
+		for (i = 0; i < 16; i++) {
+			if (i >= 4)
+				MSG[i % 4] = _mm_sha256msg2_epu32(
+				    _mm_add_epi32(_mm_sha256msg1_epu32(MSG[i % 4], MSG[(i + 1) % 4]),
+				        _mm_alignr_epi8(MSG[(i + 3) % 4], MSG[(i + 2) % 4], 4)),
+				    MSG[(i + 3) % 4]);
+
+			__m128i WK = _mm_add_epi32(MSG[i % 4],
+			    _mm_load_si128((const __m128i *)&Krnd[4 * i]));
+			STATE1 = _mm_sha256rnds2_epu32(STATE1, STATE0, WK);
+			WK = _mm_shuffle_epi32(WK, 0x0E);
+			STATE0 = _mm_sha256rnds2_epu32(STATE0, STATE1, WK);
+		}
+
+		STATE0 = _mm_add_epi32(STATE0, ABEF_SAVE);
+		STATE1 = _mm_add_epi32(STATE1, CDGH_SAVE);
+	}
+
+	TMP = _mm_shuffle_epi32(STATE0, 0x1B);			/* FEBA */
+	STATE1 = _mm_shuffle_epi32(STATE1, 0xB1);		/* DCHG */
+	STATE0 = _mm_blend_epi16(TMP, STATE1, 0xF0);		/* DCBA */
+	STATE1 = _mm_alignr_epi8(STATE1, TMP, 8);		/* HGFE */
+
+	_mm_storeu_si128((__m128i *)&state[0], STATE0);
+	_mm_storeu_si128((__m128i *)&state[4], STATE1);
+}
+
+#endif
+
+static SHA256_Transform_fn SHA256_Transform = SHA256_Transform_scalar;
+const char* SHA256_Transform_name = "scalar";
+
+// Picks the fastest SHA256 block function the CPU supports, and checks it against the scalar one.
+// Must be called once, before any request is served.
+void SelectSHA256Transform() {
+#if defined(__aarch64__)
+  if (getauxval(AT_HWCAP) & HWCAP_SHA2) {
+    SHA256_Transform = SHA256_Transform_armv8;
+    SHA256_Transform_name = "armv8-sha2";
+  }
+#elif defined(__x86_64__)
+  unsigned int eax, ebx, ecx, edx;
+  // SHA-NI is reported in CPUID.(EAX=7, ECX=0):EBX[29]; the kernel also uses SSSE3 and SSE4.1.
+  if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSSE3) && (ecx & bit_SSE4_1) &&
+      __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_SHA)) {
+    SHA256_Transform = SHA256_Transform_shani;
+    SHA256_Transform_name = "sha-ni";
+  }
+#endif
+
+  // Two blocks, so that the state carried from one block to the next is covered as well.
+  uint8_t blocks[128];
+  for (size_t i = 0; i < sizeof(blocks); i++)
+    blocks[i] = static_cast<uint8_t>(i * 37 + 11);
+  uint32_t expected[8], actual[8];
+  memcpy(expected, initial_state, sizeof(expected));
+  memcpy(actual, initial_state, sizeof(actual));
+  SHA256_Transform_scalar(expected, blocks, 2);
+  SHA256_Transform(actual, blocks, 2);
+  assert(memcmp(expected, actual, sizeof(expected)) == 0);
+}
+
+static const uint8_t PAD[64] = {
+	0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+void SHA256_Init(SHA256_CTX * ctx)
+{
+	/* Zero bits processed so far. */
+	ctx->count = 0;
+
+	/* Initialize state. */
+	memcpy(ctx->state, initial_state, sizeof(initial_state));
+
+}
+
+void SHA256_Update(SHA256_CTX * ctx, const void * in, size_t len)
+{
+	uint32_t r;
+	const uint8_t * src = (const uint8_t *)in;
+
+	/* Return immediately if we have nothing to do. */
+	if (len == 0)
+		return;
+
+	/* Number of bytes left in the buffer from previous updates. */
+	r = (ctx->count >> 3) & 0x3f;
+
+	/* Update number of bits. */
+	ctx->count += (uint64_t)(len) << 3;
+
+	/* Handle the case where we don't need to perform any transforms. */
+	if (len < 64 - r) {
+		memcpy(&ctx->buf[r], src, len);
+		return;
+	}
+
+	/* Finish the current block. */
+	memcpy(&ctx->buf[r], src, 64 - r);
+	SHA256_Transform(ctx->state, ctx->buf, 1);
+	src += 64 - r;
+	len -= 64 - r;
+
+	/* Perform complete blocks, in one go so that the state stays in registers. */
+	if (len >= 64) {
+		SHA256_Transform(ctx->state, src, len / 64);
+		src += len & ~(size_t)63;
+		len &= 63;
+	}
+
+	/* Copy left over data into buffer. */
+	memcpy(ctx->buf, src, len);
+}
+
+/* Add padding and terminating bit-count. */
+static void SHA256_Pad(SHA256_CTX * ctx)
+{
+	size_t r;
+
+	/* Figure out how many bytes we have buffered. */
+	r = (ctx->count >> 3) & 0x3f;
+
+	/* Pad to 56 mod 64, transforming if we finish a block en route. */
+	if (r < 56) {
+		/* Pad to 56 mod 64. */
+		memcpy(&ctx->buf[r], PAD, 56 - r);
+	} else {
+		/* Finish the current block and mix. */
+		memcpy(&ctx->buf[r], PAD, 64 - r);
+		SHA256_Transform(ctx->state, ctx->buf, 1);
+
+		/* The start of the final block is all zeroes. */
+		memset(&ctx->buf[0], 0, 56);
+	}
+
+	/* Add the terminating bit-count. */
+	be64enc(&ctx->buf[56], ctx->count);
+
+	/* Mix in the final block. */
+	SHA256_Transform(ctx->state, ctx->buf, 1);
+}
+
+void SHA256_Final(uint8_t digest[32], SHA256_CTX * ctx)
+{
+	/* Add padding. */
+	SHA256_Pad(ctx);
+
+	/* Write the hash. */
+	be32enc_vect(digest, ctx->state, 32);
+}
+
+/**
+ * HMAC_SHA256_Init(ctx, K, Klen):
+ * Initialize the HMAC-SHA256 context ctx with Klen bytes of key from K.  The
+ * resulting context (the ipad/opad midstates) can be copied and reused for
+ * any number of messages under the same key.
+ */
+void HMAC_SHA256_Init(HMAC_SHA256_CTX * ctx, const void * _K, size_t Klen)
+{
+	uint8_t pad[64];
+	uint8_t khash[32];
+	const uint8_t * K = (const uint8_t *)_K;
+	size_t i;
+
+	/* If Klen > 64, the key is really SHA256(K). */
+	if (Klen > 64) {
+		SHA256_Init(&ctx->ictx);
+		SHA256_Update(&ctx->ictx, K, Klen);
+		SHA256_Final(khash, &ctx->ictx);
+		K = khash;
+		Klen = 32;
+	}
+
+	/* Inner SHA256 operation is SHA256(K xor [block of 0x36] || data). */
+	SHA256_Init(&ctx->ictx);
+	memset(pad, 0x36, 64);
+	for (i = 0; i < Klen; i++)
+		pad[i] ^= K[i];
+	SHA256_Update(&ctx->ictx, pad, 64);
+
+	/* Outer SHA256 operation is SHA256(K xor [block of 0x5c] || hash). */
+	SHA256_Init(&ctx->octx);
+	memset(pad, 0x5c, 64);
+	for (i = 0; i < Klen; i++)
+		pad[i] ^= K[i];
+	SHA256_Update(&ctx->octx, pad, 64);
+}
+
+/**
+ * HMAC_SHA256_Update(ctx, in, len):
+ * Input len bytes from in into the HMAC-SHA256 context ctx.
+ */
+void HMAC_SHA256_Update(HMAC_SHA256_CTX * ctx, const void * in, size_t len)
+{
+	/* Feed data to the inner SHA256 operation. */
+	SHA256_Update(&ctx->ictx, in, len);
+}
+
+/**
+ * HMAC_SHA256_Final(digest, ctx):
+ * Output the HMAC-SHA256 of the data input to the context ctx into the
+ * buffer digest.
+ */
+void HMAC_SHA256_Final(uint8_t digest[32], HMAC_SHA256_CTX * ctx)
+{
+	uint8_t ihash[32];
+
+	/* Finish the inner SHA256 operation. */
+	SHA256_Final(ihash, &ctx->ictx);
+
+	/* Feed the inner hash to the outer SHA256 operation. */
+	SHA256_Update(&ctx->octx, ihash, 32);
+
+	/* Finish the outer SHA256 operation. */
+	SHA256_Final(digest, &ctx->octx);
+}
+
+/*
+ * Multi-buffer SHA256.
+ *
+ * Every PBKDF2 output block T_i only depends on the shared PS midstate and on
+ * the block index i, so the blocks can be computed side by side: lane j of
+ * each vector works on block i + j.  The round function is the same as in
+ * SHA256_Transform_scalar(), applied to vectors of L independent words.
+ */
+namespace {
+
+#if defined(__aarch64__)
+
+struct NeonLanes {
+	static constexpr size_t kLanes = 4;
+	using T = uint32x4_t;
+
+	static T Load(const uint32_t * p) { return vld1q_u32(p); }
+	static void Store(uint32_t * p, T a) { vst1q_u32(p, a); }
+	static T Set1(uint32_t x) { return vdupq_n_u32(x); }
+	static T Add(T a, T b) { return vaddq_u32(a, b); }
+	static T Xor(T a, T b) { return veorq_u32(a, b); }
+	static T And(T a, T b) { return vandq_u32(a, b); }
+	static T Or(T a, T b) { return vorrq_u32(a, b); }
+	template <int n> static T Shr(T a) { return vshrq_n_u32(a, n); }
+	template <int n> static T Rotr(T a) { return vsriq_n_u32(vshlq_n_u32(a, 32 - n), a, n); }
+};
+
+#elif defined(__x86_64__)
+
+struct Sse2Lanes {
+	static constexpr size_t kLanes = 4;
+	using T = __m128i;
+
+	static T Load(const uint32_t * p) { return _mm_load_si128((const __m128i *)p); }
+	static void Store(uint32_t * p, T a) { _mm_store_si128((__m128i *)p, a); }
+	static T Set1(uint32_t x) { return _mm_set1_epi32((int)x); }
+	static T Add(T a, T b) { return _mm_add_epi32(a, b); }
+	static T Xor(T a, T b) { return _mm_xor_si128(a, b); }
+	static T And(T a, T b) { return _mm_and_si128(a, b); }
+	static T Or(T a, T b) { return _mm_or_si128(a, b); }
+	template <int n> static T Shr(T a) { return _mm_srli_epi32(a, n); }
+	template <int n> static T Rotr(T a)
+	{
+		return _mm_or_si128(_mm_srli_epi32(a, n), _mm_slli_epi32(a, 32 - n));
+	}
+};
+
+struct Avx2Lanes {
+	static constexpr size_t kLanes = 8;
+	using T = __m256i;
+
+	__attribute__((target("avx2"), always_inline))
+	static T Load(const uint32_t * p) { return _mm256_load_si256((const __m256i *)p); }
+	__attribute__((target("avx2"), always_inline))
+	static void Store(uint32_t * p, T a) { _mm256_store_si256((__m256i *)p, a); }
+	__attribute__((target("avx2"), always_inline))
+	static T Set1(uint32_t x) { return _mm256_set1_epi32((int)x); }
+	__attribute__((target("avx2"), always_inline))
+	static T Add(T a, T b) { return _mm256_add_epi32(a, b); }
+	__attribute__((target("avx2"), always_inline))
+	static T Xor(T a, T b) { return _mm256_xor_si256(a, b); }
+	__attribute__((target("avx2"), always_inline))
+	static T And(T a, T b) { return _mm256_and_si256(a, b); }
+	__attribute__((target("avx2"), always_inline))
+	static T Or(T a, T b) { return _mm256_or_si256(a, b); }
+	template <int n> __attribute__((target("avx2"), always_inline))
+	static T Shr(T a) { return _mm256_srli_epi32(a, n); }
+	template <int n> __attribute__((target("avx2"), always_inline))
+	static T Rotr(T a)
+	{
+		return _mm256_or_si256(_mm256_srli_epi32(a, n), _mm256_slli_epi32(a, 32 - n));
+	}
+};
+
+#endif
+
+#include "kdf/pbkdf2_sha256_lanes.inc"
+
+#if defined(__aarch64__)
+
+void PBKDF2_SHA256_U1_neon(const HMAC_SHA256_CTX * PShctx, uint32_t i, uint8_t * out)
+{
+	PBKDF2_SHA256_U1_lanes<NeonLanes>(PShctx, i, out);
+}
+
+#elif defined(__x86_64__)
+
+void PBKDF2_SHA256_U1_sse2(const HMAC_SHA256_CTX * PShctx, uint32_t i, uint8_t * out)
+{
+	PBKDF2_SHA256_U1_lanes<Sse2Lanes>(PShctx, i, out);
+}
+
+/*
+ * The lane code is compiled a second time for AVX2: the instantiations for
+ * Avx2Lanes must themselves be AVX2 functions, to inline its helpers and to
+ * pass __m256i values around without depending on the default ABI.
+ */
+namespace avx2 {
+#if defined(__clang__)
+#pragma clang attribute push (__attribute__((target("avx2"))), apply_to = function)
+#else
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#endif
+
+#include "kdf/pbkdf2_sha256_lanes.inc"
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#else
+#pragma GCC pop_options
+#endif
+} // namespace avx2
+
+__attribute__((target("avx2")))
+void PBKDF2_SHA256_U1_avx2(const HMAC_SHA256_CTX * PShctx, uint32_t i, uint8_t * out)
+{
+	avx2::PBKDF2_SHA256_U1_lanes<Avx2Lanes>(PShctx, i, out);
+}
+
+#endif
+
+} // namespace
+
+/*
+ * Multi-buffer U_1 computation in use (see SelectPBKDF2Lanes()), and the number
+ * of blocks it computes per call.  Zero lanes means that only the serial path
+ * is used.
+ */
+static void (*PBKDF2_SHA256_U1_multi)(const HMAC_SHA256_CTX * PShctx, uint32_t i,
+    uint8_t * out) = nullptr;
+static size_t PBKDF2_SHA256_U1_multi_lanes = 0;
+const char* PBKDF2_SHA256_U1_multi_name = "none";
+
+// Picks a multi-buffer kernel for the PBKDF2 blocks, if one is faster than computing the blocks
+// one by one with the selected SHA256 block function. Four 32-bit lanes do not beat the SHA
+// instructions, eight (AVX2) do. Must be called after SelectSHA256Transform().
+void SelectPBKDF2Lanes() {
+  const bool has_sha_instructions = SHA256_Transform != SHA256_Transform_scalar;
+
+#if defined(__aarch64__)
+  if (!has_sha_instructions && (getauxval(AT_HWCAP) & HWCAP_ASIMD)) {
+    PBKDF2_SHA256_U1_multi = PBKDF2_SHA256_U1_neon;
+    PBKDF2_SHA256_U1_multi_lanes = NeonLanes::kLanes;
+    PBKDF2_SHA256_U1_multi_name = "neon";
+  }
+#elif defined(__x86_64__)
+  if (__builtin_cpu_supports("avx2")) {
+    PBKDF2_SHA256_U1_multi = PBKDF2_SHA256_U1_avx2;
+    PBKDF2_SHA256_U1_multi_lanes = Avx2Lanes::kLanes;
+    PBKDF2_SHA256_U1_multi_name = "avx2";
+  } else if (!has_sha_instructions) {
+    PBKDF2_SHA256_U1_multi = PBKDF2_SHA256_U1_sse2;
+    PBKDF2_SHA256_U1_multi_lanes = Sse2Lanes::kLanes;
+    PBKDF2_SHA256_U1_multi_name = "sse2";
+  }
+#endif
+}
+
+/**
+ * PBKDF2_SHA256_iterate(Phctx, T, c):
+ * Given T = U_1, compute T = U_1 xor U_2 xor ... xor U_c.  Every U_j is the
+ * HMAC of a 32-byte value, so both of its message blocks have a fixed layout:
+ * they are padded once, and each iteration is exactly two compressions
+ * starting from the ipad and opad midstates of Phctx.
+ */
+static void PBKDF2_SHA256_iterate(const HMAC_SHA256_CTX * Phctx, uint8_t T[32],
+    uint64_t c)
+{
+	uint8_t ibuf[64], obuf[64];
+	uint32_t state[8];
+	uint64_t j;
+	int k;
+
+	if (c < 2)
+		return;
+
+	/* Both messages are 32 bytes long and follow the 64-byte pad block. */
+	memcpy(ibuf, T, 32);
+	memcpy(&ibuf[32], PAD, 24);
+	be64enc(&ibuf[56], (64 + 32) << 3);
+	memcpy(&obuf[32], &ibuf[32], 32);
+
+	for (j = 2; j <= c; j++) {
+		/* Inner hash of U_{j-1}. */
+		memcpy(state, Phctx->ictx.state, sizeof(state));
+		SHA256_Transform(state, ibuf, 1);
+		be32enc_vect(obuf, state, 32);
+
+		/* U_j = outer hash of the inner hash, in place of U_{j-1}. */
+		memcpy(state, Phctx->octx.state, sizeof(state));
+		SHA256_Transform(state, obuf, 1);
+		be32enc_vect(ibuf, state, 32);
+
+		/* ... xor U_j ... */
+		for (k = 0; k < 32; k++)
+			T[k] ^= ibuf[k];
+	}
+}
+
+/**
+ * key_derivation_function(Phctx, salt, saltlen, c, buf, dkLen):
+ * Compute PBKDF2(passwd, salt, c, dkLen) using HMAC-SHA256 as the PRF, and
+ * write the output to buf.  Phctx is the HMAC key schedule of the password
+ * (see HMAC_SHA256_Init()), so that it can be computed once and shared between
+ * both passes of a derivation.  The value of dkLen must be at most 32 *
+ * (2^32 - 1), and c is treated as 1 if it is 0.
+ */
+void key_derivation_function(const HMAC_SHA256_CTX * Phctx, const uint8_t * salt,
+    size_t saltlen, uint64_t c, uint8_t * buf, size_t dkLen)
+{
+	HMAC_SHA256_CTX PShctx, hctx;
+	uint8_t ivec[4];
+	uint8_t T[32];
+	size_t i, l;
+	size_t clen;
+
+	assert(dkLen <= 32 * (size_t)(UINT32_MAX));
+
+	/* Compute HMAC state after processing P and S. */
+	memcpy(&PShctx, Phctx, sizeof(HMAC_SHA256_CTX));
+	HMAC_SHA256_Update(&PShctx, salt, saltlen);
+
+	/* Compute whole groups of blocks side by side, if we can. */
+	i = 0;
+	if (PBKDF2_SHA256_U1_multi_lanes != 0) {
+		const size_t L = PBKDF2_SHA256_U1_multi_lanes;
+		uint8_t Ts[8 * 32];
+
+		assert(L * 32 <= sizeof(Ts));
+		for (; (i + L) * 32 <= dkLen; i += L) {
+			/* T_i = U_1 ..., for blocks i + 1 to i + L. */
+			PBKDF2_SHA256_U1_multi(&PShctx, (uint32_t)(i + 1), Ts);
+			for (l = 0; l < L; l++)
+				PBKDF2_SHA256_iterate(Phctx, &Ts[l * 32], c);
+			memcpy(&buf[i * 32], Ts, L * 32);
+		}
+	}
+
+	/* Iterate through the remaining blocks. */
+	for (; i * 32 < dkLen; i++) {
+		/* Generate INT(i + 1). */
+		be32enc(ivec, (uint32_t)(i + 1));
+
+		/* Compute T_i = U_1 = PRF(P, S || INT(i)). */
+		memcpy(&hctx, &PShctx, sizeof(HMAC_SHA256_CTX));
+		HMAC_SHA256_Update(&hctx, ivec, 4);
+		HMAC_SHA256_Final(T, &hctx);
+
+		/* ... xor U_2 ... xor U_c. */
+		PBKDF2_SHA256_iterate(Phctx, T, c);
+
+		/* Copy as many bytes as necessary into buf. */
+		clen = dkLen - i * 32;
+		if (clen > 32)
+			clen = 32;
+		memcpy(&buf[i * 32], T, clen);
+	}
+}
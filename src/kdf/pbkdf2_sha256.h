@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2020 Arm Limited. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// PBKDF2-HMAC-SHA256 (RFC 2898), as used by scrypt's first and last passes. This is portable code
+// with no dependency on the compartment interface, so that it can be linked into Node A as well as
+// into host tools such as the benchmarks.
+
+typedef struct {
+	uint32_t state[8];
+	uint64_t count;
+	uint8_t buf[64];
+} SHA256_CTX;
+
+typedef struct {
+	SHA256_CTX ictx;
+	SHA256_CTX octx;
+} HMAC_SHA256_CTX;
+
+// Name of the SHA256 block function and of the multi-buffer PBKDF2 kernel picked by
+// SelectSHA256Transform() and SelectPBKDF2Lanes() ("none" if there is no multi-buffer kernel).
+extern const char* SHA256_Transform_name;
+extern const char* PBKDF2_SHA256_U1_multi_name;
+
+// Picks the fastest SHA256 block function the CPU supports, and checks it against the scalar one.
+// Must be called once, before any other function in this file.
+void SelectSHA256Transform();
+
+// Picks a multi-buffer kernel for the PBKDF2 blocks, if one is faster than computing the blocks
+// one by one. Must be called once, after SelectSHA256Transform().
+void SelectPBKDF2Lanes();
+
+void SHA256_Init(SHA256_CTX * ctx);
+void SHA256_Update(SHA256_CTX * ctx, const void * in, size_t len);
+void SHA256_Final(uint8_t digest[32], SHA256_CTX * ctx);
+
+void HMAC_SHA256_Init(HMAC_SHA256_CTX * ctx, const void * _K, size_t Klen);
+void HMAC_SHA256_Update(HMAC_SHA256_CTX * ctx, const void * in, size_t len);
+void HMAC_SHA256_Final(uint8_t digest[32], HMAC_SHA256_CTX * ctx);
+
+// Computes PBKDF2(passwd, salt, c, dkLen) into buf, where Phctx is the HMAC key schedule of the
+// password (see HMAC_SHA256_Init()).
+void key_derivation_function(const HMAC_SHA256_CTX * Phctx, const uint8_t * salt,
+    size_t saltlen, uint64_t c, uint8_t * buf, size_t dkLen);
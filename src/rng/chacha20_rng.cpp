@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2020 Arm Limited. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include "rng/chacha20_rng.h"
+
+#include <string.h>
+#include <sys/random.h>
+
+#include <algorithm>
+
+namespace {
+
+// "expand 32-byte k"
+constexpr uint32_t kSigma[4] = {0x61707865, 0x3320646e, 0x79622d32, 0x6b206574};
+
+inline uint32_t Rotl(uint32_t x, int n) {
+  return (x << n) | (x >> (32 - n));
+}
+
+inline void QuarterRound(uint32_t& a, uint32_t& b, uint32_t& c, uint32_t& d) {
+  a += b; d ^= a; d = Rotl(d, 16);
+  c += d; b ^= c; b = Rotl(b, 12);
+  a += b; d ^= a; d = Rotl(d, 8);
+  c += d; b ^= c; b = Rotl(b, 7);
+}
+
+inline uint32_t Load32Le(const uint8_t* p) {
+  return uint32_t{p[0]} | (uint32_t{p[1]} << 8) | (uint32_t{p[2]} << 16) | (uint32_t{p[3]} << 24);
+}
+
+inline void Store32Le(uint8_t* p, uint32_t x) {
+  p[0] = x & 0xff;
+  p[1] = (x >> 8) & 0xff;
+  p[2] = (x >> 16) & 0xff;
+  p[3] = x >> 24;
+}
+
+// memset() that the compiler cannot elide, for wiping secrets.
+void Wipe(void* buf, size_t len) {
+  memset(buf, 0, len);
+  asm volatile("" : : "r"(buf) : "memory");
+}
+
+// Fills buf entirely from getrandom(), which may return fewer bytes than requested.
+bool GetSystemEntropy(uint8_t* buf, size_t len) {
+  while (len > 0) {
+    ssize_t ret = getrandom(buf, len, 0);
+    if (ret < 0)
+      return false;
+    buf += ret;
+    len -= ret;
+  }
+  return true;
+}
+
+}
+
+void ChaCha20Block(const uint32_t input[16], uint8_t out[64]) {
+  uint32_t x[16];
+  memcpy(x, input, sizeof(x));
+  for (int i = 0; i < 10; ++i) {
+    // Column rounds.
+    QuarterRound(x[0], x[4], x[8], x[12]);
+    QuarterRound(x[1], x[5], x[9], x[13]);
+    QuarterRound(x[2], x[6], x[10], x[14]);
+    QuarterRound(x[3], x[7], x[11], x[15]);
+    // Diagonal rounds.
+    QuarterRound(x[0], x[5], x[10], x[15]);
+    QuarterRound(x[1], x[6], x[11], x[12]);
+    QuarterRound(x[2], x[7], x[8], x[13]);
+    QuarterRound(x[3], x[4], x[9], x[14]);
+  }
+  for (int i = 0; i < 16; ++i)
+    Store32Le(out + 4 * i, x[i] + input[i]);
+  Wipe(x, sizeof(x));
+}
+
+bool ChaCha20SelfTest() {
+  // RFC 8439, section 2.3.2: key 00:01:...:1f, block counter 1, nonce
+  // 00:00:00:09:00:00:00:4a:00:00:00:00.
+  uint32_t input[16] = {kSigma[0], kSigma[1], kSigma[2], kSigma[3]};
+  for (int i = 0; i < 8; ++i)
+    input[4 + i] = 0x03020100 + 0x04040404 * i;
+  input[12] = 1;
+  input[13] = 0x09000000;
+  input[14] = 0x4a000000;
+  input[15] = 0;
+  static const uint8_t expected[64] = {
+    0x10, 0xf1, 0xe7, 0xe4, 0xd1, 0x3b, 0x59, 0x15, 0x50, 0x0f, 0xdd, 0x1f, 0xa3, 0x20, 0x71, 0xc4,
+    0xc7, 0xd1, 0xf4, 0xc7, 0x33, 0xc0, 0x68, 0x03, 0x04, 0x22, 0xaa, 0x9a, 0xc3, 0xd4, 0x6c, 0x4e,
+    0xd2, 0x82, 0x64, 0x46, 0x07, 0x9f, 0xaa, 0x09, 0x14, 0xc2, 0xd7, 0x05, 0xd9, 0x8b, 0x02, 0xa2,
+    0xb5, 0x12, 0x9c, 0xd1, 0xde, 0x16, 0x4e, 0xb9, 0xcb, 0xd0, 0x83, 0xe8, 0xa2, 0x50, 0x3c, 0x4e,
+  };
+  uint8_t out[64];
+  ChaCha20Block(input, out);
+  return memcmp(out, expected, sizeof(out)) == 0;
+}
+
+ChaCha20Rng::~ChaCha20Rng() {
+  Wipe(state_, sizeof(state_));
+  Wipe(buffer_, sizeof(buffer_));
+}
+
+bool ChaCha20Rng::Seed() {
+  uint8_t seed[kSeedSize];
+  if (!GetSystemEntropy(seed, sizeof(seed)))
+    return false;
+  memcpy(state_, kSigma, sizeof(kSigma));
+  Rekey(seed);
+  Wipe(seed, sizeof(seed));
+  Wipe(buffer_, sizeof(buffer_));
+  available_ = 0;
+  output_since_reseed_ = 0;
+  return true;
+}
+
+void ChaCha20Rng::Rekey(const uint8_t seed[kSeedSize]) {
+  for (int i = 0; i < 8; ++i)
+    state_[4 + i] = Load32Le(seed + 4 * i);
+  state_[12] = 0;
+  state_[13] = 0;
+  state_[14] = Load32Le(seed + 32);
+  state_[15] = Load32Le(seed + 36);
+}
+
+void ChaCha20Rng::Refill() {
+  if (output_since_reseed_ >= kReseedInterval) {
+    // Mix fresh system entropy into the key and nonce. On failure, the next refill tries again.
+    uint8_t entropy[kSeedSize];
+    if (GetSystemEntropy(entropy, sizeof(entropy))) {
+      for (int i = 0; i < 8; ++i)
+        state_[4 + i] ^= Load32Le(entropy + 4 * i);
+      state_[14] ^= Load32Le(entropy + 32);
+      state_[15] ^= Load32Le(entropy + 36);
+      output_since_reseed_ = 0;
+    }
+    Wipe(entropy, sizeof(entropy));
+  }
+
+  for (size_t i = 0; i < kBufferSize; i += 64) {
+    ChaCha20Block(state_, buffer_ + i);
+    if (++state_[12] == 0)
+      ++state_[13];
+  }
+  // Fast key erasure: the first kSeedSize bytes of output become the next key and nonce, and are
+  // never handed out.
+  Rekey(buffer_);
+  Wipe(buffer_, kSeedSize);
+  available_ = kBufferSize - kSeedSize;
+}
+
+void ChaCha20Rng::Generate(void* buf, size_t len) {
+  uint8_t* out = static_cast<uint8_t*>(buf);
+  while (len > 0) {
+    if (available_ == 0)
+      Refill();
+    size_t n = std::min(len, available_);
+    uint8_t* src = buffer_ + kBufferSize - available_;
+    memcpy(out, src, n);
+    Wipe(src, n);
+    out += n;
+    len -= n;
+    available_ -= n;
+    output_since_reseed_ += n;
+  }
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2020 Arm Limited. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Userspace CSPRNG based on the ChaCha20 block function (RFC 8439), in the manner of OpenBSD's
+// arc4random(): the keystream is generated a buffer at a time, and the start of each buffer
+// immediately replaces the key ("fast key erasure"), so that earlier output cannot be recovered
+// from the state. Output is wiped from the buffer as it is handed out. The key is seeded from
+// getrandom(), and more system entropy is mixed in every kReseedInterval bytes, so a stream of
+// random bytes costs one syscall per kReseedInterval bytes instead of one per request.
+//
+// This is portable code with no dependency on the compartment interface. Not thread-safe.
+class ChaCha20Rng {
+ public:
+  // Bytes of system entropy used for seeding: a 256-bit key and a 64-bit nonce.
+  static constexpr size_t kSeedSize = 40;
+  // Keystream generated per refill of the internal buffer.
+  static constexpr size_t kBufferSize = 16 * 64;
+  // Output after which system entropy is mixed in again.
+  static constexpr uint64_t kReseedInterval = 1600 * 1024;
+
+  ChaCha20Rng() = default;
+  ~ChaCha20Rng();
+  ChaCha20Rng(const ChaCha20Rng&) = delete;
+  ChaCha20Rng& operator=(const ChaCha20Rng&) = delete;
+
+  // Seeds the generator from getrandom(), discarding any previous state. Returns false if
+  // getrandom() failed, in which case the generator must not be used.
+  bool Seed();
+
+  // Fills buf with len random bytes. Must only be called once Seed() succeeded. If reseeding fails,
+  // the generator keeps running from its current (still secret) state, and tries again on the next
+  // refill.
+  void Generate(void* buf, size_t len);
+
+ private:
+  void Refill();
+  void Rekey(const uint8_t seed[kSeedSize]);
+
+  // ChaCha20 input block: constants, key, 64-bit block counter and 64-bit nonce.
+  uint32_t state_[16] = {};
+  uint8_t buffer_[kBufferSize] = {};
+  // Unused output, at the end of buffer_.
+  size_t available_ = 0;
+  uint64_t output_since_reseed_ = 0;
+};
+
+// Computes the ChaCha20 block (20 rounds and feed-forward) of the 16-word input into out.
+void ChaCha20Block(const uint32_t input[16], uint8_t out[64]);
+
+// Checks ChaCha20Block() against the test vector of RFC 8439, section 2.3.2.
+bool ChaCha20SelfTest();
@@ -0,0 +1,152 @@
+/*
+ * Copyright (c) 2020 Arm Limited. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+// Checks a channel between two compartments (see compartments/compartment_channel.h), with the
+// producer and consumer compartments of compartments/channel_peer.cpp. The ring is filled until it
+// is full, drained until it is empty, and both ends then go around it many times with varying
+// numbers of messages, so that the slot indices wrap around at every possible position. Every
+// message is checked by the consumer. Exits with status 0 if all checks pass.
+//
+// Like switch_benchmark.cpp, this file is built in two flavours: channel-test
+// (CHANNEL_TEST_COMPARTMENTS defined, Morello only) loads the compartments, and
+// channel_test_in_process links them in-process, which also builds and runs on the host.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <iostream>
+#include <string>
+
+#include <archcap.h>
+
+#include "compartment_interface.h"
+#include "compartments/protocol.h"
+
+#if defined(CHANNEL_TEST_COMPARTMENTS)
+#include "compartment-manager/compartment_config.h"
+#include "compartment-manager/compartment_manager.h"
+#else
+#include "compartments/compartment_in_process.h"
+
+DECLARE_IN_PROCESS_COMPARTMENT(channel_producer_entry, channel_producer_main);
+DECLARE_IN_PROCESS_COMPARTMENT(channel_consumer_entry, channel_consumer_main);
+#endif
+
+namespace {
+
+// Small, so that the ring is often full and the indices wrap around often.
+constexpr size_t kSlotCount = 8;
+constexpr size_t kRounds = 10000;
+
+#if defined(CHANNEL_TEST_COMPARTMENTS)
+
+bool SetupCompartments(const std::string& dirname) {
+  CompartmentManagerInit();
+  CompartmentAdd(kChannelProducerCompartmentId, dirname + "compartments/channel_producer", {},
+                 kCompartmentMemoryRangeLength);
+  CompartmentAdd(kChannelConsumerCompartmentId, dirname + "compartments/channel_consumer", {},
+                 kCompartmentMemoryRangeLength);
+  CompartmentConnectChannel(kChannelProducerCompartmentId, kChannelConsumerCompartmentId,
+                            kChannelTestChannel, sizeof(ChannelTestMessage), kSlotCount);
+  return true;
+}
+
+#else
+
+bool SetupCompartments(const std::string&) {
+  return InProcessCompartmentAdd(kChannelProducerCompartmentId, "channel_producer",
+                                 channel_producer_main, channel_producer_entry) &&
+         InProcessCompartmentAdd(kChannelConsumerCompartmentId, "channel_consumer",
+                                 channel_consumer_main, channel_consumer_entry) &&
+         InProcessCompartmentConnectChannel(kChannelProducerCompartmentId,
+                                            kChannelConsumerCompartmentId, kChannelTestChannel,
+                                            sizeof(ChannelTestMessage), kSlotCount);
+}
+
+#endif
+
+// Mirrors the state of the ring, to know how many messages each call should handle.
+class ChannelTest {
+ public:
+  // Asks the producer to enqueue count messages, and checks how many it did.
+  bool Produce(size_t count) {
+    size_t expected = std::min(count, kSlotCount - (produced_ - consumed_));
+    uintcap_t ret = CompartmentCall(kChannelProducerCompartmentId, produced_, count);
+    produced_ += expected;
+    return Check("enqueue", count, ret, expected);
+  }
+
+  // Asks the consumer to dequeue count messages, and checks how many it did. The consumer checks
+  // the messages themselves.
+  bool Consume(size_t count) {
+    size_t expected = std::min(count, static_cast<size_t>(produced_ - consumed_));
+    uintcap_t ret = CompartmentCall(kChannelConsumerCompartmentId, consumed_, count);
+    consumed_ += expected;
+    return Check("dequeue", count, ret, expected);
+  }
+
+ private:
+  bool Check(const char* operation, size_t count, uintcap_t ret, size_t expected) {
+    if (ret == expected)
+      return true;
+    std::cerr << "Failed to " << operation << " " << count << " messages after "
+              << produced_ << " enqueued and " << consumed_ << " dequeued: got "
+              << static_cast<int64_t>(ret) << ", expected " << expected << "\n";
+    return false;
+  }
+
+  uint64_t produced_ = 0;
+  uint64_t consumed_ = 0;
+};
+
+bool RunTest() {
+  ChannelTest test;
+
+  // Full ring: the producer stops at kSlotCount messages, and cannot enqueue any more until the
+  // consumer dequeues some.
+  if (!test.Produce(kSlotCount + 3) || !test.Produce(1))
+    return false;
+  // Drain part of the ring, refill it: the new messages wrap around to the first slots.
+  if (!test.Consume(3) || !test.Produce(kSlotCount) || !test.Produce(1))
+    return false;
+  // Empty ring: the consumer stops at the last message, and cannot dequeue any more.
+  if (!test.Consume(kSlotCount + 3) || !test.Consume(1))
+    return false;
+
+  // Go around the ring with pseudo-random numbers of messages, from 0 to 2 * kSlotCount, so that
+  // the ring is in turn empty, partially filled and full at every slot index.
+  uint32_t state = 1;
+  auto next_count = [&] {
+    state = state * 1103515245 + 12345;
+    return (state >> 16) % (2 * kSlotCount + 1);
+  };
+  for (size_t round = 0; round < kRounds; ++round) {
+    if (!test.Produce(next_count()) || !test.Consume(next_count()))
+      return false;
+  }
+  return test.Consume(kSlotCount);
+}
+
+}
+
+int main(int, char** argv) {
+  // Get our dirname (see compartment-manager/main.cpp).
+  std::string dirname{argv[0]};
+  size_t pos = dirname.find_last_of('/');
+  dirname.erase(pos == std::string::npos ? 0 : pos + 1);
+
+  if (!SetupCompartments(dirname)) {
+    std::cerr << "Failed to set up the compartments\n";
+    return 1;
+  }
+
+  if (!RunTest()) {
+    std::cerr << "Channel test FAILED\n";
+    return 1;
+  }
+  std::cout << "Channel test passed" << std::endl;
+  return 0;
+}